@@ -1,27 +1,68 @@
 #include "apic.h"
+#include "cpu.h"
 #include "io.h"
+#include "syscall.h"
 #include <stddef.h>
 
 #define PIT_FREQ 1193182
 
 static void *g_lapic_base = NULL;
+static int g_x2apic = 0;
+static uint64_t g_tsc_hz = 0;
+
+static inline void x2apic_write(uint32_t reg, uint64_t val) {
+  asm volatile("wrmsr"
+               :
+               : "c"(X2APIC_MSR(reg)), "a"((uint32_t)val),
+                 "d"((uint32_t)(val >> 32))
+               : "memory");
+}
+
+static inline uint32_t x2apic_read(uint32_t reg) {
+  uint32_t low, high;
+  asm volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(X2APIC_MSR(reg)));
+  return low;
+}
 
+// Same register offsets in both modes; x2APIC turns each into an MSR
 static void lapic_write(uint32_t reg, uint32_t val) {
-  *(volatile uint32_t *)((uint8_t *)g_lapic_base + reg) = val;
+  if (g_x2apic)
+    x2apic_write(reg, val);
+  else
+    *(volatile uint32_t *)((uint8_t *)g_lapic_base + reg) = val;
 }
 
 static uint32_t lapic_read(uint32_t reg) {
+  if (g_x2apic)
+    return x2apic_read(reg);
   return *(volatile uint32_t *)((uint8_t *)g_lapic_base + reg);
 }
 
-void LAPIC_Init(void *base) {
+static int x2apic_supported(void) {
+  uint32_t eax, ebx, ecx, edx;
+  asm volatile("cpuid"
+               : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+               : "a"(1), "c"(0));
+  return (ecx & CPUID_1_ECX_X2APIC) != 0;
+}
+
+void LAPIC_Init(void *base, int allow_x2apic) {
   g_lapic_base = base;
 
   // 1. Disable legacy PIC
   outb(0xA1, 0xFF);
   outb(0x21, 0xFF);
 
-  // 2. Set Spurious Interrupt Vector Register
+  // 2. Pick the access mode. Firmware may already have switched to x2APIC;
+  // leaving it again would mean disabling the APIC, so we stay there.
+  uint64_t apic_base = MSR_Read(MSR_APIC_BASE);
+  if ((apic_base & APIC_BASE_EXTD) ||
+      (allow_x2apic && x2apic_supported())) {
+    MSR_Write(MSR_APIC_BASE, apic_base | APIC_BASE_ENABLE | APIC_BASE_EXTD);
+    g_x2apic = 1;
+  }
+
+  // 3. Set Spurious Interrupt Vector Register
   // Enable APIC by setting bit 8 and set spurious vector to 0xFF
   lapic_write(LAPIC_REG_SIVR, lapic_read(LAPIC_REG_SIVR) | 0x1FF);
 }
@@ -49,9 +90,11 @@ uint32_t LAPIC_CalibrateTimer() {
   lapic_write(LAPIC_REG_TDCR, 0x3);        // Div 16
   lapic_write(LAPIC_REG_TICR, 0xFFFFFFFF); // Start value
 
+  uint64_t tsc_start = Cpu_ReadTSC();
   pit_delay(10); // Wait 10ms
 
   uint32_t current = lapic_read(LAPIC_REG_TCCR);
+  g_tsc_hz = (Cpu_ReadTSC() - tsc_start) * 100; // The TSC over the same 10ms
   uint32_t ticks = 0xFFFFFFFF - current;
 
   lapic_write(LAPIC_REG_TICR, 0); // Stop timer
@@ -69,4 +112,37 @@ void LAPIC_TimerInit(uint32_t count) {
   lapic_write(LAPIC_REG_TICR, count);
 }
 
-void LAPIC_SendEOI(void) { lapic_write(LAPIC_REG_EOI, 0); }
+void LAPIC_SendEOI(void) {
+  if (g_x2apic)
+    x2apic_write(LAPIC_REG_EOI, 0); // No uncached MMIO on the IRQ path
+  else
+    *(volatile uint32_t *)((uint8_t *)g_lapic_base + LAPIC_REG_EOI) = 0;
+}
+
+void LAPIC_SendIPI(uint32_t apic_id, uint8_t vector) {
+  if (g_x2apic) {
+    // WRMSR to the ICR is not serializing: make earlier stores visible to
+    // the target before the IPI
+    asm volatile("mfence; lfence" ::: "memory");
+    x2apic_write(LAPIC_REG_ICR_LOW, ((uint64_t)apic_id << 32) | vector);
+    return;
+  }
+
+  uint64_t flags = Cpu_IrqSave();
+  while (lapic_read(LAPIC_REG_ICR_LOW) & LAPIC_ICR_PENDING)
+    Cpu_Pause();
+  lapic_write(LAPIC_REG_ICR_HIGH, apic_id << 24);
+  lapic_write(LAPIC_REG_ICR_LOW, vector); // Fixed, physical: sends it
+  Cpu_IrqRestore(flags);
+}
+
+uint32_t LAPIC_GetId(void) {
+  // 32-bit ID in x2APIC mode, bits 31:24 in xAPIC mode
+  if (g_x2apic)
+    return lapic_read(LAPIC_REG_ID);
+  return lapic_read(LAPIC_REG_ID) >> 24;
+}
+
+int LAPIC_IsX2Apic(void) { return g_x2apic; }
+
+uint64_t LAPIC_GetTscFrequency(void) { return g_tsc_hz; }
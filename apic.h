@@ -11,6 +11,8 @@
 #define LAPIC_REG_DFR 0x00E0
 #define LAPIC_REG_SIVR 0x00F0
 #define LAPIC_REG_ESR 0x0280
+#define LAPIC_REG_ICR_LOW 0x0300
+#define LAPIC_REG_ICR_HIGH 0x0310 // xAPIC only; one 64-bit MSR in x2APIC
 #define LAPIC_REG_LVT_TIMER 0x0320
 #define LAPIC_REG_LVT_THERMAL 0x0330
 #define LAPIC_REG_LVT_PERF 0x0340
@@ -25,9 +27,27 @@
 #define LAPIC_TIMER_ONESHOT 0x00000000
 #define LAPIC_TIMER_MASKED 0x00010000
 
-void LAPIC_Init(void *base);
+#define LAPIC_ICR_PENDING (1 << 12) // Delivery status (xAPIC)
+
+// x2APIC: the same registers as MSRs 0x800 + offset / 16
+#define MSR_APIC_BASE 0x1B
+#define APIC_BASE_EXTD (1ULL << 10) // x2APIC mode
+#define APIC_BASE_ENABLE (1ULL << 11)
+#define CPUID_1_ECX_X2APIC (1 << 21)
+#define X2APIC_MSR(reg) (0x800 + ((reg) >> 4))
+
+// Enables the local APIC, in x2APIC mode (MSR access) if the CPU supports it
+// and 'allow_x2apic' is set; otherwise through the MMIO window at 'base'.
+void LAPIC_Init(void *base, int allow_x2apic);
 uint32_t LAPIC_CalibrateTimer();
 void LAPIC_TimerInit(uint32_t count);
 void LAPIC_SendEOI(void);
+// Fixed-delivery IPI of 'vector' to the CPU with local APIC ID 'apic_id'
+void LAPIC_SendIPI(uint32_t apic_id, uint8_t vector);
+// This CPU's local APIC ID (32 bits wide in x2APIC mode)
+uint32_t LAPIC_GetId(void);
+int LAPIC_IsX2Apic(void);
+// TSC frequency in Hz, measured by LAPIC_CalibrateTimer (0 before that)
+uint64_t LAPIC_GetTscFrequency(void);
 
 #endif
@@ -0,0 +1,635 @@
+#include "bcache.h"
+#include "cpu.h"
+#include "libc.h"
+#include "memory.h"
+#include "schedule.h"
+#include "spinlock.h"
+#include "usercopy.h"
+#include <stddef.h>
+
+static BCache_Buffer *buffers; // stats.MaxBuffers headers
+static BCache_Buffer *hash_table[BCACHE_HASH_BUCKETS];
+static uint32_t clock_hand = 0;
+static uint32_t lba_size = 0; // 0 until BCache_Init
+static BCache_Stats stats;
+
+// A reader going through the disk in order
+typedef struct {
+  uint32_t Nsid;
+  uint64_t Next;   // Block after the last one the stream read
+  uint64_t Ahead;  // Readahead has been issued up to here
+  uint32_t Window; // Blocks to keep ahead of the reader, 0 until sequential
+  uint64_t LastUse;
+} BCache_Stream;
+
+static BCache_Stream streams[BCACHE_RA_STREAMS];
+static uint64_t stream_clock = 0;
+
+// Buffers for one readahead command, contiguous on disk
+typedef struct {
+  NVMe_Request Req;
+  uint32_t Count;
+  BCache_Buffer *Bufs[BCACHE_RA_BATCH_BLOCKS];
+  NVMe_IoVec Iov[BCACHE_RA_BATCH_BLOCKS];
+} BCache_Batch;
+
+static BCache_Batch batches[BCACHE_RA_BATCHES];
+static uint32_t batch_free = (1u << BCACHE_RA_BATCHES) - 1;
+
+// Protects the hash table, buffer flags and counts, and buffer data while it
+// is copied. Taken from NVMe completion callbacks, so always IrqSave. Never
+// held across an NVMe submission: a full queue reaps completions, whose
+// callbacks take this lock.
+static LockClass bcache_class = LOCK_CLASS_INIT("bcache");
+static Spinlock bcache_lock = SPINLOCK_INIT(&bcache_class);
+
+static uint32_t BCache_Hash(uint32_t nsid, uint64_t block) {
+  uint64_t h = (block ^ ((uint64_t)nsid << 40)) * 0x9E3779B97F4A7C15ULL;
+  return (uint32_t)(h >> 32) % BCACHE_HASH_BUCKETS;
+}
+
+static BCache_Buffer *BCache_Find(uint32_t nsid, uint64_t block) {
+  BCache_Buffer *b = hash_table[BCache_Hash(nsid, block)];
+  for (; b; b = b->HashNext) {
+    if (b->Nsid == nsid && b->Block == block && !(b->Flags & BCACHE_STALE))
+      return b;
+  }
+  return NULL;
+}
+
+static void BCache_HashInsert(BCache_Buffer *b) {
+  uint32_t h = BCache_Hash(b->Nsid, b->Block);
+  b->HashNext = hash_table[h];
+  hash_table[h] = b;
+  b->Flags |= BCACHE_HASHED;
+}
+
+static void BCache_HashRemove(BCache_Buffer *b) {
+  if (!(b->Flags & BCACHE_HASHED))
+    return;
+  BCache_Buffer **link = &hash_table[BCache_Hash(b->Nsid, b->Block)];
+  while (*link && *link != b)
+    link = &(*link)->HashNext;
+  if (*link)
+    *link = b->HashNext;
+  b->HashNext = NULL;
+  b->Flags &= ~BCACHE_HASHED;
+}
+
+static void BCache_SetDirty(BCache_Buffer *b) {
+  if (!(b->Flags & BCACHE_DIRTY)) {
+    b->Flags |= BCACHE_DIRTY;
+    stats.DirtyBuffers++;
+  }
+}
+
+static void BCache_ClearDirty(BCache_Buffer *b) {
+  if (b->Flags & BCACHE_DIRTY) {
+    b->Flags &= ~BCACHE_DIRTY;
+    stats.DirtyBuffers--;
+  }
+}
+
+// Forgets an unpinned buffer's block, unwritten changes included
+static void BCache_Drop(BCache_Buffer *b) {
+  BCache_HashRemove(b);
+  BCache_ClearDirty(b);
+  b->Flags = 0;
+  b->Referenced = 0;
+  stats.Invalidations++;
+}
+
+// Ends the fill or write-back of 'b', with the lock held
+static void BCache_Complete(BCache_Buffer *b, uint16_t status) {
+  b->Error = status != 0;
+  if (b->Error)
+    stats.Errors++;
+  if (b->Flags & BCACHE_WRITING) {
+    if (b->Error)
+      BCache_SetDirty(b);
+    else
+      stats.Writebacks++;
+  } else if (!b->Error) {
+    b->Flags |= BCACHE_VALID;
+  }
+  b->Flags &= ~BCACHE_BUSY;
+
+  // Readahead has no caller waiting to drop the pin
+  if (b->Flags & BCACHE_ASYNC) {
+    b->Flags &= ~BCACHE_ASYNC;
+    if (--b->RefCount == 0 && (b->Flags & BCACHE_STALE))
+      BCache_Drop(b);
+  }
+}
+
+// Runs in whatever context reaped the completion; see NVMe_Callback
+static void BCache_IoDone(NVMe_Request *req, void *arg) {
+  uint64_t flags = Spinlock_LockIrqSave(&bcache_lock);
+  BCache_Complete((BCache_Buffer *)arg, req->Status);
+  Spinlock_UnlockIrqRestore(&bcache_lock, flags);
+}
+
+// Submits the fill or write-back marked in b->Flags. Called without the
+// lock, on a buffer pinned by the caller.
+static void BCache_StartIo(BCache_Buffer *b) {
+  uint32_t count = BCACHE_BLOCK_SIZE / lba_size;
+  uint64_t lba = b->Block * count;
+  int ret;
+  if (b->Flags & BCACHE_WRITING)
+    ret = NVMe_SubmitWrite(b->Nsid, lba, b->Data, count, &b->Req,
+                           BCache_IoDone, b);
+  else
+    ret = NVMe_SubmitRead(b->Nsid, lba, b->Data, count, &b->Req,
+                          BCache_IoDone, b);
+  if (ret != 0) {
+    // Never reached the device; complete it here as failed
+    b->Req.Status = 1;
+    BCache_IoDone(&b->Req, b);
+  }
+}
+
+// Waits until the pinned buffer 'b' is idle. Entered and left holding the
+// lock; '*flags' is the interrupt state it was taken with. Syscall handlers
+// cannot sleep, so they reap their CPU's queue themselves.
+static void BCache_WaitIdle(BCache_Buffer *b, uint64_t *flags) {
+  while (b->Flags & BCACHE_BUSY) {
+    Spinlock_UnlockIrqRestore(&bcache_lock, *flags);
+    NVMe_Poll();
+    if (Scheduler_CanSleep())
+      Scheduler_Yield();
+    else
+      Cpu_Pause();
+    *flags = Spinlock_LockIrqSave(&bcache_lock);
+  }
+}
+
+// Starts I/O on the pinned buffer 'b' and waits for it, with the lock held
+// on entry and exit
+static void BCache_DoIo(BCache_Buffer *b, uint32_t op, uint64_t *flags) {
+  b->Flags |= op;
+  Spinlock_UnlockIrqRestore(&bcache_lock, *flags);
+  BCache_StartIo(b);
+  *flags = Spinlock_LockIrqSave(&bcache_lock);
+  BCache_WaitIdle(b, flags);
+}
+
+// A buffer to reuse: a fresh one while the budget allows, else the CLOCK
+// victim. Two turns of the hand are enough to clear every referenced bit.
+static BCache_Buffer *BCache_Victim(void) {
+  if (stats.Buffers < stats.MaxBuffers) {
+    uint8_t *data = PageAllocator_Alloc(1);
+    if (data) {
+      BCache_Buffer *b = &buffers[stats.Buffers++];
+      b->Data = data;
+      return b;
+    }
+  }
+  for (uint32_t i = 0; i < 2 * stats.Buffers; i++) {
+    BCache_Buffer *b = &buffers[clock_hand];
+    clock_hand = (clock_hand + 1) % stats.Buffers;
+    if (b->RefCount || (b->Flags & BCACHE_BUSY))
+      continue;
+    if (b->Referenced) {
+      b->Referenced = 0;
+      continue;
+    }
+    return b;
+  }
+  return NULL;
+}
+
+// Moves an unpinned, idle, clean buffer over to 'block' of 'nsid'
+static void BCache_Recycle(BCache_Buffer *b, uint32_t nsid, uint64_t block) {
+  if (b->Flags & BCACHE_VALID)
+    stats.Evictions++;
+  if (b->Flags & BCACHE_READAHEAD)
+    stats.ReadaheadWasted++;
+  BCache_HashRemove(b);
+  b->Nsid = nsid;
+  b->Block = block;
+  b->Flags = 0;
+  BCache_HashInsert(b);
+}
+
+// Pins the buffer for 'block', reading it in if 'fill' is set. Without
+// 'fill' the buffer may come back invalid and marked READING, for a caller
+// that overwrites all of it with BCache_CopyBlock.
+static BCache_Buffer *BCache_Lookup(uint32_t nsid, uint64_t block, int fill) {
+  uint64_t flags = Spinlock_LockIrqSave(&bcache_lock);
+  BCache_Buffer *b;
+  for (;;) {
+    b = BCache_Find(nsid, block);
+    if (b) {
+      b->RefCount++;
+      b->Referenced = 1;
+      stats.Hits++;
+      if (b->Flags & BCACHE_READAHEAD) {
+        b->Flags &= ~BCACHE_READAHEAD;
+        stats.ReadaheadHits++;
+      }
+      BCache_WaitIdle(b, &flags);
+      // An earlier fill failed: try again
+      if (fill && !(b->Flags & BCACHE_VALID))
+        BCache_DoIo(b, BCACHE_READING, &flags);
+      break;
+    }
+
+    b = BCache_Victim();
+    if (!b) {
+      Spinlock_UnlockIrqRestore(&bcache_lock, flags);
+      return NULL;
+    }
+    if (b->Flags & BCACHE_DIRTY) {
+      // Write it back and start over: someone else may have brought the
+      // block in meanwhile
+      b->RefCount++;
+      BCache_ClearDirty(b);
+      BCache_DoIo(b, BCACHE_WRITING, &flags);
+      b->RefCount--;
+      if (b->Flags & BCACHE_DIRTY) {
+        // The write failed and would be picked again
+        Spinlock_UnlockIrqRestore(&bcache_lock, flags);
+        return NULL;
+      }
+      continue;
+    }
+
+    BCache_Recycle(b, nsid, block);
+    b->RefCount = 1;
+    b->Referenced = 1;
+    stats.Misses++;
+    if (fill)
+      BCache_DoIo(b, BCACHE_READING, &flags);
+    break;
+  }
+
+  if (!(b->Flags & BCACHE_VALID)) {
+    if (fill) {
+      b->RefCount--;
+      b = NULL;
+    } else {
+      // The caller fills it in (BCache_CopyBlock); others wait for that
+      b->Flags |= BCACHE_READING;
+    }
+  }
+  Spinlock_UnlockIrqRestore(&bcache_lock, flags);
+  return b;
+}
+
+// --- Readahead ---
+
+static void BCache_BatchDone(NVMe_Request *req, void *arg) {
+  BCache_Batch *batch = (BCache_Batch *)arg;
+  uint64_t flags = Spinlock_LockIrqSave(&bcache_lock);
+  for (uint32_t i = 0; i < batch->Count; i++)
+    BCache_Complete(batch->Bufs[i], req->Status);
+  batch_free |= 1u << (batch - batches);
+  Spinlock_UnlockIrqRestore(&bcache_lock, flags);
+}
+
+// Reads the batch in with one command. Called without the lock.
+static void BCache_BatchSubmit(uint32_t nsid, BCache_Batch *batch) {
+  uint32_t per_block = BCACHE_BLOCK_SIZE / lba_size;
+  for (uint32_t i = 0; i < batch->Count; i++) {
+    batch->Iov[i].Base = batch->Bufs[i]->Data;
+    batch->Iov[i].Length = BCACHE_BLOCK_SIZE;
+  }
+  if (NVMe_SubmitReadV(nsid, batch->Bufs[0]->Block * per_block, batch->Iov,
+                       (int)batch->Count, &batch->Req, BCache_BatchDone,
+                       batch) != 0) {
+    batch->Req.Status = 1;
+    BCache_BatchDone(&batch->Req, batch);
+  }
+}
+
+// Starts reading blocks [from, to) of 'nsid' that are not cached yet,
+// without waiting. Stops early rather than block: when no clean buffer is
+// free or every batch is in flight. Entered and left holding the lock.
+static void BCache_Readahead(uint32_t nsid, uint64_t from, uint64_t to,
+                             uint64_t *flags) {
+  uint32_t max = NVMe_GetMaxTransfer() / BCACHE_BLOCK_SIZE;
+  if (max > BCACHE_RA_BATCH_BLOCKS)
+    max = BCACHE_RA_BATCH_BLOCKS;
+  if (max == 0)
+    max = 1;
+
+  BCache_Batch *batch = NULL;
+  for (uint64_t block = from; block < to; block++) {
+    BCache_Buffer *b = BCache_Find(nsid, block);
+    if (!b) {
+      b = BCache_Victim();
+      if (!b || (b->Flags & BCACHE_DIRTY))
+        break;
+      if (!batch) {
+        if (!batch_free)
+          break;
+        int i = __builtin_ctz(batch_free);
+        batch_free &= ~(1u << i);
+        batch = &batches[i];
+        batch->Count = 0;
+      }
+      // Unreferenced, so it goes first if the reader never gets to it
+      BCache_Recycle(b, nsid, block);
+      b->Flags |= BCACHE_READING | BCACHE_ASYNC | BCACHE_READAHEAD;
+      b->RefCount = 1;
+      b->Referenced = 0;
+      batch->Bufs[batch->Count++] = b;
+      stats.ReadaheadBlocks++;
+      if (batch->Count < max)
+        continue;
+    }
+    // A cached block ends the run, as does a full batch
+    if (batch) {
+      Spinlock_UnlockIrqRestore(&bcache_lock, *flags);
+      BCache_BatchSubmit(nsid, batch);
+      *flags = Spinlock_LockIrqSave(&bcache_lock);
+      batch = NULL;
+    }
+  }
+  if (batch) {
+    Spinlock_UnlockIrqRestore(&bcache_lock, *flags);
+    BCache_BatchSubmit(nsid, batch);
+    *flags = Spinlock_LockIrqSave(&bcache_lock);
+  }
+}
+
+// Whole cache blocks in 'nsid', or UINT64_MAX if its size is not known
+static uint64_t BCache_NamespaceBlocks(uint32_t nsid) {
+  uint64_t lbas = NVMe_GetNamespaceSize(nsid);
+  if (!lbas)
+    return UINT64_MAX;
+  return lbas / (BCACHE_BLOCK_SIZE / lba_size);
+}
+
+// Called by BCache_Read for blocks [first, last] before it reads them
+static void BCache_ReadStream(uint32_t nsid, uint64_t first, uint64_t last) {
+  uint64_t flags = Spinlock_LockIrqSave(&bcache_lock);
+  BCache_Stream *s = NULL;
+  BCache_Stream *oldest = &streams[0];
+  for (int i = 0; i < BCACHE_RA_STREAMS; i++) {
+    BCache_Stream *c = &streams[i];
+    if (c->LastUse && c->Nsid == nsid &&
+        (first == c->Next || first + 1 == c->Next)) {
+      s = c;
+      break;
+    }
+    if (c->LastUse < oldest->LastUse)
+      oldest = c;
+  }
+  if (!s) {
+    // Not a continuation of anything: start tracking it, no readahead yet
+    s = oldest;
+    s->Nsid = nsid;
+    s->Next = last + 1;
+    s->Ahead = last + 1;
+    s->Window = 0;
+    s->LastUse = ++stream_clock;
+    Spinlock_UnlockIrqRestore(&bcache_lock, flags);
+    return;
+  }
+  s->LastUse = ++stream_clock;
+
+  if (s->Window == 0) {
+    s->Window = BCACHE_RA_MIN;
+  } else if (first == s->Next && first < s->Ahead) {
+    // Entering a block readahead should have brought in: if it is still
+    // there the window can grow, if it was evicted unused it was too big
+    BCache_Buffer *b = BCache_Find(nsid, first);
+    if (b && (b->Flags & BCACHE_READAHEAD)) {
+      if (s->Window < BCACHE_RA_MAX)
+        s->Window *= 2;
+    } else if (!b && s->Window > BCACHE_RA_MIN) {
+      s->Window /= 2;
+    }
+  }
+  // Never more than a quarter of the cache
+  uint32_t limit = stats.MaxBuffers / 4;
+  if (s->Window > limit)
+    s->Window = limit > BCACHE_RA_MIN ? limit : BCACHE_RA_MIN;
+
+  if (s->Next < last + 1)
+    s->Next = last + 1;
+  if (s->Ahead < s->Next)
+    s->Ahead = s->Next;
+  // Top up once half the window is used
+  if (s->Ahead - s->Next <= s->Window / 2) {
+    uint64_t from = s->Ahead;
+    s->Ahead = s->Next + s->Window;
+    // Nothing past the last block of the namespace
+    uint64_t end = BCache_NamespaceBlocks(nsid);
+    if (s->Ahead > end)
+      s->Ahead = end > s->Next ? end : s->Next;
+    if (from < s->Ahead)
+      BCache_Readahead(nsid, from, s->Ahead, &flags);
+  }
+  Spinlock_UnlockIrqRestore(&bcache_lock, flags);
+}
+
+int BCache_Init(uint64_t budget_bytes) {
+  uint32_t size = NVMe_GetBlockSize();
+  if (!size || size > BCACHE_BLOCK_SIZE || BCACHE_BLOCK_SIZE % size)
+    return -1;
+
+  uint32_t count = (uint32_t)(budget_bytes / BCACHE_BLOCK_SIZE);
+  if (count == 0)
+    return -1;
+  uint64_t bytes = (uint64_t)count * sizeof(BCache_Buffer);
+  BCache_Buffer *headers =
+      PageAllocator_Alloc((bytes + BCACHE_BLOCK_SIZE - 1) / BCACHE_BLOCK_SIZE);
+  if (!headers)
+    return -1;
+  memset(headers, 0, bytes);
+
+  uint64_t flags = Spinlock_LockIrqSave(&bcache_lock);
+  buffers = headers;
+  stats.MaxBuffers = count;
+  lba_size = size;
+  Spinlock_UnlockIrqRestore(&bcache_lock, flags);
+  return 0;
+}
+
+BCache_Buffer *BCache_Get(uint32_t nsid, uint64_t block) {
+  if (!lba_size)
+    return NULL;
+  return BCache_Lookup(nsid, block, 1);
+}
+
+void BCache_MarkDirty(BCache_Buffer *buf) {
+  uint64_t flags = Spinlock_LockIrqSave(&bcache_lock);
+  BCache_SetDirty(buf);
+  Spinlock_UnlockIrqRestore(&bcache_lock, flags);
+}
+
+void BCache_Put(BCache_Buffer *buf) {
+  uint64_t flags = Spinlock_LockIrqSave(&bcache_lock);
+  if (--buf->RefCount == 0 && (buf->Flags & BCACHE_STALE))
+    BCache_Drop(buf);
+  Spinlock_UnlockIrqRestore(&bcache_lock, flags);
+}
+
+// Moves 'n' bytes at 'off' between the pinned buffer 'b' and 'buf'. Kernel
+// buffers are copied under the lock, so readers never see half a write.
+// User buffers may fault, which must not happen with the lock held: they
+// are copied without it, the pin keeping the buffer in place, but with
+// interrupts off so a buffer being filled in is never left READING while
+// its filler is preempted. Returns 0 or BCACHE_EFAULT.
+static int BCache_CopyBlock(BCache_Buffer *b, uint32_t off, void *buf,
+                            uint32_t n, int write, int user) {
+  uint64_t flags;
+  int ret = 0;
+  if (user) {
+    uint64_t irq = Cpu_IrqSave();
+    uint64_t left = write ? copy_from_user(b->Data + off, buf, n)
+                          : copy_to_user(buf, b->Data + off, n);
+    Cpu_IrqRestore(irq);
+    if (left)
+      ret = BCACHE_EFAULT;
+    flags = Spinlock_LockIrqSave(&bcache_lock);
+  } else {
+    flags = Spinlock_LockIrqSave(&bcache_lock);
+    if (write)
+      memcpy(b->Data + off, buf, n);
+    else
+      memcpy(buf, b->Data + off, n);
+  }
+
+  if (write) {
+    // An invalid block stays invalid unless it was filled in completely.
+    // A valid one may have changed in part even if the copy faulted.
+    if (b->Flags & BCACHE_READING) {
+      b->Flags &= ~BCACHE_READING;
+      if (ret == 0)
+        b->Flags |= BCACHE_VALID;
+    }
+    if (b->Flags & BCACHE_VALID)
+      BCache_SetDirty(b);
+  }
+  Spinlock_UnlockIrqRestore(&bcache_lock, flags);
+  return ret;
+}
+
+static int BCache_Copy(uint32_t nsid, uint64_t lba, void *buffer,
+                       uint32_t count, int write, int user) {
+  uint64_t pos = lba * lba_size;
+  uint64_t end = pos + (uint64_t)count * lba_size;
+  uint8_t *p = (uint8_t *)buffer;
+  if (!write && count)
+    BCache_ReadStream(nsid, pos / BCACHE_BLOCK_SIZE,
+                      (end - 1) / BCACHE_BLOCK_SIZE);
+  while (pos < end) {
+    uint32_t off = (uint32_t)(pos % BCACHE_BLOCK_SIZE);
+    uint32_t n = BCACHE_BLOCK_SIZE - off;
+    if (n > end - pos)
+      n = (uint32_t)(end - pos);
+
+    // A block written in full is never read in first
+    int fill = !write || n != BCACHE_BLOCK_SIZE;
+    BCache_Buffer *b = BCache_Lookup(nsid, pos / BCACHE_BLOCK_SIZE, fill);
+    if (!b)
+      return -1;
+    int ret = BCache_CopyBlock(b, off, p, n, write, user);
+    BCache_Put(b);
+    if (ret)
+      return ret;
+
+    p += n;
+    pos += n;
+  }
+  return 0;
+}
+
+int BCache_Read(uint32_t nsid, uint64_t lba, void *buffer, uint32_t count) {
+  if (!lba_size)
+    return NVMe_Read(nsid, lba, buffer, count);
+  return BCache_Copy(nsid, lba, buffer, count, 0, 0);
+}
+
+int BCache_Write(uint32_t nsid, uint64_t lba, const void *buffer,
+                 uint32_t count) {
+  if (!lba_size)
+    return NVMe_Write(nsid, lba, (void *)buffer, count);
+  return BCache_Copy(nsid, lba, (void *)buffer, count, 1, 0);
+}
+
+// Before BCache_Init the controller accesses the buffer directly, which
+// needs the identity mapping the callers check with User_DmaOk
+int BCache_ReadUser(uint32_t nsid, uint64_t lba, void *user_buffer,
+                    uint32_t count) {
+  if (!lba_size)
+    return NVMe_Read(nsid, lba, user_buffer, count);
+  return BCache_Copy(nsid, lba, user_buffer, count, 0, 1);
+}
+
+int BCache_WriteUser(uint32_t nsid, uint64_t lba, const void *user_buffer,
+                     uint32_t count) {
+  if (!lba_size)
+    return NVMe_Write(nsid, lba, (void *)user_buffer, count);
+  return BCache_Copy(nsid, lba, (void *)user_buffer, count, 1, 1);
+}
+
+void BCache_Invalidate(uint32_t nsid, uint64_t lba, uint32_t count) {
+  if (!lba_size || count == 0)
+    return;
+  uint64_t first = lba * lba_size / BCACHE_BLOCK_SIZE;
+  uint64_t last = ((lba + count) * lba_size - 1) / BCACHE_BLOCK_SIZE;
+
+  uint64_t flags = Spinlock_LockIrqSave(&bcache_lock);
+  for (uint32_t i = 0; i < stats.Buffers; i++) {
+    BCache_Buffer *b = &buffers[i];
+    if (!(b->Flags & BCACHE_HASHED) || b->Nsid != nsid || b->Block < first ||
+        b->Block > last)
+      continue;
+    if (b->RefCount)
+      b->Flags |= BCACHE_STALE;
+    else
+      BCache_Drop(b);
+  }
+  Spinlock_UnlockIrqRestore(&bcache_lock, flags);
+}
+
+int BCache_Flush(uint32_t nsid) {
+  if (!lba_size)
+    return 0;
+
+  // Start every write-back first so they run in parallel, then wait
+  uint64_t flags = Spinlock_LockIrqSave(&bcache_lock);
+  for (uint32_t i = 0; i < stats.Buffers; i++) {
+    BCache_Buffer *b = &buffers[i];
+    if ((nsid && b->Nsid != nsid) || !(b->Flags & BCACHE_DIRTY) ||
+        (b->Flags & (BCACHE_BUSY | BCACHE_STALE | BCACHE_FLUSH)))
+      continue;
+    b->RefCount++;
+    BCache_ClearDirty(b);
+    b->Flags |= BCACHE_WRITING | BCACHE_FLUSH;
+    Spinlock_UnlockIrqRestore(&bcache_lock, flags);
+    BCache_StartIo(b);
+    flags = Spinlock_LockIrqSave(&bcache_lock);
+  }
+
+  // Also waits for write-backs started by evictions or another flush
+  int result = 0;
+  for (uint32_t i = 0; i < stats.Buffers; i++) {
+    BCache_Buffer *b = &buffers[i];
+    if ((nsid && b->Nsid != nsid) ||
+        !(b->Flags & (BCACHE_WRITING | BCACHE_FLUSH)))
+      continue;
+    b->RefCount++;
+    BCache_WaitIdle(b, &flags);
+    if (b->Flags & BCACHE_FLUSH) {
+      b->Flags &= ~BCACHE_FLUSH;
+      b->RefCount--;
+    }
+    if ((b->Flags & BCACHE_DIRTY) && b->Error)
+      result = -1;
+    if (--b->RefCount == 0 && (b->Flags & BCACHE_STALE))
+      BCache_Drop(b);
+  }
+  Spinlock_UnlockIrqRestore(&bcache_lock, flags);
+  return result;
+}
+
+void BCache_GetStats(BCache_Stats *out) {
+  uint64_t flags = Spinlock_LockIrqSave(&bcache_lock);
+  *out = stats;
+  Spinlock_UnlockIrqRestore(&bcache_lock, flags);
+}
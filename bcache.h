@@ -0,0 +1,116 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include "nvme.h"
+#include <stdint.h>
+
+// Block buffer cache over the NVMe driver. The disk is cached in
+// BCACHE_BLOCK_SIZE buffers keyed by (namespace, block), a block being
+// BCACHE_BLOCK_SIZE bytes of the namespace (one or more LBAs). Buffers are
+// found through a hash table, pinned by a reference count while in use and
+// recycled by a CLOCK sweep once the memory budget is used up: every lookup
+// sets a buffer's referenced bit, the hand clears it, and the first unpinned
+// buffer it finds with the bit already clear is evicted. Dirty buffers are
+// written back before they are reused.
+//
+// Fills and write-backs are asynchronous NVMe requests whose callback marks
+// the buffer idle again, so waiting for a busy buffer works from syscalls
+// (which poll the queue) as well as from kernel threads (which yield).
+//
+// BCache_Read also detects sequential streams (a read starting in the block
+// where the previous one of the stream ended, or right after it) and keeps
+// a window of blocks prefetched ahead of them, read in as one vectored
+// command per run of blocks. The window starts at BCACHE_RA_MIN, doubles
+// each time the reader enters a block readahead brought in, and halves when
+// it finds one already evicted unused. It is topped up once the reader has
+// used half of it, so the device stays busy while the reader copies, and
+// stops at the last block of the namespace.
+
+#define BCACHE_BLOCK_SIZE 4096
+#define BCACHE_DEFAULT_BUDGET (4 * 1024 * 1024)
+#define BCACHE_HASH_BUCKETS 1024
+
+// Readahead, in cache blocks
+#define BCACHE_RA_STREAMS 8       // Sequential streams tracked
+#define BCACHE_RA_MIN 4           // Window once a stream looks sequential
+#define BCACHE_RA_MAX 64          // Largest window (256 KiB)
+#define BCACHE_RA_BATCH_BLOCKS 32 // Blocks per readahead command at most
+#define BCACHE_RA_BATCHES 16      // Readahead commands in flight at most
+
+// Buffer flags
+#define BCACHE_VALID 0x01      // Data holds the block (newer if dirty)
+#define BCACHE_DIRTY 0x02      // Changed in memory, not yet written back
+#define BCACHE_READING 0x04    // Fill in flight
+#define BCACHE_WRITING 0x08    // Write-back in flight
+#define BCACHE_BUSY (BCACHE_READING | BCACHE_WRITING)
+#define BCACHE_HASHED 0x10     // In the hash table
+#define BCACHE_STALE 0x20      // Invalidated while pinned, dropped on last put
+#define BCACHE_FLUSH 0x40      // Pinned by BCache_Flush
+#define BCACHE_ASYNC 0x80      // Pinned by readahead until its fill completes
+#define BCACHE_READAHEAD 0x100 // Brought in by readahead, not yet looked up
+
+typedef struct BCache_Buffer {
+  uint32_t Nsid;
+  uint64_t Block; // Byte offset in the namespace / BCACHE_BLOCK_SIZE
+  uint8_t *Data;  // BCACHE_BLOCK_SIZE bytes, identity mapped for DMA
+  volatile uint32_t Flags;
+  uint32_t RefCount;
+  uint8_t Referenced; // CLOCK bit
+  uint8_t Error;      // The last fill or write-back failed
+  struct BCache_Buffer *HashNext;
+  NVMe_Request Req; // Fill or write-back in flight
+} BCache_Buffer;
+
+typedef struct {
+  uint64_t Hits;
+  uint64_t Misses;
+  uint64_t Evictions;       // Valid buffers recycled for another block
+  uint64_t Writebacks;      // Dirty buffers written to the device
+  uint64_t Invalidations;   // Buffers dropped by BCache_Invalidate
+  uint64_t Errors;          // Failed fills and write-backs
+  uint64_t ReadaheadBlocks; // Blocks prefetched
+  uint64_t ReadaheadHits;   // Prefetched blocks later looked up
+  uint64_t ReadaheadWasted; // Prefetched blocks evicted unused
+  uint32_t Buffers;         // Allocated so far
+  uint32_t MaxBuffers;      // Memory budget / BCACHE_BLOCK_SIZE
+  uint32_t DirtyBuffers;
+} BCache_Stats;
+
+// Sets the memory budget; buffer pages are allocated on demand up to it.
+// Call after NVMe_Init. Returns -1 if there is no namespace, its LBA size
+// does not divide BCACHE_BLOCK_SIZE, or the buffer headers do not fit.
+int BCache_Init(uint64_t budget_bytes);
+
+// Pins the buffer holding 'block' of 'nsid', reading it in on a miss.
+// Returns NULL if the read fails or every buffer is pinned. The data may be
+// changed in place, followed by BCache_MarkDirty; callers changing the same
+// block must serialize among themselves.
+BCache_Buffer *BCache_Get(uint32_t nsid, uint64_t block);
+void BCache_MarkDirty(BCache_Buffer *buf);
+void BCache_Put(BCache_Buffer *buf);
+
+// Copy 'count' LBAs from 'lba' through the cache. Writes are write-back:
+// the data reaches the device on BCache_Flush or when the buffer is
+// evicted. Before BCache_Init they go straight to the device. Reads also
+// drive readahead. Return 0, or -1 if a fill failed.
+int BCache_Read(uint32_t nsid, uint64_t lba, void *buffer, uint32_t count);
+int BCache_Write(uint32_t nsid, uint64_t lba, const void *buffer,
+                 uint32_t count);
+// The same for a user buffer, copied with copy_to_user/copy_from_user.
+// Also return BCACHE_EFAULT if part of the buffer is not mapped; a write
+// may then have changed some of the blocks.
+#define BCACHE_EFAULT (-2)
+int BCache_ReadUser(uint32_t nsid, uint64_t lba, void *user_buffer,
+                    uint32_t count);
+int BCache_WriteUser(uint32_t nsid, uint64_t lba, const void *user_buffer,
+                     uint32_t count);
+// Drops every cached block overlapping 'count' LBAs from 'lba', unwritten
+// changes included. For when the device was written behind the cache.
+void BCache_Invalidate(uint32_t nsid, uint64_t lba, uint32_t count);
+// Writes back the dirty buffers of 'nsid' (0 for all) and waits for them.
+// Returns 0, or -1 if a write failed; those buffers stay dirty.
+int BCache_Flush(uint32_t nsid);
+
+void BCache_GetStats(BCache_Stats *out);
+
+#endif
@@ -0,0 +1,113 @@
+#include "cmdline.h"
+#include <stddef.h>
+
+static char cmdline[CMDLINE_MAX];
+
+void Cmdline_Init(const uint16_t *options, uint32_t size) {
+  uint32_t n = 0;
+  if (options) {
+    // LoadOptions is UCS-2; only ASCII is meaningful for options
+    for (uint32_t i = 0; i < size / 2 && n < CMDLINE_MAX - 1; i++) {
+      uint16_t c = options[i];
+      if (c == 0)
+        break;
+      cmdline[n++] = c < 0x80 ? (char)c : '?';
+    }
+  }
+  cmdline[n] = 0;
+}
+
+static int is_separator(char c) { return c == ' ' || c == '\t' || c == 0; }
+
+const char *Cmdline_Get(const char *key) {
+  const char *p = cmdline;
+  while (*p) {
+    // Start of a word
+    while (*p && is_separator(*p))
+      p++;
+
+    const char *k = key;
+    const char *w = p;
+    while (*k && *w == *k) {
+      k++;
+      w++;
+    }
+    if (*k == 0 && *w == '=')
+      return w + 1;
+
+    // Skip to the next word
+    while (!is_separator(*p))
+      p++;
+  }
+  return NULL;
+}
+
+static int parse_number(const char **s, uint32_t *out) {
+  const char *p = *s;
+  uint32_t v = 0;
+  if (*p < '0' || *p > '9')
+    return 0;
+  while (*p >= '0' && *p <= '9') {
+    v = v * 10 + (uint32_t)(*p - '0');
+    if (v >= 64)
+      return 0;
+    p++;
+  }
+  *s = p;
+  *out = v;
+  return 1;
+}
+
+int Cmdline_GetCpuList(const char *key, uint64_t *mask) {
+  const char *p = Cmdline_Get(key);
+  if (!p)
+    return 0;
+
+  uint64_t m = 0;
+  while (!is_separator(*p)) {
+    uint32_t first, last;
+    if (!parse_number(&p, &first))
+      return 0;
+    last = first;
+    if (*p == '-') {
+      p++;
+      if (!parse_number(&p, &last) || last < first)
+        return 0;
+    }
+    for (uint32_t cpu = first; cpu <= last; cpu++)
+      m |= 1ULL << cpu;
+
+    if (*p == ',')
+      p++;
+    else if (!is_separator(*p))
+      return 0;
+  }
+  *mask = m;
+  return 1;
+}
+
+int Cmdline_GetNumbers(const char *key, uint32_t *values, int max) {
+  const char *p = Cmdline_Get(key);
+  if (!p)
+    return 0;
+
+  int n = 0;
+  while (!is_separator(*p)) {
+    if (n == max || *p < '0' || *p > '9')
+      return 0;
+    uint64_t v = 0;
+    while (*p >= '0' && *p <= '9') {
+      v = v * 10 + (uint64_t)(*p - '0');
+      if (v > 0xFFFFFFFFu)
+        return 0;
+      p++;
+    }
+    values[n++] = (uint32_t)v;
+
+    if (*p == ',')
+      p++;
+    else if (!is_separator(*p))
+      return 0;
+  }
+  return n;
+}
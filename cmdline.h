@@ -0,0 +1,25 @@
+#ifndef CMDLINE_H
+#define CMDLINE_H
+
+#include <stdint.h>
+
+#define CMDLINE_MAX 256
+
+// Boot options, e.g. "main.efi isolcpus=2-3" from the UEFI shell.
+// 'options' is the UCS-2 LoadOptions string of the loaded image; it is
+// copied, so this must run before ExitBootServices.
+void Cmdline_Init(const uint16_t *options, uint32_t size);
+
+// Returns the value of 'key=value' (terminated by a space or the end of the
+// line), or NULL if the option is not present.
+const char *Cmdline_Get(const char *key);
+
+// Parses a CPU list option such as "1,3-5" into a bitmask.
+// Returns 1 if the option is present and valid.
+int Cmdline_GetCpuList(const char *key, uint64_t *mask);
+
+// Parses an option of up to 'max' comma separated numbers, such as "8,10".
+// Returns how many were read, or 0 if the option is absent or malformed.
+int Cmdline_GetNumbers(const char *key, uint32_t *values, int max);
+
+#endif
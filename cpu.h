@@ -0,0 +1,36 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>
+
+#define RFLAGS_IF 0x200
+
+// Time Stamp Counter
+static inline uint64_t Cpu_ReadTSC(void) {
+  uint32_t low, high;
+  asm volatile("rdtsc" : "=a"(low), "=d"(high));
+  return ((uint64_t)high << 32) | low;
+}
+
+// Spin-wait hint
+static inline void Cpu_Pause(void) { asm volatile("pause" ::: "memory"); }
+
+// Disable interrupts and return the previous RFLAGS
+static inline uint64_t Cpu_IrqSave(void) {
+  uint64_t flags;
+  asm volatile("pushfq\n"
+               "popq %0\n"
+               "cli\n"
+               : "=r"(flags)
+               :
+               : "memory");
+  return flags;
+}
+
+// Re-enable interrupts if they were enabled when Cpu_IrqSave was called
+static inline void Cpu_IrqRestore(uint64_t flags) {
+  if (flags & RFLAGS_IF)
+    asm volatile("sti" ::: "memory");
+}
+
+#endif
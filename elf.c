@@ -0,0 +1,326 @@
+#include "elf.h"
+#include "heap.h"
+#include "libc.h"
+#include "memory.h"
+#include "nvme.h"
+#include "schedule.h"
+#include "spinlock.h"
+#include "syscall.h"
+#include "vdso.h"
+#include <stddef.h>
+
+typedef struct {
+  uint64_t vaddr; // Unbiased
+  uint64_t memsz;
+  uint64_t filesz;
+  uint64_t offset;
+  uint32_t flags;  // PF_*
+  uint64_t pages;  // Pages spanned by [vaddr, vaddr + memsz)
+  uint64_t *frames; // Shared frames of a read-only segment, 0 until loaded
+} ElfSegment;
+
+typedef struct {
+  int refs; // Live instances; the slot is free at 0
+  uint32_t nsid;
+  uint64_t lba;
+  uint64_t entry;
+  uint64_t span; // End of the highest segment
+  int num_segments;
+  ElfSegment segments[ELF_MAX_SEGMENTS];
+} ElfImage;
+
+typedef struct {
+  int active;
+  int task_id;
+  ElfImage *image;
+  uint64_t bias; // Start of the instance's slot
+} ElfInstance;
+
+static ElfImage images[ELF_MAX_IMAGES];
+static ElfInstance instances[MAX_TASKS];
+static uint64_t next_slot = 0;
+static uint8_t header_page[PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+
+// Also held across the disk reads of a fault, so two CPUs touching the same
+// shared page do not both load it.
+static LockClass elf_class = LOCK_CLASS_INIT("elf");
+static Spinlock elf_lock = SPINLOCK_INIT(&elf_class);
+
+static uint64_t Elf_PageStart(uint64_t v) { return v & ~(PAGE_SIZE - 1ULL); }
+
+static void Elf_FreeImage(ElfImage *img) {
+  for (int i = 0; i < img->num_segments; i++) {
+    ElfSegment *seg = &img->segments[i];
+    if (!seg->frames)
+      continue;
+    for (uint64_t p = 0; p < seg->pages; p++)
+      if (seg->frames[p])
+        PageAllocator_Free((void *)seg->frames[p], 1);
+    kfree(seg->frames);
+    seg->frames = NULL;
+  }
+  img->refs = 0;
+}
+
+// Reads and checks the headers at 'lba' into 'img'. Only headers within the
+// first page are supported.
+static int64_t Elf_ParseImage(ElfImage *img, uint32_t nsid, uint64_t lba) {
+  // File pages are read as whole LBAs of the namespace
+  uint32_t block_size = NVMe_GetBlockSize();
+  if (!block_size || block_size > PAGE_SIZE || PAGE_SIZE % block_size)
+    return (int64_t)SYSCALL_EIO;
+  // A failed read would leave the previous image's headers here
+  if (NVMe_Read(nsid, lba, header_page, PAGE_SIZE / block_size) != 0)
+    return (int64_t)SYSCALL_EIO;
+
+  Elf64_Ehdr *eh = (Elf64_Ehdr *)header_page;
+  if (eh->e_ident[0] != 0x7F || eh->e_ident[1] != 'E' ||
+      eh->e_ident[2] != 'L' || eh->e_ident[3] != 'F' ||
+      eh->e_ident[4] != ELFCLASS64 || eh->e_ident[5] != ELFDATA2LSB ||
+      eh->e_type != ET_DYN || eh->e_machine != EM_X86_64 ||
+      eh->e_phentsize != sizeof(Elf64_Phdr) ||
+      eh->e_phoff + (uint64_t)eh->e_phnum * sizeof(Elf64_Phdr) > PAGE_SIZE)
+    return (int64_t)SYSCALL_EINVAL;
+
+  memset(img, 0, sizeof(*img));
+  img->nsid = nsid;
+  img->lba = lba;
+  img->entry = eh->e_entry;
+
+  Elf64_Phdr *ph = (Elf64_Phdr *)(header_page + eh->e_phoff);
+  for (int i = 0; i < eh->e_phnum; i++, ph++) {
+    if (ph->p_type != PT_LOAD || ph->p_memsz == 0)
+      continue;
+    // The file offset and address must agree within a page so each page
+    // of the segment is one page of the file.
+    if (img->num_segments == ELF_MAX_SEGMENTS ||
+        ph->p_filesz > ph->p_memsz ||
+        (ph->p_offset & (PAGE_SIZE - 1)) != (ph->p_vaddr & (PAGE_SIZE - 1)) ||
+        ph->p_vaddr >= ELF_SLOT_SIZE ||
+        ph->p_memsz > ELF_SLOT_SIZE - ph->p_vaddr) {
+      Elf_FreeImage(img);
+      return (int64_t)SYSCALL_EINVAL;
+    }
+
+    // Segments must not share a page: each page takes the sharing and
+    // permissions of exactly one segment.
+    uint64_t first = Elf_PageStart(ph->p_vaddr);
+    uint64_t pages =
+        (ph->p_vaddr + ph->p_memsz - first + PAGE_SIZE - 1) / PAGE_SIZE;
+    for (int s = 0; s < img->num_segments; s++) {
+      ElfSegment *other = &img->segments[s];
+      uint64_t other_first = Elf_PageStart(other->vaddr);
+      if (first < other_first + other->pages * PAGE_SIZE &&
+          other_first < first + pages * PAGE_SIZE) {
+        Elf_FreeImage(img);
+        return (int64_t)SYSCALL_EINVAL;
+      }
+    }
+
+    ElfSegment *seg = &img->segments[img->num_segments++];
+    seg->vaddr = ph->p_vaddr;
+    seg->memsz = ph->p_memsz;
+    seg->filesz = ph->p_filesz;
+    seg->offset = ph->p_offset;
+    seg->flags = ph->p_flags;
+    seg->pages = pages;
+    if (!(seg->flags & PF_W)) {
+      seg->frames = (uint64_t *)kmalloc(seg->pages * sizeof(uint64_t));
+      if (!seg->frames) {
+        Elf_FreeImage(img);
+        return (int64_t)SYSCALL_ENOMEM;
+      }
+      memset(seg->frames, 0, seg->pages * sizeof(uint64_t));
+    }
+    if (seg->vaddr + seg->memsz > img->span)
+      img->span = seg->vaddr + seg->memsz;
+  }
+
+  if (img->num_segments == 0 || img->entry >= img->span) {
+    Elf_FreeImage(img);
+    return (int64_t)SYSCALL_EINVAL;
+  }
+  img->refs = 0;
+  return 0;
+}
+
+// Finds a loaded image or parses a new one. Called with elf_lock held.
+static ElfImage *Elf_GetImage(uint32_t nsid, uint64_t lba, int64_t *err) {
+  ElfImage *free_img = NULL;
+  for (int i = 0; i < ELF_MAX_IMAGES; i++) {
+    if (images[i].refs && images[i].nsid == nsid && images[i].lba == lba)
+      return &images[i];
+    if (!images[i].refs && !free_img)
+      free_img = &images[i];
+  }
+  if (!free_img) {
+    *err = (int64_t)SYSCALL_ENOMEM;
+    return NULL;
+  }
+  *err = Elf_ParseImage(free_img, nsid, lba);
+  return *err ? NULL : free_img;
+}
+
+int64_t Elf_Exec(uint32_t nsid, uint64_t lba, uint64_t stack_pages) {
+  void *stack = PageAllocator_Alloc(stack_pages);
+  if (!stack)
+    return (int64_t)SYSCALL_ENOMEM;
+
+  // Held until the task id is recorded: the new task may fault (or exit) on
+  // another CPU right away, and both paths take elf_lock.
+  uint64_t flags = Spinlock_LockIrqSave(&elf_lock);
+  ElfInstance *inst = NULL;
+  for (int i = 0; i < MAX_TASKS && !inst; i++)
+    if (!instances[i].active)
+      inst = &instances[i];
+
+  int64_t err = (int64_t)SYSCALL_ENOMEM;
+  uint64_t max_slots = (VDSO_DATA_ADDR - ELF_REGION_BASE) / ELF_SLOT_SIZE;
+  ElfImage *img = NULL;
+  if (inst && next_slot < max_slots)
+    img = Elf_GetImage(nsid, lba, &err);
+  if (!img) {
+    Spinlock_UnlockIrqRestore(&elf_lock, flags);
+    PageAllocator_Free(stack, stack_pages);
+    return err;
+  }
+
+  img->refs++;
+  inst->active = 1;
+  inst->image = img;
+  inst->bias = ELF_REGION_BASE + next_slot++ * ELF_SLOT_SIZE;
+  inst->task_id = Scheduler_AddUserTask(
+      (void (*)())(inst->bias + img->entry), stack, stack_pages);
+  if (inst->task_id < 0) {
+    inst->active = 0;
+    if (--img->refs == 0)
+      Elf_FreeImage(img);
+    Spinlock_UnlockIrqRestore(&elf_lock, flags);
+    PageAllocator_Free(stack, stack_pages);
+    return (int64_t)SYSCALL_ENOMEM;
+  }
+  int task_id = inst->task_id;
+  Spinlock_UnlockIrqRestore(&elf_lock, flags);
+  return task_id;
+}
+
+// Fills a fresh frame for page 'page_va' (unbiased) of 'seg'. Bytes outside
+// the file-backed part of the segment are zero. Returns NULL if out of
+// memory or the read fails.
+static void *Elf_LoadPage(ElfImage *img, ElfSegment *seg, uint64_t page_va) {
+  uint8_t *frame = (uint8_t *)PageAllocator_Alloc(1);
+  if (!frame)
+    return NULL;
+
+  uint64_t data_start = page_va > seg->vaddr ? page_va : seg->vaddr;
+  uint64_t data_end = seg->vaddr + seg->filesz;
+  if (data_end > page_va + PAGE_SIZE)
+    data_end = page_va + PAGE_SIZE;
+
+  if (data_end > data_start) {
+    uint64_t file_page = Elf_PageStart(seg->offset) +
+                         (page_va - Elf_PageStart(seg->vaddr));
+    // file_page is page aligned, so a whole number of blocks (checked by
+    // Elf_ParseImage)
+    uint32_t block_size = NVMe_GetBlockSize();
+    uint32_t blocks =
+        (uint32_t)((data_end - page_va + block_size - 1) / block_size);
+    if (NVMe_Read(img->nsid, img->lba + file_page / block_size, frame,
+                  blocks)) {
+      PageAllocator_Free(frame, 1);
+      return NULL;
+    }
+    memset(frame, 0, data_start - page_va);
+    memset(frame + (data_end - page_va), 0, page_va + PAGE_SIZE - data_end);
+  } else {
+    memset(frame, 0, PAGE_SIZE);
+  }
+  return frame;
+}
+
+int Elf_HandlePageFault(InterruptFrame *frame) {
+  // Only not-present faults; protection faults are real errors
+  if (frame->int_no != 14 || (frame->err_code & 1))
+    return 0;
+
+  uint64_t addr;
+  asm volatile("mov %%cr2, %0" : "=r"(addr));
+  if (addr < ELF_REGION_BASE || addr >= VDSO_DATA_ADDR)
+    return 0;
+
+  int handled = 0;
+  uint64_t flags = Spinlock_LockIrqSave(&elf_lock);
+  ElfInstance *inst = &instances[0];
+  while (inst < &instances[MAX_TASKS] &&
+         !(inst->active && addr - inst->bias < ELF_SLOT_SIZE))
+    inst++;
+
+  if (inst < &instances[MAX_TASKS]) {
+    ElfImage *img = inst->image;
+    uint64_t va = addr - inst->bias;
+    for (int i = 0; i < img->num_segments && !handled; i++) {
+      ElfSegment *seg = &img->segments[i];
+      if (va < seg->vaddr || va >= seg->vaddr + seg->memsz)
+        continue;
+
+      uint64_t page_va = Elf_PageStart(va);
+      void *virt = (void *)(inst->bias + page_va);
+      // Another CPU running the same instance may have mapped it meanwhile
+      if (PageTable_Lookup(g_kernel_pml4, virt) & PAGE_PRESENT) {
+        handled = 1;
+        break;
+      }
+
+      if (seg->flags & PF_W) {
+        void *page = Elf_LoadPage(img, seg, page_va);
+        if (page) {
+          PageTable_Map(g_kernel_pml4, virt, page, PAGE_WRITABLE | PAGE_USER);
+          handled = 1;
+        } else {
+          handled = -1;
+        }
+      } else {
+        uint64_t *slot =
+            &seg->frames[(page_va - Elf_PageStart(seg->vaddr)) / PAGE_SIZE];
+        if (!*slot)
+          *slot = (uint64_t)Elf_LoadPage(img, seg, page_va);
+        if (*slot) {
+          PageTable_Map(g_kernel_pml4, virt, (void *)*slot, PAGE_USER);
+          handled = 1;
+        } else {
+          handled = -1;
+        }
+      }
+    }
+  }
+  Spinlock_UnlockIrqRestore(&elf_lock, flags);
+  return handled;
+}
+
+void Elf_ReleaseTask(int task_id) {
+  uint64_t flags = Spinlock_LockIrqSave(&elf_lock);
+  for (int i = 0; i < MAX_TASKS; i++) {
+    ElfInstance *inst = &instances[i];
+    if (!inst->active || inst->task_id != task_id)
+      continue;
+
+    ElfImage *img = inst->image;
+    for (int s = 0; s < img->num_segments; s++) {
+      ElfSegment *seg = &img->segments[s];
+      uint64_t start = inst->bias + Elf_PageStart(seg->vaddr);
+      for (uint64_t p = 0; p < seg->pages; p++) {
+        void *virt = (void *)(start + p * PAGE_SIZE);
+        uint64_t pte = PageTable_Lookup(g_kernel_pml4, virt);
+        if (!(pte & PAGE_PRESENT))
+          continue;
+        PageTable_UnMap(g_kernel_pml4, virt);
+        if (seg->flags & PF_W)
+          PageAllocator_Free((void *)(pte & ~0xFFFULL), 1);
+      }
+    }
+    inst->active = 0;
+    if (--img->refs == 0)
+      Elf_FreeImage(img);
+  }
+  Spinlock_UnlockIrqRestore(&elf_lock, flags);
+}
@@ -0,0 +1,72 @@
+#ifndef ELF_H
+#define ELF_H
+
+#include "interrupt.h"
+#include "usercopy.h"
+#include <stdint.h>
+
+// ELF64 file header
+typedef struct {
+  uint8_t e_ident[16];
+  uint16_t e_type;
+  uint16_t e_machine;
+  uint32_t e_version;
+  uint64_t e_entry;
+  uint64_t e_phoff;
+  uint64_t e_shoff;
+  uint32_t e_flags;
+  uint16_t e_ehsize;
+  uint16_t e_phentsize;
+  uint16_t e_phnum;
+  uint16_t e_shentsize;
+  uint16_t e_shnum;
+  uint16_t e_shstrndx;
+} __attribute__((packed)) Elf64_Ehdr;
+
+// ELF64 program header
+typedef struct {
+  uint32_t p_type;
+  uint32_t p_flags;
+  uint64_t p_offset;
+  uint64_t p_vaddr;
+  uint64_t p_paddr;
+  uint64_t p_filesz;
+  uint64_t p_memsz;
+  uint64_t p_align;
+} __attribute__((packed)) Elf64_Phdr;
+
+#define ELFCLASS64 2
+#define ELFDATA2LSB 1
+#define ET_DYN 3
+#define EM_X86_64 62
+#define PT_LOAD 1
+#define PF_X 1
+#define PF_W 2
+#define PF_R 4
+
+// Images are position independent (ET_DYN, e.g. -static-pie without
+// relocations to apply). The lower addresses belong to the kernel's identity
+// map, so every instance gets its own slot above ELF_REGION_BASE. Slots are
+// never reused: a CPU may still cache translations for a released one.
+#define ELF_REGION_BASE USER_IDENTITY_LIMIT
+#define ELF_SLOT_SIZE 0x100000000ULL // 4GB per instance
+#define ELF_MAX_SEGMENTS 8
+#define ELF_MAX_IMAGES 8
+
+// Starts a user task running the ELF64 executable stored from 'lba' on
+// namespace 'nsid'. Only the first page (headers) is read here; PT_LOAD
+// segments are paged in on first touch. Read-only segments of the same
+// image share their pages between instances. Returns the task id, or a
+// negative SYSCALL_E* value.
+int64_t Elf_Exec(uint32_t nsid, uint64_t lba, uint64_t stack_pages);
+
+// Called by ExceptionHandler for page faults. Returns 1 if the address
+// belongs to a loaded image and is now mapped, -1 if it belongs to one but
+// the page could not be loaded (read error or out of memory), 0 otherwise.
+int Elf_HandlePageFault(InterruptFrame *frame);
+
+// Unmaps the instance run by 'task_id' (if any) and frees its private pages.
+// Shared pages go once the last instance of the image is gone.
+void Elf_ReleaseTask(int task_id);
+
+#endif
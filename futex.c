@@ -0,0 +1,110 @@
+#include "futex.h"
+#include "schedule.h"
+#include "spinlock.h"
+#include "usercopy.h"
+#include <stddef.h>
+
+// One waiter slot per task; a task waits on at most one address at a time.
+static FutexWaiter task_waiters[MAX_TASKS];
+static FutexWaiter *buckets[FUTEX_HASH_SIZE];
+static Spinlock bucket_locks[FUTEX_HASH_SIZE];
+static LockClass futex_lock_class = LOCK_CLASS_INIT("futex_bucket");
+static int futex_ready = 0;
+
+static void Futex_InitTable() {
+  for (int i = 0; i < FUTEX_HASH_SIZE; i++) {
+    buckets[i] = NULL;
+    Spinlock_Init(&bucket_locks[i], &futex_lock_class);
+  }
+  for (int i = 0; i < MAX_TASKS; i++)
+    task_waiters[i].waiting = 0;
+  futex_ready = 1;
+}
+
+static int Futex_Hash(uintptr_t key) {
+  // Multiplicative hash on the word address
+  uint64_t h = (uint64_t)(key >> 2) * 0x9E3779B97F4A7C15ULL;
+  return (int)(h >> 58) & (FUTEX_HASH_SIZE - 1);
+}
+
+// Queues 'w' if the value still matches. The value check and the enqueue
+// happen under the bucket lock, so a waker either sees us queued or we see
+// its store. 'block' marks the current task blocked before the lock is
+// dropped. Returns 1 if queued, 0 if the value differs, -1 for a bad address.
+static int Futex_Enqueue(uint32_t *uaddr, uint32_t expected, FutexWaiter *w,
+                         int block) {
+  if (!futex_ready)
+    Futex_InitTable();
+
+  uintptr_t key = (uintptr_t)uaddr;
+  int bucket = Futex_Hash(key);
+
+  uint64_t flags = Spinlock_LockIrqSave(&bucket_locks[bucket]);
+  uint32_t value;
+  if (copy_from_user(&value, uaddr, sizeof(value)) != 0) {
+    Spinlock_UnlockIrqRestore(&bucket_locks[bucket], flags);
+    return -1;
+  }
+  if (value != expected) {
+    Spinlock_UnlockIrqRestore(&bucket_locks[bucket], flags);
+    return 0;
+  }
+
+  w->key = key;
+  w->next = NULL;
+  w->waiting = 1;
+
+  // Append so waiters are woken in FIFO order
+  FutexWaiter **pos = &buckets[bucket];
+  while (*pos)
+    pos = &(*pos)->next;
+  *pos = w;
+
+  if (block)
+    Scheduler_Block();
+  Spinlock_UnlockIrqRestore(&bucket_locks[bucket], flags);
+  return 1;
+}
+
+int Futex_Wait(uint32_t *uaddr, uint32_t expected) {
+  int task = Scheduler_GetCurrentTask();
+  FutexWaiter *w = &task_waiters[task];
+  w->task = task;
+  w->wake = NULL;
+  return Futex_Enqueue(uaddr, expected, w, 1);
+}
+
+int Futex_WaitAsync(uint32_t *uaddr, uint32_t expected, FutexWaiter *w) {
+  w->task = -1;
+  return Futex_Enqueue(uaddr, expected, w, 0);
+}
+
+int Futex_Wake(uint32_t *uaddr, int count) {
+  if (!futex_ready)
+    return 0;
+
+  uintptr_t key = (uintptr_t)uaddr;
+  int bucket = Futex_Hash(key);
+  int woken = 0;
+
+  uint64_t flags = Spinlock_LockIrqSave(&bucket_locks[bucket]);
+  FutexWaiter **pos = &buckets[bucket];
+
+  while (*pos && woken < count) {
+    FutexWaiter *w = *pos;
+    if (w->key == key) {
+      *pos = w->next; // Unlink
+      w->waiting = 0;
+      if (w->task >= 0)
+        Scheduler_Wake(w->task);
+      else
+        w->wake(w);
+      woken++;
+    } else {
+      pos = &w->next;
+    }
+  }
+  Spinlock_UnlockIrqRestore(&bucket_locks[bucket], flags);
+
+  return woken;
+}
@@ -0,0 +1,33 @@
+#ifndef FUTEX_H
+#define FUTEX_H
+
+#include <stdint.h>
+
+#define FUTEX_HASH_SIZE 64
+
+// A waiter queued on a futex. Tasks use a per-task slot inside futex.c;
+// Futex_WaitAsync callers provide their own.
+typedef struct FutexWaiter {
+  uintptr_t key; // User address being waited on
+  struct FutexWaiter *next;
+  int task;                            // Task to wake, -1 for async waiters
+  void (*wake)(struct FutexWaiter *w); // Async waiters only
+  volatile int waiting;
+} FutexWaiter;
+
+// Queues the current task on 'uaddr' if *uaddr still equals 'expected' and
+// marks it blocked. Returns 1 if the caller must now sleep
+// (Scheduler_SleepFromSyscall), 0 if the value had changed, -1 if 'uaddr'
+// is not a valid user address.
+int Futex_Wait(uint32_t *uaddr, uint32_t expected);
+
+// Like Futex_Wait, but nobody sleeps: w->wake is called once the waiter is
+// woken. It runs with the futex bucket lock held, so it must not call back
+// into the futex code. Returns 1 if queued, 0 if the value had changed, -1
+// for a bad address.
+int Futex_WaitAsync(uint32_t *uaddr, uint32_t expected, FutexWaiter *w);
+
+// Wakes up to 'count' waiters on 'uaddr'. Returns the number woken.
+int Futex_Wake(uint32_t *uaddr, int count);
+
+#endif
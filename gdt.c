@@ -5,6 +5,8 @@ static GDTEntry gdt[7];
 static GDTPointer gdt_ptr;
 TSS tss;
 
+static uint8_t ist_stacks[3][IST_STACK_SIZE] __attribute__((aligned(16)));
+
 void GDT_SetEntry(int index, uint32_t base, uint32_t limit, uint8_t access,
                   uint8_t gran) {
   gdt[index].base_low = (base & 0xFFFF);
@@ -39,6 +41,9 @@ void GDT_Init() {
   // Clear TSS
   memset(&tss, 0, sizeof(TSS));
   tss.iomap_base = sizeof(TSS);
+  tss.ist1 = (uint64_t)&ist_stacks[IST_DOUBLE_FAULT - 1][IST_STACK_SIZE];
+  tss.ist2 = (uint64_t)&ist_stacks[IST_NMI - 1][IST_STACK_SIZE];
+  tss.ist3 = (uint64_t)&ist_stacks[IST_MACHINE_CHECK - 1][IST_STACK_SIZE];
 
   // Null descriptor
   GDT_SetEntry(0, 0, 0, 0, 0);
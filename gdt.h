@@ -41,6 +41,14 @@ typedef struct {
 #define USER_CODE_SEL (0x20 | 3)
 #define TSS_SEL 0x28
 
+// Interrupt Stack Table slots. These exceptions always switch to a known
+// good stack, so a double fault caused by a bad RSP (or an NMI/#MC hitting
+// at any point) does not run on, or corrupt, the interrupted stack.
+#define IST_DOUBLE_FAULT 1
+#define IST_NMI 2
+#define IST_MACHINE_CHECK 3
+#define IST_STACK_SIZE 8192
+
 void GDT_Init();
 void TSS_SetStack(uint64_t kstack);
 extern TSS tss;
@@ -1,7 +1,15 @@
 #include "heap.h"
+#include "spinlock.h"
 #include <stddef.h>
 
 static HeapBlock *free_list = NULL;
+static LockClass heap_lock_class = LOCK_CLASS_INIT("heap");
+// Every CPU allocates through this one lock; an MCS lock has each waiter
+// spin on its own node instead of the shared lock word
+static McsLock heap_lock = MCSLOCK_INIT(&heap_lock_class);
+
+static void *Heap_AllocLocked(size_t size);
+static void Heap_FreeLocked(void *ptr);
 
 void Heap_Init(void *start, size_t size) {
   free_list = (HeapBlock *)start;
@@ -12,6 +20,14 @@ void Heap_Init(void *start, size_t size) {
 }
 
 void *kmalloc(size_t size) {
+  McsNode node;
+  uint64_t flags = McsLock_LockIrqSave(&heap_lock, &node);
+  void *ptr = Heap_AllocLocked(size);
+  McsLock_UnlockIrqRestore(&heap_lock, &node, flags);
+  return ptr;
+}
+
+static void *Heap_AllocLocked(size_t size) {
   HeapBlock *current = free_list;
 
   // Simple First-Fit
@@ -53,9 +69,13 @@ void *kmalloc_aligned(size_t size, size_t alignment) {
   // 2. The alignment padding (up to alignment - 1)
   // 3. A new HeapBlock header for the aligned block
   size_t total_size = size + alignment + sizeof(HeapBlock);
-  void *ptr = kmalloc(total_size);
-  if (!ptr)
+  McsNode node;
+  uint64_t flags = McsLock_LockIrqSave(&heap_lock, &node);
+  void *ptr = Heap_AllocLocked(total_size);
+  if (!ptr) {
+    McsLock_UnlockIrqRestore(&heap_lock, &node, flags);
     return NULL;
+  }
 
   uintptr_t raw_addr = (uintptr_t)ptr;
   uintptr_t aligned_addr =
@@ -82,9 +102,10 @@ void *kmalloc_aligned(size_t size, size_t alignment) {
     original_block->free = 1; // The padding is now free!
 
     // Coalesce the padding if possible (optional but good)
-    kfree((void *)((uint8_t *)original_block + sizeof(HeapBlock)));
+    Heap_FreeLocked((void *)((uint8_t *)original_block + sizeof(HeapBlock)));
   }
 
+  McsLock_UnlockIrqRestore(&heap_lock, &node, flags);
   return (void *)aligned_addr;
 }
 
@@ -92,6 +113,13 @@ void kfree(void *ptr) {
   if (!ptr)
     return;
 
+  McsNode node;
+  uint64_t flags = McsLock_LockIrqSave(&heap_lock, &node);
+  Heap_FreeLocked(ptr);
+  McsLock_UnlockIrqRestore(&heap_lock, &node, flags);
+}
+
+static void Heap_FreeLocked(void *ptr) {
   HeapBlock *block = (HeapBlock *)((uint8_t *)ptr - sizeof(HeapBlock));
   block->free = 1;
 
@@ -1,11 +1,18 @@
 #include "interrupt.h"
 #include "gdt.h"
+#include "cpu.h"
 #include "graphics.h"
+#include "percpu.h"
+#include "schedule.h"
+#include "softirq.h"
+#include "usercopy.h"
+#include "elf.h"
 #include <stddef.h>
 
 static IDTEntry idt[256];
 static IDTPointer idt_ptr;
 static InterruptHandler handler_table[256];
+static FastInterruptHandler fast_table[256];
 
 const char *exception_messages[] = {"DIVISION BY ZERO",
                                     "DEBUG",
@@ -74,6 +81,9 @@ extern void isr30();
 extern void isr31();
 extern void isr33(); // Vector 0x21
 extern void isr64(); // Vector 0x40
+extern void isr80(), isr81(), isr82(), isr83(), isr84(), isr85(), isr86(),
+    isr87(), isr88(); // Vectors 0x50-0x58
+extern void isr129(); // Vector 0x81
 extern void isr_generic();
 
 void IDT_SetGate(uint8_t vector, void *handler, uint16_t selector,
@@ -88,17 +98,99 @@ void IDT_SetGate(uint8_t vector, void *handler, uint16_t selector,
   idt[vector].zero = 0;
 }
 
+void IDT_SetIst(uint8_t vector, uint8_t ist) { idt[vector].ist = ist; }
+
 void Interrupt_RegisterHandler(uint8_t vector, InterruptHandler handler) {
   handler_table[vector] = handler;
 }
 
+void Interrupt_RegisterFastHandler(uint8_t vector,
+                                   FastInterruptHandler handler) {
+  fast_table[vector] = handler;
+}
+
+static IrqStats irq_stats[256];
+
+static void Interrupt_Account(uint64_t vector, uint64_t cycles) {
+  IrqStats *s = &irq_stats[vector];
+  int bucket = cycles ? 63 - __builtin_clzll(cycles) : 0;
+  if (bucket >= IRQ_HIST_BUCKETS)
+    bucket = IRQ_HIST_BUCKETS - 1;
+
+  __atomic_fetch_add(&s->total_cycles, cycles, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&s->histogram[bucket], 1, __ATOMIC_RELAXED);
+  if (cycles > s->max_cycles)
+    s->max_cycles = cycles;
+}
+
+void Interrupt_GetStats(uint8_t vector, IrqStats *out) {
+  *out = irq_stats[vector];
+}
+
+// Called by the lean stubs. Returns 0 if the interrupt is fully handled,
+// otherwise the int_no for the full entry through isr_common.
+uint64_t Interrupt_FastDispatch(uint64_t vector, uint64_t cs) {
+  FastInterruptHandler fast = fast_table[vector];
+  if (!fast)
+    return vector; // Full entry, as if there were no lean stub
+
+  PERCPU_INC(irq_count);
+  __atomic_fetch_add(&irq_stats[vector].count, 1, __ATOMIC_RELAXED);
+  uint64_t start = Cpu_ReadTSC();
+  int full = fast((uint8_t)vector);
+  Interrupt_Account(vector, Cpu_ReadTSC() - start);
+
+  // Bottom halves, with interrupts enabled. Not counted as hard-IRQ time.
+  Softirq_IrqExit();
+
+  if (full || Scheduler_PreemptPending(cs))
+    return vector | INT_DEFERRED;
+  return 0;
+}
+
 uintptr_t ExceptionHandler(InterruptFrame *frame) {
+  if (frame->int_no & INT_DEFERRED) {
+    // Second half of a lean entry; the fast handler ran and was counted
+    InterruptFrame *f = frame;
+    uint8_t vector = frame->int_no & 0xFF;
+    if (handler_table[vector])
+      handler_table[vector](&f);
+    Scheduler_Preempt(&f);
+    return (uintptr_t)f;
+  }
+
+  PERCPU_INC(irq_count);
+  // int_no is 0x100 only for frames built by syscall_entry, never here
+  __atomic_fetch_add(&irq_stats[frame->int_no & 0xFF].count, 1,
+                     __ATOMIC_RELAXED);
   if (handler_table[frame->int_no]) {
     InterruptFrame *f = frame;
+    uint64_t start = Cpu_ReadTSC();
     handler_table[frame->int_no](&f);
+    Interrupt_Account(frame->int_no, Cpu_ReadTSC() - start);
+    // Device interrupts only; never with the interrupted code's IF clear
+    if (frame->int_no >= 32 && (frame->rflags & RFLAGS_IF))
+      Softirq_IrqExit();
+    Scheduler_Preempt(&f);
     return (uintptr_t)f;
   }
 
+  // First touch of a demand-paged ELF segment
+  int elf = Elf_HandlePageFault(frame);
+  if (elf > 0)
+    return (uintptr_t)frame;
+  // The page could not be loaded: a user task cannot go on. A kernel access
+  // (copy_from_user and friends) fails through its fixup below.
+  if (elf < 0 && (frame->cs & 3)) {
+    InterruptFrame *f = frame;
+    Scheduler_TerminateCurrentTask(&f);
+    return (uintptr_t)f;
+  }
+
+  // A bad pointer passed to copy_from_user and friends
+  if (Usercopy_Fixup(frame))
+    return (uintptr_t)frame;
+
   // Graphics_Clear(0x3B5998); // Blue screenish (Disabled to see debug logs)
   Graphics_Print(100, 100, "EXCEPTION OCCURRED!", 0xFFFFFF);
   Graphics_Print(100, 130, "INTERRUPT: ", 0xFFFFFF);
@@ -175,9 +267,84 @@ ISR_NOERR(28)
 ISR_ERR(29)
 ISR_ERR(30)
 ISR_NOERR(31)
-ISR_NOERR(33) // Vector 0x21
+// Lean stub for hot device IRQs. Saves only the registers a C call may
+// clobber (RAX, RCX, RDX, R8-R11 in the Windows x64 ABI) and calls
+// Interrupt_FastDispatch. Two slots are left for int_no/err_code so that,
+// when a full frame is needed after all, the stub can fill them in and
+// continue in isr_common as if it had been entered directly.
+//   [rsp]: r11 r10 r9 r8 rdx rcx rax | int_no err_code | rip cs ...
+// The hardware frame leaves RSP 8 mod 16; 16 + 56 bytes later plus the
+// shadow space it is 16-byte aligned for the call.
+#define ISR_FAST(n)                                                            \
+  asm(".global isr" #n "\n"                                                    \
+      "isr" #n ":\n"                                                           \
+      "  subq $16, %rsp\n"                                                     \
+      "  testb $3, 24(%rsp)\n"                                                 \
+      "  jz 1f\n"                                                              \
+      "  swapgs\n"                                                             \
+      "1:\n"                                                                   \
+      "  pushq %rax\n"                                                         \
+      "  pushq %rcx\n"                                                         \
+      "  pushq %rdx\n"                                                         \
+      "  pushq %r8\n"                                                          \
+      "  pushq %r9\n"                                                          \
+      "  pushq %r10\n"                                                         \
+      "  pushq %r11\n"                                                         \
+      "  movl $" #n ", %ecx\n"                                                 \
+      "  movq 80(%rsp), %rdx\n"                                                \
+      "  subq $32, %rsp\n"                                                     \
+      "  call Interrupt_FastDispatch\n"                                        \
+      "  addq $32, %rsp\n"                                                     \
+      "  jmp isr_fast_exit\n");
+
+ISR_FAST(33) // Vector 0x21
 
-ISR_NOERR(64) // Vector 0x40
+ISR_FAST(64) // Vector 0x40
+
+ISR_FAST(80) // Vectors 0x50-0x58 (NVMe queues)
+ISR_FAST(81)
+ISR_FAST(82)
+ISR_FAST(83)
+ISR_FAST(84)
+ISR_FAST(85)
+ISR_FAST(86)
+ISR_FAST(87)
+ISR_FAST(88)
+
+// RAX is the int_no for a full entry, or 0 if the interrupt is done
+asm("isr_fast_exit:\n"
+    "  testq %rax, %rax\n"
+    "  jnz 2f\n"
+    "  popq %r11\n"
+    "  popq %r10\n"
+    "  popq %r9\n"
+    "  popq %r8\n"
+    "  popq %rdx\n"
+    "  popq %rcx\n"
+    "  popq %rax\n"
+    "  addq $16, %rsp\n"
+    "  testb $3, 8(%rsp)\n" // CS
+    "  jz 1f\n"
+    "  swapgs\n"
+    "1:\n"
+    "  iretq\n"
+    "2:\n"
+    "  movq %rax, 56(%rsp)\n" // int_no
+    "  movq $0, 64(%rsp)\n"   // err_code
+    "  popq %r11\n"
+    "  popq %r10\n"
+    "  popq %r9\n"
+    "  popq %r8\n"
+    "  popq %rdx\n"
+    "  popq %rcx\n"
+    "  popq %rax\n"
+    "  testb $3, 24(%rsp)\n" // isr_common swaps GS again
+    "  jz 3f\n"
+    "  swapgs\n"
+    "3:\n"
+    "  jmp isr_common\n");
+
+ISR_NOERR(129) // Vector 0x81
 
 asm(".global isr_generic\n"
     "isr_generic:\n"
@@ -185,7 +352,14 @@ asm(".global isr_generic\n"
     "  pushq $255\n" // Generic flag
     "  jmp isr_common\n");
 
+// GS holds the per-CPU base in kernel mode. Coming from ring 3 (CS RPL in
+// the hardware frame, which sits above int_no/err_code) swap it in, and swap
+// it back out on the way back to ring 3.
 asm("isr_common:\n"
+    "  testb $3, 24(%rsp)\n" // CS
+    "  jz 1f\n"
+    "  swapgs\n"
+    "1:\n"
     "  pushq %rax\n"
     "  pushq %rbx\n"
     "  pushq %rcx\n"
@@ -225,6 +399,10 @@ asm("isr_common:\n"
     "  popq %rbx\n"
     "  popq %rax\n"
     "  addq $16, %rsp\n" // Clean up int_no and err_code
+    "  testb $3, 8(%rsp)\n" // CS
+    "  jz 2f\n"
+    "  swapgs\n"
+    "2:\n"
     "  iretq\n");
 
 void IDT_Init() {
@@ -267,9 +445,20 @@ void IDT_Init() {
   IDT_SetGate(30, isr30, KERNEL_CODE_SEL, 0x8E);
   IDT_SetGate(31, isr31, KERNEL_CODE_SEL, 0x8E);
 
+  IDT_SetIst(2, IST_NMI);
+  IDT_SetIst(8, IST_DOUBLE_FAULT);
+  IDT_SetIst(18, IST_MACHINE_CHECK);
+
   IDT_SetGate(33, isr33, KERNEL_CODE_SEL, 0x8E); // Vector 0x21 (Keyboard)
   IDT_SetGate(64, isr64, KERNEL_CODE_SEL, 0x8E); // Vector 0x40 (Timer)
 
+  // Vectors 0x50-0x58 (NVMe queues)
+  void (*nvme_isrs[INT_NVME_COUNT])() = {isr80, isr81, isr82, isr83, isr84,
+                                         isr85, isr86, isr87, isr88};
+  for (int i = 0; i < INT_NVME_COUNT; i++)
+    IDT_SetGate(INT_NVME + i, nvme_isrs[i], KERNEL_CODE_SEL, 0x8E);
+  IDT_SetGate(129, isr129, KERNEL_CODE_SEL, 0x8E); // Vector 0x81 (Yield)
+
   idt_ptr.limit = sizeof(idt) - 1;
   idt_ptr.base = (uint64_t)&idt;
 
@@ -4,6 +4,19 @@
 #include <stdint.h>
 
 #define INT_TIMER 0x40
+// NVMe queue vectors: queue ID n interrupts on INT_NVME + n
+#define INT_NVME 0x50
+#define INT_NVME_COUNT 9 // Admin queue and up to 8 I/O queues
+#define INT_YIELD 0x81 // Software interrupt used by kernel threads to yield
+
+// int_no of a frame saved by syscall_entry. Only its callee-saved registers,
+// RIP, RFLAGS and RSP are live, so syscall_entry can resume it with sysretq
+// instead of going through isr_restore.
+#define FRAME_SYSCALL 0x100
+
+// int_no flag of a frame built by the second half of a lean IRQ entry (see
+// Interrupt_RegisterFastHandler): the fast handler has already run.
+#define INT_DEFERRED 0x200
 
 typedef struct {
   uint16_t offset_low;
@@ -28,6 +41,23 @@ typedef struct {
 } InterruptFrame;
 
 typedef void (*InterruptHandler)(InterruptFrame **frame);
+// Runs from a lean entry stub that saves only the caller-saved registers,
+// so it must not switch tasks. Returns 1 if the vector's regular handler
+// should then run with a full frame.
+typedef int (*FastInterruptHandler)(uint8_t vector);
+
+// Per-vector statistics (SYSCALL_IRQ_STATS). Every entry is counted; the
+// time is that of the registered handler. Bucket n of the histogram counts
+// handler runs that took [2^n, 2^(n+1)) TSC cycles; the last bucket takes
+// the rest.
+#define IRQ_HIST_BUCKETS 32
+
+typedef struct {
+  uint64_t count;
+  uint64_t total_cycles;
+  uint64_t max_cycles;
+  uint64_t histogram[IRQ_HIST_BUCKETS];
+} IrqStats;
 
 extern const char *exception_messages[];
 
@@ -35,5 +65,12 @@ void IDT_Init();
 void IDT_SetGate(uint8_t vector, void *handler, uint16_t selector,
                  uint8_t type_attr);
 void Interrupt_RegisterHandler(uint8_t vector, InterruptHandler handler);
+// Only for the vectors with a lean stub: the timer, keyboard and NVMe
+// queue vectors. After the fast handler, the full frame is only built when
+// it asks for it or a reschedule is due (as in Scheduler_Preempt).
+void Interrupt_RegisterFastHandler(uint8_t vector,
+                                   FastInterruptHandler handler);
+void IDT_SetIst(uint8_t vector, uint8_t ist);
+void Interrupt_GetStats(uint8_t vector, IrqStats *out);
 
 #endif
@@ -1,28 +1,163 @@
 #include "ioapic.h"
+#include "irqbalance.h"
+#include "spinlock.h"
 
-static void *g_ioapic_base = 0;
+typedef struct {
+  void *base;
+  uint8_t id;
+  uint32_t gsi_base;
+  uint32_t pins; // Redirection entries
+} IOAPIC;
 
-static void ioapic_write(uint8_t reg, uint32_t val) {
-  volatile uint32_t *iowin = (uint32_t *)((uint8_t *)g_ioapic_base + 0x10);
-  volatile uint32_t *ioregsel = (uint32_t *)((uint8_t *)g_ioapic_base + 0x00);
+static IOAPIC g_ioapics[IOAPIC_MAX_CONTROLLERS];
+static int g_ioapic_count = 0;
+
+// ISA IRQ -> GSI and flags; identity, active high, edge unless overridden
+typedef struct {
+  uint32_t gsi;
+  uint16_t flags;
+} IOAPIC_IsaIrq;
+
+static IOAPIC_IsaIrq g_isa[IOAPIC_ISA_IRQS];
+static int g_isa_ready = 0;
+
+// Routes set up through IOAPIC_MapGSI, so they can be moved later
+typedef struct {
+  uint8_t vector;
+  uint8_t apic_id;
+  uint8_t mapped;
+} IOAPIC_Route;
+
+static IOAPIC_Route g_routes[IOAPIC_MAX_GSIS];
+
+// IOREGSEL/IOWIN is a two-step access; the balancer moves routes from a
+// worker thread while boot code may still be adding them
+static LockClass g_ioapic_class = LOCK_CLASS_INIT("ioapic");
+static Spinlock g_ioapic_lock = SPINLOCK_INIT(&g_ioapic_class);
+
+static void ioapic_write(IOAPIC *io, uint8_t reg, uint32_t val) {
+  volatile uint32_t *iowin = (uint32_t *)((uint8_t *)io->base + 0x10);
+  volatile uint32_t *ioregsel = (uint32_t *)((uint8_t *)io->base + 0x00);
   *ioregsel = reg;
   *iowin = val;
 }
 
-static uint32_t ioapic_read(uint8_t reg) {
-  volatile uint32_t *iowin = (uint32_t *)((uint8_t *)g_ioapic_base + 0x10);
-  volatile uint32_t *ioregsel = (uint32_t *)((uint8_t *)g_ioapic_base + 0x00);
+static uint32_t ioapic_read(IOAPIC *io, uint8_t reg) {
+  volatile uint32_t *iowin = (uint32_t *)((uint8_t *)io->base + 0x10);
+  volatile uint32_t *ioregsel = (uint32_t *)((uint8_t *)io->base + 0x00);
   *ioregsel = reg;
   return *iowin;
 }
 
-void IOAPIC_Init(void *base) { g_ioapic_base = base; }
+static IOAPIC *IOAPIC_ForGsi(uint32_t gsi) {
+  for (int i = 0; i < g_ioapic_count; i++) {
+    IOAPIC *io = &g_ioapics[i];
+    if (gsi >= io->gsi_base && gsi < io->gsi_base + io->pins)
+      return io;
+  }
+  return 0;
+}
+
+static void IOAPIC_InitIsa() {
+  if (g_isa_ready)
+    return;
+  for (int i = 0; i < IOAPIC_ISA_IRQS; i++) {
+    g_isa[i].gsi = i;
+    g_isa[i].flags = 0;
+  }
+  g_isa_ready = 1;
+}
+
+void IOAPIC_Add(uint8_t id, void *base, uint32_t gsi_base) {
+  if (g_ioapic_count >= IOAPIC_MAX_CONTROLLERS)
+    return;
 
-void IOAPIC_MapIRQ(uint8_t irq, uint8_t vector, uint8_t apic_id) {
-  uint32_t low =
-      vector; // Delivery Mode: Fixed (0), Destination Mode: Physical (0)
+  uint64_t flags = Spinlock_LockIrqSave(&g_ioapic_lock);
+  IOAPIC *io = &g_ioapics[g_ioapic_count++];
+  io->base = base;
+  io->id = id;
+  io->gsi_base = gsi_base;
+  // VER[23:16] is the index of the last redirection entry
+  io->pins = ((ioapic_read(io, IOAPIC_REG_VER) >> 16) & 0xFF) + 1;
+
+  // Nothing is delivered until someone maps it
+  for (uint32_t pin = 0; pin < io->pins; pin++)
+    ioapic_write(io, IOAPIC_REG_REDTBL + 2 * pin, IOAPIC_REDIR_MASKED);
+  Spinlock_UnlockIrqRestore(&g_ioapic_lock, flags);
+}
+
+void IOAPIC_AddOverride(uint8_t irq, uint32_t gsi, uint16_t flags) {
+  IOAPIC_InitIsa();
+  if (irq >= IOAPIC_ISA_IRQS)
+    return;
+  g_isa[irq].gsi = gsi;
+  g_isa[irq].flags = flags;
+}
+
+// Balancer callback: only the destination (high dword) changes, a single
+// register write, so the pin never has to be masked and no edge is lost
+static void IOAPIC_Retarget(uint8_t vector, uint8_t apic_id, void *ctx) {
+  (void)vector;
+  uint32_t gsi = (uint32_t)(uintptr_t)ctx;
+  IOAPIC *io = IOAPIC_ForGsi(gsi);
+  if (!io || gsi >= IOAPIC_MAX_GSIS)
+    return;
+
+  uint64_t flags = Spinlock_LockIrqSave(&g_ioapic_lock);
+  uint32_t pin = gsi - io->gsi_base;
+  ioapic_write(io, IOAPIC_REG_REDTBL + 2 * pin + 1, (uint32_t)apic_id << 24);
+  g_routes[gsi].apic_id = apic_id;
+  Spinlock_UnlockIrqRestore(&g_ioapic_lock, flags);
+}
+
+int IOAPIC_MapGSI(uint32_t gsi, uint8_t vector, uint8_t apic_id,
+                  uint16_t flags) {
+  IOAPIC *io = IOAPIC_ForGsi(gsi);
+  if (!io)
+    return -1;
+
+  // Delivery Mode: Fixed (0), Destination Mode: Physical (0)
+  uint32_t low = vector;
+  if ((flags & MPS_INTI_POLARITY_MASK) == MPS_INTI_POLARITY_LOW)
+    low |= IOAPIC_REDIR_ACTIVE_LOW;
+  if ((flags & MPS_INTI_TRIGGER_MASK) == MPS_INTI_TRIGGER_LEVEL)
+    low |= IOAPIC_REDIR_LEVEL;
   uint32_t high = (uint32_t)apic_id << 24;
 
-  ioapic_write(IOAPIC_REG_REDTBL + 2 * irq, low);
-  ioapic_write(IOAPIC_REG_REDTBL + 2 * irq + 1, high);
+  uint64_t irq_flags = Spinlock_LockIrqSave(&g_ioapic_lock);
+  uint32_t pin = gsi - io->gsi_base;
+  ioapic_write(io, IOAPIC_REG_REDTBL + 2 * pin + 1, high);
+  ioapic_write(io, IOAPIC_REG_REDTBL + 2 * pin, low);
+
+  if (gsi < IOAPIC_MAX_GSIS) {
+    g_routes[gsi].vector = vector;
+    g_routes[gsi].apic_id = apic_id;
+    g_routes[gsi].mapped = 1;
+  }
+  Spinlock_UnlockIrqRestore(&g_ioapic_lock, irq_flags);
+
+  if (gsi < IOAPIC_MAX_GSIS)
+    IrqBalance_Register(vector, apic_id, IOAPIC_Retarget,
+                        (void *)(uintptr_t)gsi);
+  return 0;
+}
+
+void IOAPIC_MapIRQ(uint8_t irq, uint8_t vector, uint8_t apic_id) {
+  IOAPIC_InitIsa();
+  if (irq < IOAPIC_ISA_IRQS)
+    IOAPIC_MapGSI(g_isa[irq].gsi, vector, apic_id, g_isa[irq].flags);
+  else
+    IOAPIC_MapGSI(irq, vector, apic_id, 0);
+}
+
+void IOAPIC_RetargetIRQs(uint8_t from_apic_id, uint8_t to_apic_id) {
+  for (int gsi = 0; gsi < IOAPIC_MAX_GSIS; gsi++) {
+    if (g_routes[gsi].mapped && g_routes[gsi].apic_id == from_apic_id) {
+      IOAPIC_Retarget(g_routes[gsi].vector, to_apic_id,
+                      (void *)(uintptr_t)gsi);
+      // Keep the balancer's view of the placement in step
+      IrqBalance_Register(g_routes[gsi].vector, to_apic_id, IOAPIC_Retarget,
+                          (void *)(uintptr_t)gsi);
+    }
+  }
 }
@@ -8,7 +8,40 @@
 #define IOAPIC_REG_ARB 0x02
 #define IOAPIC_REG_REDTBL 0x10
 
-void IOAPIC_Init(void *base);
+// Redirection entry, low dword
+#define IOAPIC_REDIR_ACTIVE_LOW (1 << 13)
+#define IOAPIC_REDIR_LEVEL (1 << 15)
+#define IOAPIC_REDIR_MASKED (1 << 16)
+
+#define IOAPIC_MAX_CONTROLLERS 4
+#define IOAPIC_MAX_GSIS 96 // Routes tracked, by global system interrupt
+#define IOAPIC_ISA_IRQS 16
+
+// MPS INTI flags, as found in MADT Interrupt Source Overrides
+#define MPS_INTI_POLARITY_MASK 0x3
+#define MPS_INTI_POLARITY_HIGH 0x1
+#define MPS_INTI_POLARITY_LOW 0x3
+#define MPS_INTI_TRIGGER_MASK 0xC
+#define MPS_INTI_TRIGGER_EDGE 0x4
+#define MPS_INTI_TRIGGER_LEVEL 0xC
+
+// Registers an IOAPIC from the MADT. Its pins serve GSIs gsi_base up to
+// gsi_base + (number of redirection entries) - 1; they start out masked.
+void IOAPIC_Add(uint8_t id, void *base, uint32_t gsi_base);
+// Records a MADT Interrupt Source Override: ISA IRQ 'irq' arrives on 'gsi'
+// with the polarity and trigger mode in 'flags' (MPS INTI flags).
+void IOAPIC_AddOverride(uint8_t irq, uint32_t gsi, uint16_t flags);
+
+// Routes ISA IRQ 'irq' (after overrides) to 'vector' on 'apic_id'
 void IOAPIC_MapIRQ(uint8_t irq, uint8_t vector, uint8_t apic_id);
+// Routes 'gsi' to 'vector' on 'apic_id'. 'flags' are MPS INTI flags;
+// conforming (0) means active high, edge triggered. Returns -1 if no IOAPIC
+// serves 'gsi'. The route is handed to the IRQ balancer.
+int IOAPIC_MapGSI(uint32_t gsi, uint8_t vector, uint8_t apic_id,
+                  uint16_t flags);
+
+// Moves every IRQ currently delivered to 'from_apic_id' over to
+// 'to_apic_id', e.g. to keep device interrupts off isolated CPUs.
+void IOAPIC_RetargetIRQs(uint8_t from_apic_id, uint8_t to_apic_id);
 
 #endif
@@ -0,0 +1,129 @@
+#include "irqbalance.h"
+#include "interrupt.h"
+#include "percpu.h"
+#include "schedule.h"
+#include "spinlock.h"
+#include "workqueue.h"
+#include <stddef.h>
+
+typedef struct {
+  uint8_t vector;
+  uint8_t apic_id;     // Where it is delivered now
+  uint64_t last_count; // Interrupt count at the previous pass
+  uint64_t rate;       // Interrupts during the last interval
+  IrqRetargetFn fn;
+  void *ctx;
+} BalancedIrq;
+
+static BalancedIrq irqs[IRQBALANCE_MAX_IRQS];
+static int irq_count = 0;
+
+static LockClass irqbalance_class = LOCK_CLASS_INIT("irqbalance");
+static Spinlock irqbalance_lock = SPINLOCK_INIT(&irqbalance_class);
+
+static WorkItem balance_work;
+
+int IrqBalance_Register(uint8_t vector, uint8_t apic_id, IrqRetargetFn fn,
+                        void *ctx) {
+  uint64_t flags = Spinlock_LockIrqSave(&irqbalance_lock);
+  BalancedIrq *irq = NULL;
+  for (int i = 0; i < irq_count; i++) {
+    if (irqs[i].vector == vector)
+      irq = &irqs[i];
+  }
+  if (!irq) {
+    if (irq_count >= IRQBALANCE_MAX_IRQS) {
+      Spinlock_UnlockIrqRestore(&irqbalance_lock, flags);
+      return -1;
+    }
+    irq = &irqs[irq_count++];
+    IrqStats stats;
+    Interrupt_GetStats(vector, &stats);
+    irq->vector = vector;
+    irq->last_count = stats.count;
+    irq->rate = 0;
+  }
+  irq->apic_id = apic_id;
+  irq->fn = fn;
+  irq->ctx = ctx;
+  Spinlock_UnlockIrqRestore(&irqbalance_lock, flags);
+  return 0;
+}
+
+int IrqBalance_Run(void) {
+  // Load of each CPU that may take device interrupts; -1 for the others
+  int64_t load[MAX_CPUS];
+  uint64_t isolated = Scheduler_GetIsolatedCpus();
+  int usable = 0;
+  for (uint32_t i = 0; i < MAX_CPUS; i++) {
+    load[i] = -1;
+    if (i < PerCpu_Count() && PerCpu_Get(i) && !(isolated & (1ULL << i))) {
+      load[i] = 0;
+      usable++;
+    }
+  }
+  if (!usable)
+    return 0;
+
+  uint64_t flags = Spinlock_LockIrqSave(&irqbalance_lock);
+
+  // Rates over the last interval, and the IRQs ordered busiest first
+  int order[IRQBALANCE_MAX_IRQS];
+  for (int i = 0; i < irq_count; i++) {
+    IrqStats stats;
+    Interrupt_GetStats(irqs[i].vector, &stats);
+    irqs[i].rate = stats.count - irqs[i].last_count;
+    irqs[i].last_count = stats.count;
+
+    int j = i;
+    while (j > 0 && irqs[order[j - 1]].rate < irqs[i].rate) {
+      order[j] = order[j - 1];
+      j--;
+    }
+    order[j] = i;
+  }
+
+  int moved = 0;
+  for (int k = 0; k < irq_count; k++) {
+    BalancedIrq *irq = &irqs[order[k]];
+    int64_t rate = (int64_t)irq->rate;
+
+    int best = -1;
+    int current = -1;
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+      if (load[i] < 0)
+        continue;
+      if (best < 0 || load[i] < load[best])
+        best = i;
+      if (PerCpu_Get(i)->apic_id == irq->apic_id)
+        current = i;
+    }
+
+    // Stay unless the current CPU is not allowed or clearly busier
+    int target = best;
+    if (current >= 0 && load[current] <= load[best] + rate / 4)
+      target = current;
+    load[target] += rate;
+
+    uint8_t apic_id = (uint8_t)PerCpu_Get(target)->apic_id;
+    if (apic_id != irq->apic_id) {
+      irq->fn(irq->vector, apic_id, irq->ctx);
+      irq->apic_id = apic_id;
+      moved++;
+    }
+  }
+
+  Spinlock_UnlockIrqRestore(&irqbalance_lock, flags);
+  return moved;
+}
+
+static void IrqBalance_Work(void *arg) {
+  (void)arg;
+  IrqBalance_Run();
+  Workqueue_QueueDelayed(&balance_work, IRQBALANCE_INTERVAL_MS);
+}
+
+void IrqBalance_Start(void) {
+  Work_Init(&balance_work, IrqBalance_Work, NULL);
+  Workqueue_QueueDelayed(&balance_work, IRQBALANCE_INTERVAL_MS);
+}
@@ -0,0 +1,30 @@
+#ifndef IRQBALANCE_H
+#define IRQBALANCE_H
+
+#include <stdint.h>
+
+// IRQ balancer: spreads device interrupts over the CPUs by their observed
+// rate (Interrupt_GetStats counts). Each pass sorts the registered IRQs by
+// interrupts since the previous pass and gives each to the least loaded
+// CPU. An IRQ stays put unless moving it takes a quarter of its own rate
+// off its CPU, so steady loads do not bounce around. Isolated CPUs
+// (Scheduler_IsolateCpus) never get device interrupts.
+
+#define IRQBALANCE_MAX_IRQS 32
+#define IRQBALANCE_INTERVAL_MS 1000
+
+// Moves 'vector' to the CPU whose local APIC ID is 'apic_id'
+typedef void (*IrqRetargetFn)(uint8_t vector, uint8_t apic_id, void *ctx);
+
+// Hands 'vector', currently delivered to 'apic_id', to the balancer.
+// Registering a vector again updates its placement and callback.
+// Returns -1 if the table is full.
+int IrqBalance_Register(uint8_t vector, uint8_t apic_id, IrqRetargetFn fn,
+                        void *ctx);
+// One balancing pass. Returns the number of IRQs moved.
+int IrqBalance_Run(void);
+// Runs a pass every IRQBALANCE_INTERVAL_MS from the workqueue. Call after
+// Workqueue_Init.
+void IrqBalance_Start(void);
+
+#endif
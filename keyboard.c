@@ -3,11 +3,32 @@
 #include "graphics.h"
 #include "io.h"
 #include "schedule.h"
+#include "softirq.h"
 #include "timer.h"
+#include "workqueue.h"
 #include <stddef.h>
 
 static char last_char = 0;
 
+// Keys waiting to be echoed. The softirq is the only producer and the
+// echo work item the only consumer.
+#define KEY_BUFFER_SIZE 64
+static char key_buffer[KEY_BUFFER_SIZE];
+static volatile uint32_t key_head = 0;
+static volatile uint32_t key_tail = 0;
+static WorkItem key_echo_work;
+static int key_echo_ready = 0;
+
+// Draws buffered keys from the worker thread instead of the IRQ handler
+static void Keyboard_EchoWork(void *arg) {
+  (void)arg;
+  while (key_tail != key_head) {
+    char c = key_buffer[key_tail % KEY_BUFFER_SIZE];
+    key_tail++;
+    Graphics_PutChar(100 + (Timer_GetTicks() % 50) * 8, 550, c, 0xFFFFFF);
+  }
+}
+
 const char scancode_to_ascii[] = {
     0,    27,  '1', '2', '3',  '4', '5', '6', '7',  '8', /* 9 */
     '9',  '0', '-', '=', '\b',                           /* Backspace */
@@ -41,34 +62,61 @@ const char scancode_to_ascii[] = {
     0, /* All other keys are undefined */
 };
 
-void Keyboard_Handler(InterruptFrame **frame_ptr) {
-  uint8_t scancode = inb(0x60);
-  LAPIC_SendEOI();
+// Scancodes read by the IRQ handler, translated by the softirq. Both run on
+// the CPU that takes the keyboard IRQ; the handler is the only producer.
+#define SCANCODE_BUFFER_SIZE 32
+static uint8_t scancode_buffer[SCANCODE_BUFFER_SIZE];
+static volatile uint32_t scancode_head = 0;
+static volatile uint32_t scancode_tail = 0;
 
-  if (scancode == 0x3A) { // CapsLock Make
-    Scheduler_Switch(frame_ptr);
-    return;
-  }
+void Keyboard_Softirq(void) {
+  while (scancode_tail != scancode_head) {
+    uint8_t scancode = scancode_buffer[scancode_tail % SCANCODE_BUFFER_SIZE];
+    scancode_tail++;
 
-  if (scancode == 0x01) { // ESC Key Make
-    Scheduler_TerminateCurrentTask(frame_ptr);
-    return;
-  }
+    if (scancode == 0x3A) { // CapsLock Make
+      Scheduler_Request(SCHED_REQUEST_SWITCH);
+      continue;
+    }
+    if (scancode == 0x01) { // ESC Key Make
+      Scheduler_Request(SCHED_REQUEST_TERMINATE);
+      continue;
+    }
 
-  if (scancode & 0x80) {
-    // Key release
-  } else {
-    // Key press
-    if (scancode < sizeof(scancode_to_ascii)) {
-      last_char = scancode_to_ascii[scancode];
-      if (last_char) {
-        Graphics_PutChar(100 + (Timer_GetTicks() % 50) * 8, 550, last_char,
-                         0xFFFFFF);
+    if (scancode & 0x80) {
+      // Key release
+    } else {
+      // Key press
+      if (scancode < sizeof(scancode_to_ascii)) {
+        last_char = scancode_to_ascii[scancode];
+        if (last_char && key_head - key_tail < KEY_BUFFER_SIZE) {
+          key_buffer[key_head % KEY_BUFFER_SIZE] = last_char;
+          key_head++;
+          if (!key_echo_ready) {
+            Work_Init(&key_echo_work, Keyboard_EchoWork, NULL);
+            key_echo_ready = 1;
+          }
+          Workqueue_Queue(&key_echo_work);
+        }
       }
     }
   }
 }
 
+int Keyboard_Handler(uint8_t vector) {
+  (void)vector;
+  uint8_t scancode = inb(0x60);
+  LAPIC_SendEOI();
+
+  // Dropped if the softirq has fallen that far behind
+  if (scancode_head - scancode_tail < SCANCODE_BUFFER_SIZE) {
+    scancode_buffer[scancode_head % SCANCODE_BUFFER_SIZE] = scancode;
+    scancode_head++;
+  }
+  Softirq_Raise(SOFTIRQ_KEYBOARD);
+  return 0;
+}
+
 char Keyboard_GetLastChar() {
   char c = last_char;
   last_char = 0;
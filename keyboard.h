@@ -7,7 +7,11 @@
 #define KEYBOARD_IRQ 1
 #define INT_KEYBOARD 0x21
 
-void Keyboard_Handler(InterruptFrame **frame);
+// Fast handler for INT_KEYBOARD: reads the scancode and leaves the rest to
+// Keyboard_Softirq (SOFTIRQ_KEYBOARD). CapsLock and ESC switch tasks through
+// Scheduler_Request.
+int Keyboard_Handler(uint8_t vector);
+void Keyboard_Softirq(void);
 char Keyboard_GetLastChar();
 
 #endif
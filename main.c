@@ -1,18 +1,26 @@
 #include "acpi.h"
 #include "apic.h"
+#include "bcache.h"
+#include "cmdline.h"
 #include "efi.h"
 #include "gdt.h"
 #include "graphics.h"
 #include "interrupt.h"
 #include "ioapic.h"
+#include "irqbalance.h"
 #include "keyboard.h"
 #include "libc.h"
 #include "memory.h"
 #include "nvme.h"
 #include "pci.h"
+#include "percpu.h"
+#include "schedbench.h"
 #include "schedule.h"
+#include "softirq.h"
 #include "syscall.h" // Added include
 #include "timer.h"
+#include "vdso.h"
+#include "workqueue.h"
 // Helper to print a hex number (very primitive)
 void PrintHex(EFI_SYSTEM_TABLE *SystemTable, uint64_t val) {
   uint16_t out[19];
@@ -49,7 +57,10 @@ void SwitchToUserMode(void *entry_point, void *user_stack) {
   // Selectors for User Mode (Ring 3)
   // USER_DATA_SEL (Index 3) = 0x18 | 3 = 0x1B
   // USER_CODE_SEL (Index 4) = 0x20 | 3 = 0x23
-  asm volatile("mov $0x1B, %%ax\n" // User Data Segment
+  // Loading %gs zeroes GS_BASE, and an interrupt taken in ring 0 does no
+  // swapgs, so keep interrupts off until iretq restores IF from RFLAGS.
+  asm volatile("cli\n"
+               "mov $0x1B, %%ax\n" // User Data Segment
                "mov %%ax, %%ds\n"
                "mov %%ax, %%es\n"
                "mov %%ax, %%fs\n"
@@ -108,6 +119,9 @@ void UserMain() {
                :
                : "r"(msg2)
                : "rax", "rdi", "rsi", "rcx", "r11");
+#ifdef SCHED_BENCH
+  SchedBench_RunUser();
+#endif
   asm volatile("mov $4, %%rax\n"
                "syscall\n"
                :
@@ -130,6 +144,7 @@ void KernelMain(EFI_PHYSICAL_ADDRESS fb_base, uint32_t width, uint32_t height,
   }
 
   GDT_Init();
+  PerCpu_Init(0); // Boot CPU; GS based accessors work from here on
   IDT_Init();
   Syscall_Init();
 
@@ -164,26 +179,59 @@ void KernelMain(EFI_PHYSICAL_ADDRESS fb_base, uint32_t width, uint32_t height,
     if (madt) {
       // ... (All existing APIC/Timer init logic) ...
       // Initialize LAPIC
-      LAPIC_Init((void *)(uintptr_t)madt->LocalApicAddress);
-      Interrupt_RegisterHandler(INT_TIMER, Timer_Handler);
-      Interrupt_RegisterHandler(INT_KEYBOARD, Keyboard_Handler);
+      // x2apic=off keeps the MMIO (xAPIC) interface
+      const char *x2apic = Cmdline_Get("x2apic");
+      int allow_x2apic =
+          !(x2apic && x2apic[0] == 'o' && x2apic[1] == 'f' && x2apic[2] == 'f');
+      LAPIC_Init((void *)(uintptr_t)madt->LocalApicAddress, allow_x2apic);
+      PerCpu_This()->apic_id = LAPIC_GetId();
+      Interrupt_RegisterFastHandler(INT_TIMER, Timer_Handler);
+      Interrupt_RegisterFastHandler(INT_KEYBOARD, Keyboard_Handler);
+      Softirq_Register(SOFTIRQ_TIMER, Timer_Softirq);
+      Softirq_Register(SOFTIRQ_KEYBOARD, Keyboard_Softirq);
       uint32_t ticks_10ms = LAPIC_CalibrateTimer();
+      Vdso_Init(LAPIC_GetTscFrequency());
       LAPIC_TimerInit(ticks_10ms / 10);
 
+      // Every IOAPIC and ISA override first, then the routes
       uint8_t *ptr = (uint8_t *)madt->InterruptControllers;
       uint8_t *end = (uint8_t *)madt + madt->Header.Length;
       while (ptr < end) {
         MADT_EntryHeader *h = (MADT_EntryHeader *)ptr;
+        if (h->Length == 0)
+          break;
         if (h->Type == MADT_TYPE_IOAPIC) {
           MADT_IoApic *io = (MADT_IoApic *)ptr;
-          IOAPIC_Init((void *)(uintptr_t)io->IoApicAddress);
-          IOAPIC_MapIRQ(1, INT_KEYBOARD, 0);
-          break;
+          IOAPIC_Add(io->IoApicId, (void *)(uintptr_t)io->IoApicAddress,
+                     io->GlobalSystemInterruptBase);
+        } else if (h->Type == MADT_TYPE_ISO) {
+          MADT_InterruptOverride *iso = (MADT_InterruptOverride *)ptr;
+          if (iso->Bus == 0) // ISA
+            IOAPIC_AddOverride(iso->Source, iso->GlobalSystemInterrupt,
+                               iso->Flags);
         }
         ptr += h->Length;
       }
+      IOAPIC_MapIRQ(KEYBOARD_IRQ, INT_KEYBOARD, PerCpu_This()->apic_id);
 
       Scheduler_Init();
+
+      // isolcpus=<list>: reserve CPUs for pinned tasks and keep device
+      // interrupts on the boot CPU
+      uint64_t isolated;
+      if (Cmdline_GetCpuList("isolcpus", &isolated)) {
+        Scheduler_IsolateCpus(isolated);
+        isolated = Scheduler_GetIsolatedCpus();
+        for (uint32_t i = 0; i < MAX_CPUS; i++) {
+          CpuData *cpu = PerCpu_Get(i);
+          if (cpu && (isolated & (1ULL << i)))
+            IOAPIC_RetargetIRQs(cpu->apic_id, PerCpu_This()->apic_id);
+        }
+      }
+
+      Workqueue_Init(1); // Single CPU for now
+      Softirq_Init(1);
+      IrqBalance_Start();
       asm volatile("sti");
 
       PCI_Init();
@@ -191,6 +239,23 @@ void KernelMain(EFI_PHYSICAL_ADDRESS fb_base, uint32_t width, uint32_t height,
       if (nvme) {
         NVMe_Init(nvme);
 
+        // nvme_coalesce=<threshold>,<time>: hold completion interrupts back
+        // until 'threshold' (1-256) are pending or 'time' x 100us passed
+        uint32_t coalesce[2];
+        if (Cmdline_GetNumbers("nvme_coalesce", coalesce, 2) == 2) {
+          uint16_t threshold;
+          uint8_t time_100us;
+          if (coalesce[0] > 256 || coalesce[1] > 255 ||
+              NVMe_SetInterruptCoalescing((uint16_t)coalesce[0],
+                                          (uint8_t)coalesce[1]) != 0 ||
+              NVMe_GetInterruptCoalescing(&threshold, &time_100us) != 0 ||
+              threshold != coalesce[0] || time_100us != coalesce[1])
+            Graphics_Print(100, 700, "NVME: COALESCING REJECTED", 0xDC322F);
+        }
+
+        if (BCache_Init(BCACHE_DEFAULT_BUDGET) != 0)
+          Graphics_Print(100, 620, "BCACHE: INIT FAILED", 0xDC322F);
+
         // Write 1 block (LBA 0) with pattern
         /***
         uint8_t *write_buf = kmalloc(4096);
@@ -235,6 +300,10 @@ void KernelMain(EFI_PHYSICAL_ADDRESS fb_base, uint32_t width, uint32_t height,
         Graphics_Print(100, 600, "PCI: NO NVME FOUND", 0xDC322F);
       }
 
+#ifdef SCHED_BENCH
+      SchedBench_RunKernel();
+#endif
+
       // --- RING 3 SWITCHING ---
       Graphics_Print(100, 525, "PREPARING USER MODE...", 0x268BD2);
 
@@ -243,7 +312,7 @@ void KernelMain(EFI_PHYSICAL_ADDRESS fb_base, uint32_t width, uint32_t height,
       // from TSS.RSP0
       void *kernel_stack = kmalloc(4096);
       if (kernel_stack) {
-        TSS_SetStack((uint64_t)kernel_stack + 4096);
+        PerCpu_SetKernelStack((uint64_t)kernel_stack + 4096);
       } else {
         Graphics_Print(100, 550, "KSTACK ALLOC FAIL", 0xDC322F);
         while (1)
@@ -348,6 +417,10 @@ EFI_STATUS EFIAPI EfiMain(EFI_HANDLE ImageHandle,
       ;
   }
 
+  // Boot options live in boot services memory; keep a copy
+  Cmdline_Init((const uint16_t *)loaded_image->LoadOptions,
+               loaded_image->LoadOptionsSize);
+
   // Find RSDP from ConfigurationTable
   RSDP *rsdp = NULL;
   EFI_GUID acpi_20_guid = ACPI_20_TABLE_GUID;
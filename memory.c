@@ -1,10 +1,18 @@
 #include "memory.h"
+#include "spinlock.h"
 #include <stddef.h>
 
 uint8_t bitmap[MAX_PAGES / 8];
 uint64_t total_pages = 0;
 PageTable *g_kernel_pml4 = NULL;
 
+// Lock order: page_table_lock -> page_alloc_lock
+static LockClass page_alloc_class = LOCK_CLASS_INIT("page_alloc");
+static Spinlock page_alloc_lock = SPINLOCK_INIT(&page_alloc_class);
+static LockClass page_table_class = LOCK_CLASS_INIT("page_table");
+// Demand paging looks entries up far more often than it changes them
+static RwLock page_table_lock = RWLOCK_INIT(&page_table_class);
+
 void PageAllocator_Init(EFI_MEMORY_DESCRIPTOR *map, UINTN map_size,
                         UINTN desc_size) {
   // Clear bitmap (mark all as used initially)
@@ -40,6 +48,7 @@ void PageAllocator_Init(EFI_MEMORY_DESCRIPTOR *map, UINTN map_size,
 }
 
 void PageAllocator_MarkUsed(void *ptr, UINTN pages) {
+  uint64_t flags = Spinlock_LockIrqSave(&page_alloc_lock);
   uint64_t start_page = (uintptr_t)ptr / PAGE_SIZE;
   for (uint64_t i = 0; i < pages; i++) {
     uint64_t page = start_page + i;
@@ -47,12 +56,15 @@ void PageAllocator_MarkUsed(void *ptr, UINTN pages) {
       bitmap[page / 8] |= (1 << (page % 8));
     }
   }
+  Spinlock_UnlockIrqRestore(&page_alloc_lock, flags);
 }
 
 void *PageAllocator_Alloc(UINTN pages) {
   if (pages == 0 || pages > total_pages)
     return NULL;
 
+  uint64_t flags = Spinlock_LockIrqSave(&page_alloc_lock);
+
   for (uint64_t i = 1; i <= total_pages - pages; i++) {
     uint64_t found = 0;
     for (uint64_t j = 0; j < pages; j++) {
@@ -67,14 +79,17 @@ void *PageAllocator_Alloc(UINTN pages) {
       for (uint64_t j = 0; j < pages; j++) {
         bitmap[(i + j) / 8] |= (1 << ((i + j) % 8));
       }
+      Spinlock_UnlockIrqRestore(&page_alloc_lock, flags);
       return (void *)(i * PAGE_SIZE);
     }
   }
 
+  Spinlock_UnlockIrqRestore(&page_alloc_lock, flags);
   return NULL;
 }
 
 void PageAllocator_Free(void *ptr, UINTN pages) {
+  uint64_t flags = Spinlock_LockIrqSave(&page_alloc_lock);
   uint64_t start_page = (uintptr_t)ptr / PAGE_SIZE;
   for (uint64_t i = 0; i < pages; i++) {
     uint64_t page = start_page + i;
@@ -82,6 +97,7 @@ void PageAllocator_Free(void *ptr, UINTN pages) {
       bitmap[page / 8] &= ~(1 << (page % 8));
     }
   }
+  Spinlock_UnlockIrqRestore(&page_alloc_lock, flags);
 }
 
 static PageTable *GetOrCreateTable(PageTable *table, int index) {
@@ -111,36 +127,59 @@ void PageTable_Map(PageTable *pml4, void *virt, void *phys, uint64_t flags) {
   int pd_idx = (v >> 21) & 0x1FF;
   int pt_idx = (v >> 12) & 0x1FF;
 
+  uint64_t irq = RwLock_WriteLockIrqSave(&page_table_lock);
   PageTable *pdp = GetOrCreateTable(pml4, pml4_idx);
   PageTable *pd = GetOrCreateTable(pdp, pdp_idx);
   PageTable *pt = GetOrCreateTable(pd, pd_idx);
 
   pt->entries[pt_idx] = (uint64_t)phys | flags | PAGE_PRESENT;
+  RwLock_WriteUnlockIrqRestore(&page_table_lock, irq);
 }
 
-void PageTable_UnMap(PageTable *pml4, void *virt) {
-  uint64_t v = (uint64_t)virt;
+// Returns the page table that maps 'v', or NULL if it does not exist
+static PageTable *FindTable(PageTable *pml4, uint64_t v) {
   int pml4_idx = (v >> 39) & 0x1FF;
   int pdp_idx = (v >> 30) & 0x1FF;
   int pd_idx = (v >> 21) & 0x1FF;
-  int pt_idx = (v >> 12) & 0x1FF;
 
   if (!(pml4->entries[pml4_idx] & PAGE_PRESENT))
-    return;
+    return NULL;
   PageTable *pdp = (PageTable *)(pml4->entries[pml4_idx] & ~0xFFFULL);
 
   if (!(pdp->entries[pdp_idx] & PAGE_PRESENT))
-    return;
+    return NULL;
   PageTable *pd = (PageTable *)(pdp->entries[pdp_idx] & ~0xFFFULL);
 
   if (!(pd->entries[pd_idx] & PAGE_PRESENT))
-    return;
-  PageTable *pt = (PageTable *)(pd->entries[pd_idx] & ~0xFFFULL);
+    return NULL;
+  return (PageTable *)(pd->entries[pd_idx] & ~0xFFFULL);
+}
+
+void PageTable_UnMap(PageTable *pml4, void *virt) {
+  uint64_t v = (uint64_t)virt;
+  int pt_idx = (v >> 12) & 0x1FF;
 
-  pt->entries[pt_idx] = 0;
+  uint64_t irq = RwLock_WriteLockIrqSave(&page_table_lock);
+  PageTable *pt = FindTable(pml4, v);
+  if (pt) {
+    pt->entries[pt_idx] = 0;
 
-  // Invalidate TLB
-  asm volatile("invlpg (%0)" : : "r"(virt) : "memory");
+    // Invalidate TLB
+    asm volatile("invlpg (%0)" : : "r"(virt) : "memory");
+  }
+  RwLock_WriteUnlockIrqRestore(&page_table_lock, irq);
+}
+
+uint64_t PageTable_Lookup(PageTable *pml4, void *virt) {
+  uint64_t v = (uint64_t)virt;
+  uint64_t pte = 0;
+
+  uint64_t irq = RwLock_ReadLockIrqSave(&page_table_lock);
+  PageTable *pt = FindTable(pml4, v);
+  if (pt)
+    pte = pt->entries[(v >> 12) & 0x1FF];
+  RwLock_ReadUnlockIrqRestore(&page_table_lock, irq);
+  return pte;
 }
 
 void PageTable_Init(void *kernel_base, uint64_t kernel_size, void *fb_base,
@@ -26,8 +26,12 @@ typedef struct {
 void PageTable_Init(void *kernel_base, uint64_t kernel_size, void *fb_base,
                     uint64_t fb_size, EFI_MEMORY_DESCRIPTOR *map,
                     UINTN map_size, UINTN desc_size, uint64_t lapic_addr);
+extern PageTable *g_kernel_pml4;
+
 void PageTable_Map(PageTable *pml4, void *virt, void *phys, uint64_t flags);
 void PageTable_UnMap(PageTable *pml4, void *virt);
+// Returns the page table entry for 'virt' (0 if not mapped)
+uint64_t PageTable_Lookup(PageTable *pml4, void *virt);
 void Memory_MapMMIO(void *phys_addr, uint64_t size);
 
 #include "heap.h"
@@ -2,7 +2,12 @@
 #include "graphics.h"
 #include "heap.h"
 #include "libc.h"
+#include "apic.h"
+#include "interrupt.h"
 #include "memory.h"
+#include "percpu.h"
+#include "schedule.h"
+#include "softirq.h"
 #include "timer.h"
 
 // Define a simple wait helper (primitive delay)
@@ -16,11 +21,9 @@ static NVMe_Context g_nvme_ctx;
 static uint8_t g_admin_sq_buffer[4096] __attribute__((aligned(4096)));
 static uint8_t g_admin_cq_buffer[4096] __attribute__((aligned(4096)));
 static uint8_t g_identify_buffer[4096] __attribute__((aligned(4096)));
+static NVMe_Request *g_admin_requests[NVME_QUEUE_SIZE];
 
-// Buffers for IO Queues (allocated dynamically or static)
-// Using static for now to ensure alignment easily
-static uint8_t g_io_sq_buffer[4096] __attribute__((aligned(4096)));
-static uint8_t g_io_cq_buffer[4096] __attribute__((aligned(4096)));
+static LockClass g_nvme_queue_class = LOCK_CLASS_INIT("nvme_queue");
 
 void NVMe_SubmitCommand(NVMe_Queue *q, NVMe_SQEntry *cmd) {
   // Copy command to SQ slot
@@ -37,58 +40,466 @@ void NVMe_SubmitCommand(NVMe_Queue *q, NVMe_SQEntry *cmd) {
   *q->DoorbellTail = q->Tail;
 }
 
-void NVMe_WaitForCompletion(NVMe_Queue *q, uint16_t cid) {
+// --- Completion statistics ---
+
+#define NVME_EWMA_SHIFT 3     // Moving average weight 1/8
+#define NVME_HYBRID_MIN 8     // Completions seen before hybrid waits start
+#define NVME_HYBRID_MAX_US 200 // Longer mean latency: just use the interrupt
+
+static void NVMe_AccountLatency(NVMe_Queue *q, uint64_t cycles) {
+  NVMe_QueueStats *s = &q->Stats;
+  if (s->Completions++ == 0)
+    s->MeanCycles = cycles;
+  else
+    s->MeanCycles = s->MeanCycles - (s->MeanCycles >> NVME_EWMA_SHIFT) +
+                    (cycles >> NVME_EWMA_SHIFT);
+  if (cycles > s->MaxCycles)
+    s->MaxCycles = cycles;
+}
+
+int NVMe_GetQueueStats(uint16_t qid, NVMe_QueueStats *out) {
+  NVMe_Queue *q;
+  if (qid == 0)
+    q = &g_nvme_ctx.AdminQueue;
+  else if (qid <= g_nvme_ctx.IOQueueCount)
+    q = g_nvme_ctx.IOQueues[qid - 1];
+  else
+    return -1;
+
+  uint64_t flags = Spinlock_LockIrqSave(&q->Lock);
+  *out = q->Stats;
+  Spinlock_UnlockIrqRestore(&q->Lock, flags);
+  return 0;
+}
+
+// Consumes every new completion on 'q': frees the command ID, records the
+// status and wakes the waiter, or queues the request for its callback (run
+// by NVMe_Unlock). Called with q->Lock held, from a submitter, a waiter or
+// the queue's softirq.
+static void NVMe_ReapCompletions(NVMe_Queue *q) {
+  int reaped = 0;
   while (1) {
-    NVMe_CQEntry *entry = &q->CQ_Base[q->Head];
+    volatile NVMe_CQEntry *entry = &q->CQ_Base[q->Head];
 
     // Check Phase Tag
     // The Phase Tag (P) bit in status field flips every pass through the queue
-    if ((entry->Status & 0x1) == q->Phase) {
-      // Entry is new
-
-      // Check Command ID
-      if (entry->CommandID == cid) {
-        // Handled
-        // Update Head
-        q->Head++;
-        if (q->Head >= q->Size) {
-          q->Head = 0;
-          q->Phase = !q->Phase; // Flip expected phase
-        }
-
-        // Ring Head Doorbell
-        *q->DoorbellHead = q->Head;
-        return;
+    if ((entry->Status & 0x1) != q->Phase)
+      break;
+
+    uint16_t cid = entry->CommandID;
+    NVMe_Request *req = cid < q->Size ? q->Requests[cid] : NULL;
+    if (req) {
+      q->Requests[cid] = NULL;
+      q->CidMap[cid / 64] &= ~(1ULL << (cid % 64));
+      if (req->PrpList >= 0)
+        q->PrpFree |= 1ULL << req->PrpList;
+      q->InFlight--;
+      NVMe_AccountLatency(q, Cpu_ReadTSC() - req->SubmitTsc);
+      req->Status = entry->Status >> 1;
+      req->Result = entry->Cdw0;
+      if (req->Callback) {
+        req->Next = NULL;
+        if (q->CompletedTail)
+          q->CompletedTail->Next = req;
+        else
+          q->CompletedHead = req;
+        q->CompletedTail = req;
       } else {
-        // Consume other completions
-        q->Head++;
-        if (q->Head >= q->Size) {
-          q->Head = 0;
-          q->Phase = !q->Phase;
-        }
-        *q->DoorbellHead = q->Head;
+        req->Done = 1;
+        if (req->Task >= 0)
+          Scheduler_Wake(req->Task);
       }
     }
+
+    q->Head++;
+    if (q->Head >= q->Size) {
+      q->Head = 0;
+      q->Phase = !q->Phase; // Flip expected phase
+    }
+    reaped = 1;
+  }
+
+  // One Head Doorbell write for the whole batch
+  if (reaped)
+    *q->DoorbellHead = q->Head;
+}
+
+// Drops q->Lock (taken with Spinlock_LockIrqSave) and then runs the
+// callbacks of the requests reaped while it was held, so that they may
+// submit to the same queue.
+static void NVMe_Unlock(NVMe_Queue *q, uint64_t flags) {
+  NVMe_Request *list = q->CompletedHead;
+  q->CompletedHead = q->CompletedTail = NULL;
+  Spinlock_UnlockIrqRestore(&q->Lock, flags);
+
+  while (list) {
+    NVMe_Request *next = list->Next; // The callback may free 'list'
+    list->Done = 1;
+    list->Callback(list, list->Arg);
+    list = next;
+  }
+}
+
+// Takes the lowest free command ID. Called with q->Lock held and fewer
+// than Size - 1 commands in flight, so there always is one.
+static uint16_t NVMe_AllocCid(NVMe_Queue *q) {
+  for (uint16_t i = 0; i * 64 < q->Size; i++) {
+    uint64_t free = ~q->CidMap[i];
+    if (free) {
+      uint16_t cid = i * 64 + __builtin_ctzll(free);
+      q->CidMap[i] |= 1ULL << (cid % 64);
+      return cid;
+    }
   }
+  return 0;
 }
 
-void NVMe_SetupIOQueues(NVMe_Context *ctx) {
+// Submits 'cmd' on behalf of 'req' (Callback, Arg, Task and PrpList
+// already set). Called with q->Lock held; reaps while the queue is full.
+static void NVMe_SubmitLocked(NVMe_Queue *q, NVMe_SQEntry *cmd,
+                              NVMe_Request *req) {
+  // Keeping one SQ slot free means the tail never catches up with
+  // commands the controller has not fetched yet
+  while (q->InFlight >= q->Size - 1)
+    NVMe_ReapCompletions(q);
+
+  uint16_t cid = NVMe_AllocCid(q);
+  req->Queue = q;
+  req->CommandID = cid;
+  req->Done = 0;
+  req->Next = NULL;
+  req->SubmitTsc = Cpu_ReadTSC();
+  q->Requests[cid] = req;
+  cmd->CommandID = cid;
+  q->InFlight++;
+  NVMe_SubmitCommand(q, cmd);
+}
+
+// Takes a PRP list (or SGL segment) page from the queue's pool, reaping
+// until a command holding one completes. Called with q->Lock held.
+static int NVMe_AllocPrpList(NVMe_Queue *q) {
+  while (!q->PrpFree)
+    NVMe_ReapCompletions(q);
+  int page = __builtin_ctzll(q->PrpFree);
+  q->PrpFree &= ~(1ULL << page);
+  return page;
+}
+
+// Walks the pages of a transfer after the first one (which PRP1 covers
+// from its offset). With 'list' NULL only counts them.
+static uint32_t NVMe_PrpPages(const NVMe_IoVec *iov, int iovcnt,
+                              uint64_t *list) {
+  uint64_t base = (uint64_t)(uintptr_t)iov[0].Base;
+  uint64_t first_end = (base | (NVME_PAGE_SIZE - 1)) + 1;
+  uint32_t n = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    uint64_t addr = (uint64_t)(uintptr_t)iov[i].Base;
+    uint64_t end = addr + iov[i].Length;
+    for (uint64_t page = i == 0 ? first_end : addr; page < end;
+         page += NVME_PAGE_SIZE) {
+      if (list)
+        list[n] = page;
+      n++;
+    }
+  }
+  return n;
+}
+
+// 1 if the buffers can be described by PRPs: every one but the first
+// starts on a page boundary, every one but the last ends on one
+static int NVMe_PrpCompatible(const NVMe_IoVec *iov, int iovcnt) {
+  for (int i = 0; i < iovcnt; i++) {
+    uint64_t addr = (uint64_t)(uintptr_t)iov[i].Base;
+    if (i > 0 && (addr & (NVME_PAGE_SIZE - 1)))
+      return 0;
+    if (i < iovcnt - 1 && ((addr + iov[i].Length) & (NVME_PAGE_SIZE - 1)))
+      return 0;
+  }
+  return 1;
+}
+
+// Points PRP1/PRP2 of 'cmd' at the buffers (at most NVME_MAX_TRANSFER
+// bytes, PRP compatible). Up to two pages need no list. Returns the pool
+// page used for the PRP list, or -1. Called with q->Lock held.
+static int NVMe_SetupPrps(NVMe_Queue *q, NVMe_SQEntry *cmd,
+                          const NVMe_IoVec *iov, int iovcnt) {
+  cmd->Prp1 = (uint64_t)(uintptr_t)iov[0].Base;
+  cmd->Prp2 = 0;
+
+  uint32_t pages = NVMe_PrpPages(iov, iovcnt, NULL);
+  if (pages == 0)
+    return -1;
+  if (pages == 1) {
+    uint64_t second;
+    NVMe_PrpPages(iov, iovcnt, &second);
+    cmd->Prp2 = second;
+    return -1;
+  }
+
+  int page = NVMe_AllocPrpList(q);
+  uint64_t *list = q->PrpPool + page * NVME_PRP_LIST_ENTRIES;
+  NVMe_PrpPages(iov, iovcnt, list);
+  cmd->Prp2 = (uint64_t)(uintptr_t)list;
+  return page;
+}
+
+// Describes the buffers with an SGL: one data block descriptor in the
+// command, or a last segment of them in a pool page. Returns the pool page
+// used, or -1. Called with q->Lock held.
+static int NVMe_SetupSgl(NVMe_Queue *q, NVMe_SQEntry *cmd,
+                         const NVMe_IoVec *iov, int iovcnt) {
+  // The data pointer (PRP1/PRP2) holds SGL descriptor 1
+  NVMe_SglDescriptor sgl1;
+  memset(&sgl1, 0, sizeof(sgl1));
+  cmd->Flags |= NVME_CMD_PSDT_SGL;
+
+  if (iovcnt == 1) {
+    sgl1.Address = (uint64_t)(uintptr_t)iov[0].Base;
+    sgl1.Length = iov[0].Length;
+    sgl1.Type = NVME_SGL_DATA_BLOCK;
+    memcpy(&cmd->Prp1, &sgl1, sizeof(sgl1));
+    return -1;
+  }
+
+  int page = NVMe_AllocPrpList(q);
+  NVMe_SglDescriptor *segment =
+      (NVMe_SglDescriptor *)(q->PrpPool + page * NVME_PRP_LIST_ENTRIES);
+  for (int i = 0; i < iovcnt; i++) {
+    memset(&segment[i], 0, sizeof(NVMe_SglDescriptor));
+    segment[i].Address = (uint64_t)(uintptr_t)iov[i].Base;
+    segment[i].Length = iov[i].Length;
+    segment[i].Type = NVME_SGL_DATA_BLOCK;
+  }
+  // Everything fits in one segment, so it is also the last
+  sgl1.Address = (uint64_t)(uintptr_t)segment;
+  sgl1.Length = iovcnt * sizeof(NVMe_SglDescriptor);
+  sgl1.Type = NVME_SGL_LAST_SEGMENT;
+  memcpy(&cmd->Prp1, &sgl1, sizeof(sgl1));
+  return page;
+}
+
+// How a submitter waits for its completion
+#define NVME_WAIT_POLL 0   // Spin on the CQ
+#define NVME_WAIT_IRQ 1    // Sleep until the interrupt handler wakes us
+#define NVME_WAIT_HYBRID 2 // Sleep part of the expected time, then poll
+
+static int NVMe_ChooseWait(NVMe_Queue *q) {
+  // Syscalls and fault handlers run with interrupts off and cannot sleep
+  if (!q->Vector || !Scheduler_CanSleep())
+    return NVME_WAIT_POLL;
+
+  // Fast devices complete in a few microseconds, less than an interrupt
+  // and a context switch cost. Slow ones are not worth a spinning core.
+  uint64_t max = LAPIC_GetTscFrequency() / 1000000 * NVME_HYBRID_MAX_US;
+  if (q->Stats.Completions < NVME_HYBRID_MIN || q->Stats.MeanCycles > max)
+    return NVME_WAIT_IRQ;
+  return NVME_WAIT_HYBRID;
+}
+
+// Hybrid wait, entered and left with q->Lock held. Gives the CPU away for
+// SleepFraction/16 of the mean latency, then polls for up to another mean.
+// If the command is still not done, req->Task is set and the caller sleeps
+// on the interrupt. The fraction adapts: finding the command already done
+// on waking means we slept too long, a long poll means too short.
+//
+// The sleep yields to the other tasks queued on this CPU. With none, a
+// yield comes straight back, so the wait polls from the start instead and
+// leaves the fraction alone: nothing was learned about the sleep.
+static void NVMe_HybridWait(NVMe_Queue *q, NVMe_Request *req) {
+  NVMe_QueueStats *s = &q->Stats;
+  uint64_t mean = s->MeanCycles;
+  uint64_t wake_at = req->SubmitTsc + (mean * s->SleepFraction >> 4);
+
+  int slept = 0;
+  Spinlock_Unlock(&q->Lock);
+  while (!req->Done && Cpu_ReadTSC() < wake_at && Scheduler_HasRunnable()) {
+    Scheduler_Yield(); // Still runnable: returns once others had a turn
+    slept = 1;
+  }
+  Spinlock_Lock(&q->Lock);
+
+  if (req->Done) {
+    if (slept) {
+      s->Overslept++;
+      if (s->SleepFraction > 1)
+        s->SleepFraction--;
+    }
+    return;
+  }
+
+  uint64_t poll_start = Cpu_ReadTSC();
+  uint64_t poll_end = (slept ? poll_start : wake_at) + mean;
+  while (!req->Done && Cpu_ReadTSC() < poll_end) {
+    NVMe_ReapCompletions(q);
+    Cpu_Pause();
+  }
+  if (!req->Done) {
+    req->Task = Scheduler_GetCurrentTask();
+    return;
+  }
+  if (slept && Cpu_ReadTSC() - poll_start > mean / 4 && s->SleepFraction < 15)
+    s->SleepFraction++;
+}
+
+// Waits for 'req' (submitted without a callback) in 'mode', entered and
+// left with q->Lock held.
+static void NVMe_WaitLocked(NVMe_Queue *q, NVMe_Request *req, int mode) {
+  if (mode == NVME_WAIT_IRQ)
+    req->Task = Scheduler_GetCurrentTask();
+  else if (mode == NVME_WAIT_HYBRID && !req->Done)
+    NVMe_HybridWait(q, req);
+
+  // Blocked under the lock before dropping it, so the softirq (which needs
+  // the lock to set Done) cannot wake us too early
+  int slept = 0;
+  while (!req->Done) {
+    if (req->Task >= 0) {
+      Scheduler_Block();
+      Spinlock_Unlock(&q->Lock);
+      Scheduler_Yield();
+      Spinlock_Lock(&q->Lock);
+      slept = 1;
+    } else {
+      NVMe_ReapCompletions(q);
+    }
+  }
+  if (slept)
+    q->Stats.Interrupts++;
+  else
+    q->Stats.Polled++;
+  req->Task = -1;
+}
+
+// Submits one command and waits for its completion (see NVMe_ChooseWait).
+// Returns the completion status, 0 on success; 'result' (optional) gets
+// the command specific result (CQE dword 0).
+static uint16_t NVMe_Execute(NVMe_Queue *q, NVMe_SQEntry *cmd,
+                             uint32_t *result) {
+  NVMe_Request req;
+  req.Callback = NULL;
+  req.Arg = NULL;
+  req.Task = -1;
+  req.PrpList = -1;
+
+  int mode = NVMe_ChooseWait(q);
+  uint64_t flags = Spinlock_LockIrqSave(&q->Lock);
+  NVMe_SubmitLocked(q, cmd, &req);
+  NVMe_WaitLocked(q, &req, mode);
+
+  uint16_t status = req.Status;
+  if (result)
+    *result = req.Result;
+  NVMe_Unlock(q, flags);
+  return status;
+}
+
+// MSI-X handler for the I/O completion queues. Reaping is left to
+// NVMe_Softirq; the device does not interrupt again for entries already
+// posted, so nothing is lost while it waits.
+static int NVMe_IrqHandler(uint8_t vector) {
+  uint16_t qid = vector - INT_NVME;
+  if (qid >= 1 && qid <= g_nvme_ctx.IOQueueCount) {
+    g_nvme_ctx.IOQueues[qid - 1]->IrqPending = 1;
+    Softirq_Raise(SOFTIRQ_BLOCK);
+  }
+  LAPIC_SendEOI();
+  return 0;
+}
+
+// SOFTIRQ_BLOCK: completes I/O commands on the queues that interrupted.
+// Runs with interrupts enabled, so the queue lock is taken the way
+// submitters take it, interrupts off.
+static void NVMe_Softirq(void) {
+  for (uint16_t i = 0; i < g_nvme_ctx.IOQueueCount; i++) {
+    NVMe_Queue *q = g_nvme_ctx.IOQueues[i];
+    if (!__atomic_exchange_n(&q->IrqPending, 0, __ATOMIC_ACQUIRE))
+      continue;
+    uint64_t flags = Spinlock_LockIrqSave(&q->Lock);
+    NVMe_ReapCompletions(q);
+    NVMe_Unlock(q, flags);
+  }
+}
+
+// The queue this CPU submits to, NULL before the I/O queues exist
+static NVMe_Queue *NVMe_IOQueue(void) {
+  if (g_nvme_ctx.IOQueueCount == 0)
+    return NULL;
+  return g_nvme_ctx.IOQueues[Cpu_GetId() % g_nvme_ctx.IOQueueCount];
+}
+
+// Doorbells are DoorbellStride apart from offset 0x1000: SQ y tail at
+// (2y), CQ y head at (2y + 1)
+static uint32_t *NVMe_Doorbell(NVMe_Context *ctx, uint16_t qid, int cq) {
+  uintptr_t db_base = (uintptr_t)ctx->Regs + 0x1000;
+  return (uint32_t *)(db_base + (2 * qid + cq) * ctx->DoorbellStride);
+}
+
+// Number of Queues (feature 0x07): asks for 'wanted' SQ/CQ pairs and
+// returns how many the controller allocated (0 on error). The answer is
+// fixed until the next controller reset.
+static uint16_t NVMe_SetQueueCount(NVMe_Context *ctx, uint16_t wanted) {
   NVMe_SQEntry cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.Opcode = NVME_ADMIN_OP_SET_FEATURES;
+  cmd.Cdw10 = NVME_FEAT_NUM_QUEUES;
+  // NCQR in 31:16, NSQR in 15:0, both 0's based
+  cmd.Cdw11 = ((uint32_t)(wanted - 1) << 16) | (wanted - 1);
+
+  uint32_t result;
+  if (NVMe_Execute(&ctx->AdminQueue, &cmd, &result))
+    return 0;
+  uint32_t nsqa = (result & 0xFFFF) + 1;
+  uint32_t ncqa = (result >> 16) + 1;
+  uint32_t granted = nsqa < ncqa ? nsqa : ncqa;
+  return granted < wanted ? (uint16_t)granted : wanted;
+}
+
+// Creates I/O queue pair 'qid' with 'depth' entries. Its completions
+// interrupt 'cpu' through MSI-X entry 'qid' when the table has one, and
+// are polled otherwise. Returns NULL if memory or the controller says no.
+static NVMe_Queue *NVMe_CreateIOQueue(NVMe_Context *ctx, uint16_t qid,
+                                      uint16_t depth, uint32_t cpu) {
+  NVMe_Queue *q = kmalloc(sizeof(NVMe_Queue));
+  NVMe_Request **requests = kmalloc(depth * sizeof(NVMe_Request *));
+  uint64_t sq_pages = (depth * sizeof(NVMe_SQEntry) + 4095) / 4096;
+  uint64_t cq_pages = (depth * sizeof(NVMe_CQEntry) + 4095) / 4096;
+  void *sq = PageAllocator_Alloc(sq_pages);
+  void *cq = PageAllocator_Alloc(cq_pages);
+  uint64_t *prp_pool = PageAllocator_Alloc(NVME_PRP_POOL_PAGES);
+  if (!q || !requests || !sq || !cq || !prp_pool)
+    goto fail;
+  memset(q, 0, sizeof(NVMe_Queue));
+  memset(requests, 0, depth * sizeof(NVMe_Request *));
+  memset(sq, 0, sq_pages * 4096);
+  memset(cq, 0, cq_pages * 4096);
+
+  // Each queue interrupts the CPU that submits to it. These vectors are
+  // not given to the IRQ balancer: completions belong where the I/O came
+  // from.
+  uint8_t vector = 0;
+  if (qid < ctx->PciDev->MsixCount && qid < INT_NVME_COUNT) {
+    CpuData *target = PerCpu_Get(cpu);
+    uint32_t apic_id = target ? target->apic_id : PerCpu_This()->apic_id;
+    vector = INT_NVME + qid;
+    Interrupt_RegisterFastHandler(vector, NVMe_IrqHandler);
+    PCI_MsixSetVector(ctx->PciDev, qid, vector, (uint8_t)apic_id);
+  }
 
   // 1. Create IO Completion Queue
   // Opcode = 0x05
   // PRP1 = Queue Base Address
   // CDW10 = (Queue Size - 1) << 16 | QID
-  // CDW11 = Interrupt Vector | (1 << 0) (Physically Contiguous)
+  // CDW11 = Interrupt Vector << 16 | IEN (1 << 1) | PC (1 << 0)
+  NVMe_SQEntry cmd;
   memset(&cmd, 0, sizeof(cmd));
   cmd.Opcode = NVME_ADMIN_OP_CREATE_IOCQ;
-  cmd.CommandID = 2;
-  cmd.Prp1 = (uint64_t)(uintptr_t)g_io_cq_buffer;
-  cmd.Cdw10 = ((64 - 1) << 16) | 1; // Size 64, QID 1
-  cmd.Cdw11 = 1;                    // Phys Contiguous
-
-  NVMe_SubmitCommand(&ctx->AdminQueue, &cmd);
-  NVMe_WaitForCompletion(&ctx->AdminQueue, 2);
+  cmd.Prp1 = (uint64_t)(uintptr_t)cq;
+  cmd.Cdw10 = ((uint32_t)(depth - 1) << 16) | qid;
+  cmd.Cdw11 = 1; // Phys Contiguous
+  if (vector)
+    cmd.Cdw11 |= ((uint32_t)qid << 16) | 2; // MSI-X entry qid, enabled
+  if (NVMe_Execute(&ctx->AdminQueue, &cmd, NULL))
+    goto fail_vector;
 
   // 2. Create IO Submission Queue
   // Opcode = 0x01
@@ -97,28 +508,74 @@ void NVMe_SetupIOQueues(NVMe_Context *ctx) {
   // CDW11 = (CQID << 16) | (1 << 0) (Phys Contiguous)
   memset(&cmd, 0, sizeof(cmd));
   cmd.Opcode = NVME_ADMIN_OP_CREATE_IOSQ;
-  cmd.CommandID = 3;
-  cmd.Prp1 = (uint64_t)(uintptr_t)g_io_sq_buffer;
-  cmd.Cdw10 = ((64 - 1) << 16) | 1; // Size 64, QID 1
-  cmd.Cdw11 = (1 << 16) | 1;        // CQID 1, Phys Contiguous
-
-  NVMe_SubmitCommand(&ctx->AdminQueue, &cmd);
-  NVMe_WaitForCompletion(&ctx->AdminQueue, 3);
+  cmd.Prp1 = (uint64_t)(uintptr_t)sq;
+  cmd.Cdw10 = ((uint32_t)(depth - 1) << 16) | qid;
+  cmd.Cdw11 = ((uint32_t)qid << 16) | 1;
+  if (NVMe_Execute(&ctx->AdminQueue, &cmd, NULL)) {
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.Opcode = NVME_ADMIN_OP_DELETE_IOCQ;
+    cmd.Cdw10 = qid;
+    NVMe_Execute(&ctx->AdminQueue, &cmd, NULL);
+    goto fail_vector;
+  }
 
   // Setup Local Queue Struct
-  ctx->IOQueue.ID = 1;
-  ctx->IOQueue.Head = 0;
-  ctx->IOQueue.Tail = 0;
-  ctx->IOQueue.Size = 64;
-  ctx->IOQueue.Phase = 1;
-  ctx->IOQueue.SQ_Base = (NVMe_SQEntry *)g_io_sq_buffer;
-  ctx->IOQueue.CQ_Base = (NVMe_CQEntry *)g_io_cq_buffer;
-
-  // Doorbell for QID 1
-  // Tail = 0x1000 + (2 * 1 * 4) = 0x1000 + 8 = 0x1008
-  uintptr_t db_base = (uintptr_t)ctx->Regs + 0x1000;
-  ctx->IOQueue.DoorbellTail = (uint32_t *)(db_base + 8);
-  ctx->IOQueue.DoorbellHead = (uint32_t *)(db_base + 12);
+  q->ID = qid;
+  q->Size = depth;
+  q->Phase = 1;
+  q->Stats.SleepFraction = 8; // Start by sleeping half the mean
+  q->SQ_Base = (NVMe_SQEntry *)sq;
+  q->CQ_Base = (NVMe_CQEntry *)cq;
+  q->Requests = requests;
+  q->PrpPool = prp_pool;
+  q->PrpFree = ~0ULL; // NVME_PRP_POOL_PAGES is 64
+  Spinlock_Init(&q->Lock, &g_nvme_queue_class);
+  q->Vector = vector;
+  q->DoorbellTail = NVMe_Doorbell(ctx, qid, 0);
+  q->DoorbellHead = NVMe_Doorbell(ctx, qid, 1);
+  return q;
+
+fail_vector:
+  if (vector)
+    PCI_MsixMask(ctx->PciDev, qid, 1);
+fail:
+  if (sq)
+    PageAllocator_Free(sq, sq_pages);
+  if (cq)
+    PageAllocator_Free(cq, cq_pages);
+  if (prp_pool)
+    PageAllocator_Free(prp_pool, NVME_PRP_POOL_PAGES);
+  if (requests)
+    kfree(requests);
+  if (q)
+    kfree(q);
+  return NULL;
+}
+
+void NVMe_SetupIOQueues(NVMe_Context *ctx) {
+  // One queue pair per CPU, as far as the controller goes
+  uint16_t wanted = PerCpu_Count();
+  if (wanted > NVME_MAX_IO_QUEUES)
+    wanted = NVME_MAX_IO_QUEUES;
+  if (wanted == 0)
+    wanted = 1;
+  uint16_t granted = NVMe_SetQueueCount(ctx, wanted);
+  if (granted == 0)
+    granted = 1; // Every controller supports at least one pair
+
+  uint32_t mqes = NVME_CAP_MQES(ctx->Regs->Cap) + 1;
+  ctx->IOQueueDepth =
+      mqes < NVME_IO_QUEUE_MAX_DEPTH ? mqes : NVME_IO_QUEUE_MAX_DEPTH;
+
+  Softirq_Register(SOFTIRQ_BLOCK, NVMe_Softirq);
+  for (uint16_t i = 0; i < granted; i++) {
+    NVMe_Queue *q = NVMe_CreateIOQueue(ctx, i + 1, ctx->IOQueueDepth, i);
+    if (!q)
+      break;
+    ctx->IOQueues[i] = q;
+    // Published last: the interrupt handler and submitters index by count
+    __atomic_store_n(&ctx->IOQueueCount, i + 1, __ATOMIC_RELEASE);
+  }
 }
 
 void NVMe_IdentifyController(NVMe_Context *ctx) {
@@ -126,12 +583,28 @@ void NVMe_IdentifyController(NVMe_Context *ctx) {
   memset(&cmd, 0, sizeof(cmd));
 
   cmd.Opcode = NVME_ADMIN_OP_IDENTIFY;
-  cmd.CommandID = 1;
   cmd.Prp1 = (uint64_t)(uintptr_t)g_identify_buffer;
   cmd.Cdw10 = 1; // CNS = 1 (Identify Controller)
 
-  NVMe_SubmitCommand(&ctx->AdminQueue, &cmd);
-  NVMe_WaitForCompletion(&ctx->AdminQueue, 1);
+  NVMe_Execute(&ctx->AdminQueue, &cmd, NULL);
+
+  // MDTS (byte 77): largest transfer as a power of two of the minimum
+  // memory page size, 0 for no limit
+  uint8_t mdts = g_identify_buffer[77];
+  ctx->MaxTransfer = NVME_MAX_TRANSFER;
+  if (mdts) {
+    uint64_t min_page = NVME_PAGE_SIZE << NVME_CAP_MPSMIN(ctx->Regs->Cap);
+    uint64_t limit = min_page << mdts;
+    if (limit < ctx->MaxTransfer)
+      ctx->MaxTransfer = (uint32_t)limit;
+  }
+
+  // SGLS (bytes 539:536): SGL support for NVM commands in bits 1:0
+  uint32_t sgls;
+  memcpy(&sgls, g_identify_buffer + 536, sizeof(sgls));
+  ctx->SglSupport = sgls & 0x3;
+  if (ctx->SglSupport == 0x3) // Reserved
+    ctx->SglSupport = 0;
 
   // Parse Identify Controller Data Structure (Figure 247 in NVMe spec 1.4)
   // Model Number is at byte 24, length 40
@@ -165,6 +638,25 @@ void NVMe_IdentifyNamespace(NVMe_Context *ctx) {
   // Identify Active Namespaces (CNS = 2) or just use NSID 1 blindly for qemu
   ctx->NSID = 1;
   Graphics_Print(100, 660, "NVME: DEFAULT NSID 1 SELECTED", 0x859900);
+
+  // Identify Namespace (CNS = 0) for its size, NSZE (bytes 0-7, in LBAs),
+  // and block size: FLBAS (byte 26) selects an LBA format at byte
+  // 128 + 4n, whose byte 2 is LBADS (log2)
+  NVMe_SQEntry cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.Opcode = NVME_ADMIN_OP_IDENTIFY;
+  cmd.NSID = ctx->NSID;
+  cmd.Prp1 = (uint64_t)(uintptr_t)g_identify_buffer;
+  cmd.Cdw10 = 0;
+  ctx->BlockSize = 512;
+  ctx->NamespaceSize = 0;
+  if (NVMe_Execute(&ctx->AdminQueue, &cmd, NULL) == 0) {
+    memcpy(&ctx->NamespaceSize, g_identify_buffer, sizeof(uint64_t));
+    uint8_t format = g_identify_buffer[26] & 0xF;
+    uint8_t lbads = g_identify_buffer[128 + 4 * format + 2];
+    if (lbads >= 9 && lbads <= 12)
+      ctx->BlockSize = 1u << lbads;
+  }
 }
 
 void NVMe_Init(PCI_Device *device) {
@@ -188,6 +680,13 @@ void NVMe_Init(PCI_Device *device) {
 
   NVMe_Registers *regs = g_nvme_ctx.Regs;
 
+  // Doorbells for the admin queue and every possible I/O queue pair
+  g_nvme_ctx.DoorbellStride = 4 << NVME_CAP_DSTRD(regs->Cap);
+  uint64_t mmio_size =
+      0x1000 + 2 * (NVME_MAX_IO_QUEUES + 1) * g_nvme_ctx.DoorbellStride;
+  if (mmio_size > 0x4000)
+    Memory_MapMMIO((void *)bar, mmio_size);
+
   // 2. Disable Controller (CC.EN = 0)
   if (regs->Cc & 0x1) {
     regs->Cc &= ~0x1;
@@ -199,7 +698,7 @@ void NVMe_Init(PCI_Device *device) {
   }
 
   // 3. Configure Admin Queue
-  uint32_t q_size = 64;
+  uint32_t q_size = NVME_QUEUE_SIZE;
   regs->Aqa = ((q_size - 1) << 16) | (q_size - 1);
 
   // Set ASQ and ACQ addresses
@@ -215,13 +714,16 @@ void NVMe_Init(PCI_Device *device) {
   g_nvme_ctx.AdminQueue.Tail = 0;
   g_nvme_ctx.AdminQueue.Size = q_size;
   g_nvme_ctx.AdminQueue.Phase = 1;
+  g_nvme_ctx.AdminQueue.InFlight = 0;
+  g_nvme_ctx.AdminQueue.Vector = 0; // Admin commands are polled
   g_nvme_ctx.AdminQueue.SQ_Base = (NVMe_SQEntry *)g_admin_sq_buffer;
   g_nvme_ctx.AdminQueue.CQ_Base = (NVMe_CQEntry *)g_admin_cq_buffer;
+  g_nvme_ctx.AdminQueue.Requests = g_admin_requests;
+  Spinlock_Init(&g_nvme_ctx.AdminQueue.Lock, &g_nvme_queue_class);
 
   // Doorbell registers
-  uintptr_t db_base = (uintptr_t)regs + 0x1000;
-  g_nvme_ctx.AdminQueue.DoorbellTail = (uint32_t *)db_base;
-  g_nvme_ctx.AdminQueue.DoorbellHead = (uint32_t *)(db_base + 4);
+  g_nvme_ctx.AdminQueue.DoorbellTail = NVMe_Doorbell(&g_nvme_ctx, 0, 0);
+  g_nvme_ctx.AdminQueue.DoorbellHead = NVMe_Doorbell(&g_nvme_ctx, 0, 1);
 
   // 5. Enable Controller
   uint32_t cc = 0;
@@ -235,6 +737,9 @@ void NVMe_Init(PCI_Device *device) {
     SleepStub(1);
   }
 
+  // MSI-X for the I/O queues (entry 0, the admin queue, stays masked)
+  PCI_EnableMsix(device);
+
   // 6. Identify Controller
   NVMe_IdentifyController(&g_nvme_ctx);
 
@@ -245,56 +750,254 @@ void NVMe_Init(PCI_Device *device) {
   NVMe_IdentifyNamespace(&g_nvme_ctx);
 }
 
-int NVMe_Read(uint32_t nsid, uint64_t lba, void *buffer, uint32_t count) {
-  NVMe_SQEntry cmd;
-  memset(&cmd, 0, sizeof(cmd));
+// Fills in a read or write of 'count' blocks from 'lba'
+static void NVMe_BuildRw(NVMe_SQEntry *cmd, uint8_t opcode, uint32_t nsid,
+                         uint64_t lba, uint32_t count) {
+  memset(cmd, 0, sizeof(*cmd));
 
-  // NVMe Read Opcode = 0x02
-  cmd.Opcode = NVME_OP_READ;
-  cmd.CommandID = 100; // Arbitrary
-  cmd.NSID = nsid;
+  // NVMe Read Opcode = 0x02, Write = 0x01
+  cmd->Opcode = opcode;
+  cmd->NSID = nsid;
 
-  // PRP 1
-  cmd.Prp1 = (uint64_t)(uintptr_t)buffer;
+  // The data pointer is filled in at submission (NVMe_SetupPrps or
+  // NVMe_SetupSgl)
 
   // CDW10: Starting LBA Low
-  cmd.Cdw10 = (uint32_t)lba;
+  cmd->Cdw10 = (uint32_t)lba;
 
   // CDW11: Starting LBA High
-  cmd.Cdw11 = (uint32_t)(lba >> 32);
+  cmd->Cdw11 = (uint32_t)(lba >> 32);
 
   // CDW12: Number of Logical Blocks (0's based). So count-1.
-  cmd.Cdw12 = (count - 1) & 0xFFFF;
+  cmd->Cdw12 = (count - 1) & 0xFFFF;
+}
+
+// Returned by NVMe_SubmitRwV for buffers that need more than one command
+#define NVME_SUBMIT_SPLIT (-2)
+
+static int NVMe_SubmitRwV(uint8_t opcode, uint32_t nsid, uint64_t lba,
+                          const NVMe_IoVec *iov, int iovcnt, NVMe_Request *req,
+                          NVMe_Callback callback, void *arg) {
+  NVMe_Queue *q = NVMe_IOQueue();
+  if (!q || iovcnt < 1 || iovcnt > NVME_MAX_IOVECS ||
+      g_nvme_ctx.BlockSize == 0)
+    return -1;
+
+  uint64_t len = 0;
+  int dword_lengths = 1;
+  for (int i = 0; i < iovcnt; i++) {
+    if ((uintptr_t)iov[i].Base & 3)
+      return -1;
+    if (iov[i].Length & 3)
+      dword_lengths = 0;
+    len += iov[i].Length;
+  }
+  if (len == 0 || len % g_nvme_ctx.BlockSize)
+    return -1;
+  if (len > g_nvme_ctx.MaxTransfer)
+    return NVME_SUBMIT_SPLIT;
+
+  int sgl = (g_nvme_ctx.SglSupport == NVME_SGLS_SUPPORTED) ||
+            (g_nvme_ctx.SglSupport == NVME_SGLS_DWORD_ALIGNED && dword_lengths);
+  if (!sgl && !NVMe_PrpCompatible(iov, iovcnt))
+    return NVME_SUBMIT_SPLIT;
+
+  NVMe_SQEntry cmd;
+  NVMe_BuildRw(&cmd, opcode, nsid, lba, (uint32_t)(len / g_nvme_ctx.BlockSize));
+  req->Callback = callback;
+  req->Arg = arg;
+  req->Task = -1;
+  req->Status = 0;
+  req->Result = 0;
+
+  uint64_t flags = Spinlock_LockIrqSave(&q->Lock);
+  if (sgl)
+    req->PrpList = NVMe_SetupSgl(q, &cmd, iov, iovcnt);
+  else
+    req->PrpList = NVMe_SetupPrps(q, &cmd, iov, iovcnt);
+  NVMe_SubmitLocked(q, &cmd, req);
+  NVMe_Unlock(q, flags);
+  return 0;
+}
 
-  NVMe_SubmitCommand(&g_nvme_ctx.IOQueue, &cmd);
-  NVMe_WaitForCompletion(&g_nvme_ctx.IOQueue, 100);
+static int NVMe_SubmitRw(uint8_t opcode, uint32_t nsid, uint64_t lba,
+                         void *buffer, uint32_t count, NVMe_Request *req,
+                         NVMe_Callback callback, void *arg) {
+  NVMe_IoVec iov = {buffer, count * g_nvme_ctx.BlockSize};
+  if (count == 0 || (uint64_t)count * g_nvme_ctx.BlockSize > 0xFFFFFFFFu)
+    return -1;
+  int ret = NVMe_SubmitRwV(opcode, nsid, lba, &iov, 1, req, callback, arg);
+  return ret == NVME_SUBMIT_SPLIT ? -1 : ret;
+}
+
+// Synchronous read or write, split into MaxTransfer pieces with up to
+// NVME_SPLIT_INFLIGHT of them in flight
+static int NVMe_Rw(uint8_t opcode, uint32_t nsid, uint64_t lba,
+                   void *buffer, uint32_t count) {
+  if (!NVMe_IOQueue() || g_nvme_ctx.BlockSize == 0 || ((uintptr_t)buffer & 3))
+    return -1;
+  uint32_t chunk = g_nvme_ctx.MaxTransfer / g_nvme_ctx.BlockSize;
+  if (chunk == 0)
+    return -1;
+
+  NVMe_Request reqs[NVME_SPLIT_INFLIGHT];
+  uint8_t *p = buffer;
+  uint32_t pieces = 0;
+  int error = 0;
+  while (count) {
+    NVMe_Request *req = &reqs[pieces % NVME_SPLIT_INFLIGHT];
+    if (pieces >= NVME_SPLIT_INFLIGHT && NVMe_Wait(req))
+      error = -1;
+
+    uint32_t n = count < chunk ? count : chunk;
+    if (NVMe_SubmitRw(opcode, nsid, lba, p, n, req, NULL, NULL)) {
+      error = -1;
+      break;
+    }
+    pieces++;
+    lba += n;
+    p += (uint64_t)n * g_nvme_ctx.BlockSize;
+    count -= n;
+  }
+
+  uint32_t first = pieces > NVME_SPLIT_INFLIGHT ? pieces - NVME_SPLIT_INFLIGHT
+                                                 : 0;
+  for (uint32_t i = first; i < pieces; i++) {
+    if (NVMe_Wait(&reqs[i % NVME_SPLIT_INFLIGHT]))
+      error = -1;
+  }
+  return error;
+}
 
-  return 0; // Success
+int NVMe_Read(uint32_t nsid, uint64_t lba, void *buffer, uint32_t count) {
+  return NVMe_Rw(NVME_OP_READ, nsid, lba, buffer, count);
 }
 
 int NVMe_Write(uint32_t nsid, uint64_t lba, void *buffer, uint32_t count) {
-  NVMe_SQEntry cmd;
-  memset(&cmd, 0, sizeof(cmd));
+  return NVMe_Rw(NVME_OP_WRITE, nsid, lba, buffer, count);
+}
+
+// Synchronous vectored I/O: one command when possible, else one per buffer
+static int NVMe_RwV(uint8_t opcode, uint32_t nsid, uint64_t lba,
+                    const NVMe_IoVec *iov, int iovcnt) {
+  NVMe_Request req;
+  int ret = NVMe_SubmitRwV(opcode, nsid, lba, iov, iovcnt, &req, NULL, NULL);
+  if (ret == 0)
+    return NVMe_Wait(&req);
+  if (ret != NVME_SUBMIT_SPLIT)
+    return -1;
+
+  uint32_t block = g_nvme_ctx.BlockSize;
+  for (int i = 0; i < iovcnt; i++) {
+    if (iov[i].Length % block)
+      return -1;
+  }
+  for (int i = 0; i < iovcnt; i++) {
+    uint32_t count = iov[i].Length / block;
+    if (count && NVMe_Rw(opcode, nsid, lba, iov[i].Base, count))
+      return -1;
+    lba += count;
+  }
+  return 0;
+}
 
-  // NVMe Write Opcode = 0x01
-  cmd.Opcode = NVME_OP_WRITE;
-  cmd.CommandID = 101; // Arbitrary
-  cmd.NSID = nsid;
+int NVMe_ReadV(uint32_t nsid, uint64_t lba, const NVMe_IoVec *iov,
+               int iovcnt) {
+  return NVMe_RwV(NVME_OP_READ, nsid, lba, iov, iovcnt);
+}
 
-  // PRP 1
-  cmd.Prp1 = (uint64_t)(uintptr_t)buffer;
+int NVMe_WriteV(uint32_t nsid, uint64_t lba, const NVMe_IoVec *iov,
+                int iovcnt) {
+  return NVMe_RwV(NVME_OP_WRITE, nsid, lba, iov, iovcnt);
+}
 
-  // CDW10: Starting LBA Low
-  cmd.Cdw10 = (uint32_t)lba;
+int NVMe_SubmitRead(uint32_t nsid, uint64_t lba, void *buffer, uint32_t count,
+                    NVMe_Request *req, NVMe_Callback callback, void *arg) {
+  return NVMe_SubmitRw(NVME_OP_READ, nsid, lba, buffer, count, req, callback,
+                       arg);
+}
 
-  // CDW11: Starting LBA High
-  cmd.Cdw11 = (uint32_t)(lba >> 32);
+int NVMe_SubmitWrite(uint32_t nsid, uint64_t lba, void *buffer,
+                     uint32_t count, NVMe_Request *req, NVMe_Callback callback,
+                     void *arg) {
+  return NVMe_SubmitRw(NVME_OP_WRITE, nsid, lba, buffer, count, req, callback,
+                       arg);
+}
 
-  // CDW12: Number of Logical Blocks (0's based). So count-1.
-  cmd.Cdw12 = (count - 1) & 0xFFFF;
+int NVMe_SubmitReadV(uint32_t nsid, uint64_t lba, const NVMe_IoVec *iov,
+                     int iovcnt, NVMe_Request *req, NVMe_Callback callback,
+                     void *arg) {
+  int ret =
+      NVMe_SubmitRwV(NVME_OP_READ, nsid, lba, iov, iovcnt, req, callback, arg);
+  return ret == NVME_SUBMIT_SPLIT ? -1 : ret;
+}
+
+int NVMe_SubmitWriteV(uint32_t nsid, uint64_t lba, const NVMe_IoVec *iov,
+                      int iovcnt, NVMe_Request *req, NVMe_Callback callback,
+                      void *arg) {
+  int ret =
+      NVMe_SubmitRwV(NVME_OP_WRITE, nsid, lba, iov, iovcnt, req, callback, arg);
+  return ret == NVME_SUBMIT_SPLIT ? -1 : ret;
+}
+
+int NVMe_Wait(NVMe_Request *req) {
+  NVMe_Queue *q = req->Queue;
+  int mode = NVMe_ChooseWait(q);
+  uint64_t flags = Spinlock_LockIrqSave(&q->Lock);
+  NVMe_WaitLocked(q, req, mode);
+  uint16_t status = req->Status;
+  NVMe_Unlock(q, flags);
+  return status ? -1 : 0;
+}
+
+uint32_t NVMe_GetMaxTransfer(void) { return g_nvme_ctx.MaxTransfer; }
+
+uint32_t NVMe_GetBlockSize(void) { return g_nvme_ctx.BlockSize; }
+
+uint64_t NVMe_GetNamespaceSize(uint32_t nsid) {
+  return nsid == g_nvme_ctx.NSID ? g_nvme_ctx.NamespaceSize : 0;
+}
+
+int NVMe_HasInterrupt(void) {
+  NVMe_Queue *q = NVMe_IOQueue();
+  return q && q->Vector;
+}
 
-  NVMe_SubmitCommand(&g_nvme_ctx.IOQueue, &cmd);
-  NVMe_WaitForCompletion(&g_nvme_ctx.IOQueue, 101);
+int NVMe_Poll(void) {
+  NVMe_Queue *q = NVMe_IOQueue();
+  if (!q)
+    return 0;
 
-  return 0; // Success
+  uint64_t flags = Spinlock_LockIrqSave(&q->Lock);
+  NVMe_ReapCompletions(q);
+  int in_flight = q->InFlight;
+  NVMe_Unlock(q, flags);
+  return in_flight;
+}
+
+int NVMe_SetInterruptCoalescing(uint16_t threshold, uint8_t time_100us) {
+  if (threshold < 1 || threshold > 256)
+    return -1;
+
+  NVMe_SQEntry cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.Opcode = NVME_ADMIN_OP_SET_FEATURES;
+  cmd.Cdw10 = NVME_FEAT_INT_COALESCING;
+  // Bits 7:0 aggregation threshold (0's based), 15:8 aggregation time
+  cmd.Cdw11 = (uint32_t)(threshold - 1) | ((uint32_t)time_100us << 8);
+  return NVMe_Execute(&g_nvme_ctx.AdminQueue, &cmd, NULL) ? -1 : 0;
+}
+
+int NVMe_GetInterruptCoalescing(uint16_t *threshold, uint8_t *time_100us) {
+  NVMe_SQEntry cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.Opcode = NVME_ADMIN_OP_GET_FEATURES;
+  cmd.Cdw10 = NVME_FEAT_INT_COALESCING; // SEL = 0: current value
+
+  uint32_t value;
+  if (NVMe_Execute(&g_nvme_ctx.AdminQueue, &cmd, &value))
+    return -1;
+  *threshold = (uint16_t)((value & 0xFF) + 1);
+  *time_100us = (uint8_t)(value >> 8);
+  return 0;
 }
@@ -2,6 +2,7 @@
 #define NVME_H
 
 #include "pci.h"
+#include "spinlock.h"
 #include <stdint.h>
 
 // NVMe Controller Registers (Offset from BAR0)
@@ -79,12 +80,99 @@ typedef struct {
 #define NVME_ADMIN_OP_NVME_MI_RECV 0x1E
 #define NVME_ADMIN_OP_DOORBELL_BUF_OL 0x7C
 
+// Feature IDs (Set/Get Features)
+#define NVME_FEAT_NUM_QUEUES 0x07
+#define NVME_FEAT_INT_COALESCING 0x08
+
+// Controller Capabilities (CAP) fields
+#define NVME_CAP_MQES(cap) ((uint32_t)((cap) & 0xFFFF)) // 0's based
+#define NVME_CAP_DSTRD(cap) ((uint32_t)(((cap) >> 32) & 0xF)) // 4 << n bytes
+#define NVME_CAP_MPSMIN(cap) ((uint32_t)(((cap) >> 48) & 0xF)) // 4K << n
+
+// Data pointers. Buffers are identity mapped, so a virtual page is the
+// physical page. PRP1 covers the first page (from any dword offset), PRP2
+// the second one, or points to a PRP list page with the rest.
+#define NVME_PAGE_SIZE 4096
+#define NVME_PRP_LIST_ENTRIES (NVME_PAGE_SIZE / 8)
+#define NVME_PRP_POOL_PAGES 64 // PRP list pages per I/O queue
+// Largest transfer one list page can describe; MDTS may lower it
+#define NVME_MAX_TRANSFER (NVME_PRP_LIST_ENTRIES * NVME_PAGE_SIZE)
+// Chunks of a split NVMe_Read/NVMe_Write kept in flight at once
+#define NVME_SPLIT_INFLIGHT 8
+
+// Scatter-gather lists, used instead of PRPs when the controller supports
+// them (Identify Controller SGLS). The command's data pointer holds one
+// descriptor: a data block for a single buffer, or a last segment pointing
+// to a pool page of data block descriptors.
+#define NVME_CMD_PSDT_SGL 0x40 // Flags: PRP or SGL for Data Transfer = SGL
+#define NVME_SGL_DATA_BLOCK 0x00
+#define NVME_SGL_SEGMENT 0x20
+#define NVME_SGL_LAST_SEGMENT 0x30
+#define NVME_SGLS_SUPPORTED 0x1 // SGLS[1:0]: 1 any alignment, 2 dword
+#define NVME_SGLS_DWORD_ALIGNED 0x2
+
+typedef struct {
+  uint64_t Address;
+  uint32_t Length;
+  uint8_t Reserved[3];
+  uint8_t Type; // NVME_SGL_* (descriptor type << 4 | sub type)
+} __attribute__((packed)) NVMe_SglDescriptor;
+
+// One segment page: the most buffers a vectored request may have
+#define NVME_MAX_IOVECS (NVME_PAGE_SIZE / 16)
+
+typedef struct {
+  void *Base; // Identity mapped, dword aligned
+  uint32_t Length;
+} NVMe_IoVec;
+
 // NVMe NVM Opcodes
 #define NVME_OP_READ 0x02
 #define NVME_OP_WRITE 0x01
 
-// Internal Queue Structure
+#define NVME_QUEUE_SIZE 64          // Admin queue depth
+#define NVME_IO_QUEUE_MAX_DEPTH 1024 // I/O queue depth, CAP.MQES permitting
+#define NVME_MAX_IO_QUEUES 8         // One per CPU (MAX_CPUS)
+
+struct NVMe_Request;
+struct NVMe_Queue;
+
+// Called once the command has completed, after the queue lock has been
+// dropped, in the context that reaped it: the block softirq or a submitter
+// or poller. It must not sleep; it may submit new requests and free 'req'.
+typedef void (*NVMe_Callback)(struct NVMe_Request *req, void *arg);
+
+// An in-flight command. The memory belongs to the submitter and must stay
+// valid until the command completes (Done, or the callback has run).
+typedef struct NVMe_Request {
+  struct NVMe_Queue *Queue;
+  uint16_t CommandID;
+  volatile int Done;
+  uint16_t Status; // Completion status field (phase bit stripped)
+  uint32_t Result; // Command specific result (CQE dword 0)
+  int Task;        // Task sleeping in NVMe_Wait, -1 if none
+  NVMe_Callback Callback;
+  void *Arg;
+  uint64_t SubmitTsc;
+  int PrpList;               // Pool page holding its PRP list, -1 if none
+  struct NVMe_Request *Next; // Completed, waiting for its callback
+} NVMe_Request;
+
+// Per-queue completion statistics (TSC cycles). They drive the hybrid wait
+// of kernel threads: sleep for SleepFraction/16 of the mean latency, then
+// poll, then fall back to the interrupt.
 typedef struct {
+  uint64_t Completions;
+  uint64_t MeanCycles; // Moving average of submit-to-reap latency
+  uint64_t MaxCycles;
+  uint64_t Polled;     // Waits that never slept on the interrupt
+  uint64_t Interrupts; // Waits that ended asleep on the interrupt
+  uint64_t Overslept;  // Hybrid waits whose command was done on waking
+  uint32_t SleepFraction;
+} NVMe_QueueStats;
+
+// Internal Queue Structure
+typedef struct NVMe_Queue {
   uint16_t ID;
   uint16_t Tail; // Submission Tail (Host writes here)
   uint16_t Head; // Completion Head (Host reads here)
@@ -94,21 +182,109 @@ typedef struct {
   uint32_t *DoorbellHead; // Pointer to Completion Queue Head Doorbell
   NVMe_SQEntry *SQ_Base;
   NVMe_CQEntry *CQ_Base;
+  // Protects the SQ tail, CQ head and requests. A polling waiter holds it
+  // until its completion is reaped; a sleeping one drops it while waiting.
+  Spinlock Lock;
+  uint16_t InFlight; // At most Size - 1, so the SQ never overflows
+  uint8_t Vector;    // IDT vector of the CQ's MSI-X entry, 0 if polled
+  volatile int IrqPending; // Set by the interrupt, cleared by the softirq
+  // Command IDs: bit n set while CID n is in flight, Requests[n] its owner
+  uint64_t CidMap[NVME_IO_QUEUE_MAX_DEPTH / 64];
+  NVMe_Request **Requests;       // Size entries
+  NVMe_Request *CompletedHead;   // Callbacks still to run, oldest first
+  NVMe_Request *CompletedTail;
+  uint64_t *PrpPool; // NVME_PRP_POOL_PAGES list pages, NULL for admin
+  uint64_t PrpFree;  // Bit n set while pool page n is free
+  NVMe_QueueStats Stats;
 } NVMe_Queue;
 
 // NVMe Context
 typedef struct {
   PCI_Device *PciDev;
   NVMe_Registers *Regs;
+  uint32_t DoorbellStride; // Bytes between doorbell registers (CAP.DSTRD)
   NVMe_Queue AdminQueue;
-  NVMe_Queue IOQueue; // Simple single IO Queue
-  uint32_t NSID;      // Active Namespace ID
+  // I/O queue pairs: QID n is IOQueues[n - 1]. CPU i submits to
+  // IOQueues[i % IOQueueCount], so with a queue per CPU submitters never
+  // contend; the lock only orders them against their own CPU's softirq.
+  NVMe_Queue *IOQueues[NVME_MAX_IO_QUEUES];
+  uint16_t IOQueueCount;
+  uint16_t IOQueueDepth;
+  uint32_t NSID;       // Active Namespace ID
+  uint32_t BlockSize;  // LBA data size of NSID, in bytes
+  uint32_t MaxTransfer; // Bytes per command: MDTS, at most NVME_MAX_TRANSFER
+  uint32_t SglSupport;  // SGLS[1:0], 0 if only PRPs may be used
+  // Size of NSID in LBAs (NSZE), 0 if unknown
+  uint64_t NamespaceSize;
 } NVMe_Context;
 
 // Functions
 void NVMe_Init(PCI_Device *device);
 void NVMe_IdentifyController(NVMe_Context *ctx);
+// Interrupt coalescing (feature 0x08), for all I/O completion queues with
+// interrupts enabled: the controller holds an interrupt back until
+// 'threshold' completions are pending (1-256) or 'time_100us' units of
+// 100us have passed. threshold 1, time 0 turns aggregation off. Sleeping
+// waiters see the added delay, hybrid and polled ones do not.
+// Return 0, or -1 if the controller rejects the command.
+int NVMe_SetInterruptCoalescing(uint16_t threshold, uint8_t time_100us);
+int NVMe_GetInterruptCoalescing(uint16_t *threshold, uint8_t *time_100us);
+
+// Copies the statistics of queue 'qid' (0 = admin, 1 up to the number of
+// I/O queues). Returns 0, or -1 for an unknown queue.
+int NVMe_GetQueueStats(uint16_t qid, NVMe_QueueStats *out);
+
+// Return 0, or -1 if the controller reports an error. Kernel threads sleep
+// while the command is in flight when the queue has an MSI-X vector.
+// Transfers larger than the controller takes in one command are split, with
+// up to NVME_SPLIT_INFLIGHT pieces in flight. 'buffer' must be dword
+// aligned. Block counts are in units of the active namespace's LBA size.
 int NVMe_Read(uint32_t nsid, uint64_t lba, void *buffer, uint32_t count);
 int NVMe_Write(uint32_t nsid, uint64_t lba, void *buffer, uint32_t count);
 
+// Asynchronous I/O on this CPU's queue. 'req' is filled in and the command
+// submitted; the call only waits if every command ID (or PRP list page) is
+// taken. Completion runs 'callback' (if not NULL) and sets req->Done.
+// Returns 0, or -1 if there is no I/O queue, 'buffer' is not dword aligned
+// or the transfer is larger than NVMe_GetMaxTransfer.
+int NVMe_SubmitRead(uint32_t nsid, uint64_t lba, void *buffer, uint32_t count,
+                    NVMe_Request *req, NVMe_Callback callback, void *arg);
+int NVMe_SubmitWrite(uint32_t nsid, uint64_t lba, void *buffer,
+                     uint32_t count, NVMe_Request *req, NVMe_Callback callback,
+                     void *arg);
+// Waits for a request submitted without a callback (the same way NVMe_Read
+// does). Returns 0, or -1 if the controller reported an error.
+int NVMe_Wait(NVMe_Request *req);
+// Vectored I/O: the blocks from 'lba' are scattered over (or gathered
+// from) 'iov'; the total must be a multiple of the block size. One command
+// if the controller takes SGLs, or if the buffers line up on page
+// boundaries the way PRPs need (only the first may start, and only the
+// last may end, inside a page). Otherwise the synchronous calls issue one
+// command per buffer, which then must each be whole blocks.
+int NVMe_ReadV(uint32_t nsid, uint64_t lba, const NVMe_IoVec *iov,
+               int iovcnt);
+int NVMe_WriteV(uint32_t nsid, uint64_t lba, const NVMe_IoVec *iov,
+                int iovcnt);
+// As NVMe_SubmitRead; also -1 if the buffers need more than one command
+int NVMe_SubmitReadV(uint32_t nsid, uint64_t lba, const NVMe_IoVec *iov,
+                     int iovcnt, NVMe_Request *req, NVMe_Callback callback,
+                     void *arg);
+int NVMe_SubmitWriteV(uint32_t nsid, uint64_t lba, const NVMe_IoVec *iov,
+                      int iovcnt, NVMe_Request *req, NVMe_Callback callback,
+                      void *arg);
+
+// Bytes one asynchronous request may transfer
+uint32_t NVMe_GetMaxTransfer(void);
+// LBA size of the active namespace in bytes, 0 before NVMe_Init
+uint32_t NVMe_GetBlockSize(void);
+// Size of namespace 'nsid' in LBAs, 0 if not known (before NVMe_Init, or
+// not the active namespace)
+uint64_t NVMe_GetNamespaceSize(uint32_t nsid);
+// 1 if this CPU's I/O queue signals completions with an interrupt, 0 if
+// they are only reaped by polling it
+int NVMe_HasInterrupt(void);
+// Reaps this CPU's queue without waiting: completes whatever is done.
+// Returns the number of commands still in flight.
+int NVMe_Poll(void);
+
 #endif
@@ -119,6 +119,89 @@ PCI_Device *PCI_GetNVMeController() {
   return NULL;
 }
 
+uint8_t PCI_FindCapability(PCI_Device *dev, uint8_t id) {
+  uint8_t bus = dev->Bus, slot = dev->Device, fn = dev->Function;
+  if (!(PCI_Read16(bus, slot, fn, PCI_REG_STATUS) & PCI_STATUS_CAP_LIST))
+    return 0;
+
+  // Pointers are dword aligned; the bound guards against a looping list
+  uint8_t ptr = PCI_Read8(bus, slot, fn, PCI_REG_CAP_PTR) & 0xFC;
+  for (int i = 0; i < 48 && ptr; i++) {
+    if (PCI_Read8(bus, slot, fn, ptr) == id)
+      return ptr;
+    ptr = PCI_Read8(bus, slot, fn, ptr + 1) & 0xFC;
+  }
+  return 0;
+}
+
+// Memory address decoded by BAR 'bar', read back from config space (only
+// BAR0/1 are cached in PCI_Device)
+static uint64_t PCI_BarAddress(PCI_Device *dev, int bar) {
+  uint8_t off = 0x10 + bar * 4;
+  uint32_t low = PCI_Read32(dev->Bus, dev->Device, dev->Function, off);
+  uint64_t addr = low & 0xFFFFFFF0;
+  if (((low >> 1) & 3) == 2 && bar < 5) // 64-bit memory BAR
+    addr |= (uint64_t)PCI_Read32(dev->Bus, dev->Device, dev->Function,
+                                 off + 4)
+            << 32;
+  return addr;
+}
+
+int PCI_EnableMsix(PCI_Device *dev) {
+  uint8_t bus = dev->Bus, slot = dev->Device, fn = dev->Function;
+  uint8_t cap = PCI_FindCapability(dev, PCI_CAP_ID_MSIX);
+  if (!cap)
+    return 0;
+
+  uint32_t header = PCI_Read32(bus, slot, fn, cap);
+  uint16_t ctrl = header >> 16;
+  uint16_t count = (ctrl & PCI_MSIX_CTRL_SIZE) + 1;
+
+  uint32_t table = PCI_Read32(bus, slot, fn, cap + PCI_MSIX_TABLE);
+  uint64_t table_addr = PCI_BarAddress(dev, table & 7) + (table & ~7u);
+  uint64_t map_start = table_addr & ~0xFFFULL;
+  Memory_MapMMIO((void *)map_start, table_addr + count * PCI_MSIX_ENTRY_SIZE -
+                                        map_start);
+
+  dev->MsixCap = cap;
+  dev->MsixCount = count;
+  dev->MsixTable = (volatile uint32_t *)table_addr;
+  for (uint16_t i = 0; i < count; i++)
+    PCI_MsixMask(dev, i, 1);
+
+  // Enable with the function mask clear; entries stay individually masked
+  ctrl = (ctrl | PCI_MSIX_CTRL_ENABLE) & ~PCI_MSIX_CTRL_MASKALL;
+  PCI_Write32(bus, slot, fn, cap, (header & 0xFFFF) | ((uint32_t)ctrl << 16));
+
+  uint16_t cmd = PCI_Read16(bus, slot, fn, PCI_REG_COMMAND);
+  PCI_Write32(bus, slot, fn, PCI_REG_COMMAND,
+              cmd | PCI_COMMAND_INTX_DISABLE);
+  return count;
+}
+
+void PCI_MsixSetVector(PCI_Device *dev, uint16_t entry, uint8_t vector,
+                       uint8_t apic_id) {
+  if (entry >= dev->MsixCount)
+    return;
+  volatile uint32_t *e = dev->MsixTable + entry * (PCI_MSIX_ENTRY_SIZE / 4);
+  // Keep it masked while the address and data change
+  e[3] |= PCI_MSIX_VECTOR_MASKED;
+  e[0] = 0xFEE00000 | ((uint32_t)apic_id << 12); // Message address
+  e[1] = 0;
+  e[2] = vector; // Message data: fixed delivery, edge triggered
+  e[3] &= ~PCI_MSIX_VECTOR_MASKED;
+}
+
+void PCI_MsixMask(PCI_Device *dev, uint16_t entry, int masked) {
+  if (entry >= dev->MsixCount)
+    return;
+  volatile uint32_t *e = dev->MsixTable + entry * (PCI_MSIX_ENTRY_SIZE / 4);
+  if (masked)
+    e[3] |= PCI_MSIX_VECTOR_MASKED;
+  else
+    e[3] &= ~PCI_MSIX_VECTOR_MASKED;
+}
+
 uint32_t PCI_GetBAR(PCI_Device *dev, int barNum) {
   // For NVMe, BAR0/1 form the 64-bit address. Return low 32 for now or handle
   // appropriately. In this basic OS, assuming mapped strictly in 4GB or
@@ -22,6 +22,26 @@
 // PCI Programming Interface
 #define PCI_PROG_IF_NVME 0x02
 
+// Configuration space registers
+#define PCI_REG_COMMAND 0x04
+#define PCI_REG_STATUS 0x06
+#define PCI_REG_CAP_PTR 0x34
+#define PCI_COMMAND_INTX_DISABLE (1 << 10)
+#define PCI_STATUS_CAP_LIST (1 << 4)
+
+// Capability IDs
+#define PCI_CAP_ID_MSI 0x05
+#define PCI_CAP_ID_MSIX 0x11
+
+// MSI-X capability: Message Control (upper half of the first dword), then
+// Table and PBA offset/BIR
+#define PCI_MSIX_CTRL_ENABLE (1u << 15)
+#define PCI_MSIX_CTRL_MASKALL (1u << 14)
+#define PCI_MSIX_CTRL_SIZE 0x7FF // Table size - 1
+#define PCI_MSIX_TABLE 4
+#define PCI_MSIX_ENTRY_SIZE 16
+#define PCI_MSIX_VECTOR_MASKED 1
+
 typedef struct {
     uint16_t VendorID;
     uint16_t DeviceID;
@@ -44,6 +64,9 @@ typedef struct {
     uint16_t VendorID;
     uint16_t DeviceID;
     uint32_t BaseAddress[6]; // BAR0-BAR5
+    uint8_t MsixCap;         // Config offset of the MSI-X capability (0: none)
+    uint16_t MsixCount;      // MSI-X table entries (0 until enabled)
+    volatile uint32_t* MsixTable;
 } PCI_Device;
 
 // Function Prototypes
@@ -56,4 +79,18 @@ uint8_t  PCI_Read8(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset
 void PCI_Write32(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset, uint32_t value);
 uint32_t PCI_GetBAR(PCI_Device* dev, int barNum);
 
+// Walks the capability list. Returns the config offset of capability 'id',
+// or 0 if the device does not have it.
+uint8_t PCI_FindCapability(PCI_Device* dev, uint8_t id);
+
+// MSI-X
+// Maps the vector table, masks every entry and enables MSI-X (legacy INTx
+// is disabled). Returns the number of entries, or 0 without MSI-X.
+int PCI_EnableMsix(PCI_Device* dev);
+// Points table entry 'entry' at IDT vector 'vector' on the CPU with local
+// APIC ID 'apic_id' (fixed delivery, edge) and unmasks it.
+void PCI_MsixSetVector(PCI_Device* dev, uint16_t entry, uint8_t vector,
+                       uint8_t apic_id);
+void PCI_MsixMask(PCI_Device* dev, uint16_t entry, int masked);
+
 #endif
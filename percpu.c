@@ -0,0 +1,62 @@
+#include "percpu.h"
+#include "gdt.h"
+#include "libc.h"
+#include "memory.h"
+#include "syscall.h"
+
+static CpuData *cpu_areas[MAX_CPUS];
+static uint32_t cpu_count = 0;
+
+// syscall_entry depends on these
+_Static_assert(offsetof(CpuData, user_rsp_scratch) == 0, "CpuData layout");
+_Static_assert(offsetof(CpuData, kernel_stack) == 8, "CpuData layout");
+_Static_assert(sizeof(CpuData) <= PAGE_SIZE, "CpuData must fit in a page");
+
+void PerCpu_Init(uint32_t cpu_id) {
+  if (cpu_id >= MAX_CPUS)
+    return;
+
+  CpuData *cpu = (CpuData *)PageAllocator_Alloc(1); // 1 Page
+  if (!cpu)
+    return;
+  memset(cpu, 0, sizeof(CpuData));
+  cpu->self = cpu;
+  cpu->cpu_id = cpu_id;
+  uint32_t eax, ebx, ecx, edx;
+  asm volatile("cpuid"
+               : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+               : "a"(1), "c"(0));
+  cpu->apic_id = ebx >> 24;
+  cpu->current_task = 0;
+  cpu->idle_task = -1;
+  cpu->user_task = -1;
+  cpu->kernel_stack = tss.rsp0;
+
+  cpu_areas[cpu_id] = cpu;
+  if (cpu_id + 1 > cpu_count)
+    cpu_count = cpu_id + 1;
+
+  // Kernel mode runs with GS_BASE pointing here. KERNEL_GS_BASE holds the
+  // value the other side of swapgs sees: also ours until the first switch to
+  // user mode reloads the GS selector (which clears GS_BASE to the user
+  // value of 0), after which every ring 3 entry/exit swaps the two.
+  MSR_Write(MSR_GS_BASE, (uint64_t)cpu);
+  MSR_Write(MSR_KERNEL_GS_BASE, (uint64_t)cpu);
+
+  // rdtscp returns this in ECX; user mode uses it to find its CPU (vdso.h)
+  MSR_Write(MSR_TSC_AUX, cpu_id);
+}
+
+CpuData *PerCpu_Get(uint32_t cpu_id) {
+  if (cpu_id >= MAX_CPUS)
+    return NULL;
+  return cpu_areas[cpu_id];
+}
+
+uint32_t PerCpu_Count() { return cpu_count; }
+
+void PerCpu_SetKernelStack(uint64_t stack_top) {
+  // The TSS is still shared; each CPU will need its own once APs are started
+  TSS_SetStack(stack_top);
+  PERCPU_WRITE(kernel_stack, stack_top);
+}
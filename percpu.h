@@ -0,0 +1,78 @@
+#ifndef PERCPU_H
+#define PERCPU_H
+
+#include "schedule.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAX_CPUS 8
+
+// Per-CPU data, reachable through the GS base while in kernel mode.
+// syscall_entry hard-codes the offsets of the first two fields.
+typedef struct CpuData {
+  uint64_t user_rsp_scratch; // Offset 0: user RSP while entering a syscall
+  uint64_t kernel_stack;     // Offset 8: top of the running task's kstack
+  struct CpuData *self;      // Offset 16: linear address of this structure
+  uint32_t cpu_id;
+  uint32_t apic_id; // Initial local APIC ID (CPUID.1:EBX[31:24])
+  int current_task; // Task index running on this CPU
+  int idle_task;
+  volatile int need_resched;
+
+  // Scheduler run queue: FIFO of READY task indices (excluding the running
+  // and idle tasks). Protected by the scheduler lock.
+  int runqueue[MAX_TASKS];
+  uint32_t rq_head;
+  uint32_t rq_count;
+
+  // Softirqs (see softirq.h)
+  volatile uint32_t softirq_pending; // Bit n = softirq n raised
+  int in_softirq;                    // Handlers running on this CPU
+  volatile int softirq_deferred;     // Left to the softirq thread
+  volatile int sched_request;        // SCHED_REQUEST_* for Scheduler_Preempt
+  int sched_request_task;            // Task the request applies to
+  int user_task;                     // Last non-kernel task run here, or -1
+
+  // Counters
+  uint64_t irq_count;
+  uint64_t syscall_count;
+  uint64_t context_switches;
+} CpuData;
+
+// Accessors: a single GS-relative instruction, no pointer chasing
+#define PERCPU_READ(field)                                                     \
+  ({                                                                           \
+    __typeof__(((CpuData *)0)->field) __v;                                     \
+    asm volatile("mov %%gs:%c1, %0"                                            \
+                 : "=r"(__v)                                                   \
+                 : "i"(offsetof(CpuData, field)));                             \
+    __v;                                                                       \
+  })
+
+#define PERCPU_WRITE(field, val)                                               \
+  do {                                                                         \
+    __typeof__(((CpuData *)0)->field) __v = (val);                             \
+    asm volatile("mov %0, %%gs:%c1"                                            \
+                 :                                                             \
+                 : "r"(__v), "i"(offsetof(CpuData, field))                     \
+                 : "memory");                                                  \
+  } while (0)
+
+// For the uint64_t counters
+#define PERCPU_INC(field)                                                      \
+  asm volatile("incq %%gs:%c0" : : "i"(offsetof(CpuData, field)) : "memory")
+
+static inline CpuData *PerCpu_This(void) { return PERCPU_READ(self); }
+static inline uint32_t Cpu_GetId(void) { return PERCPU_READ(cpu_id); }
+static inline int Cpu_GetCurrentTask(void) { return PERCPU_READ(current_task); }
+
+// Allocates the area for 'cpu_id' and points this CPU's GS base at it.
+// Call once on each CPU, before interrupts are enabled.
+void PerCpu_Init(uint32_t cpu_id);
+CpuData *PerCpu_Get(uint32_t cpu_id);
+uint32_t PerCpu_Count();
+
+// Sets the stack used for syscalls and ring 3 interrupts on this CPU
+void PerCpu_SetKernelStack(uint64_t stack_top);
+
+#endif
@@ -0,0 +1,104 @@
+#include "schedbench.h"
+
+#ifdef SCHED_BENCH
+#include "cpu.h"
+#include "graphics.h"
+#include "memory.h"
+#include "percpu.h"
+#include "schedule.h"
+#include "syscall.h"
+
+#define SCHED_BENCH_ROUNDS 10000
+
+static volatile int bench_done = 0;
+
+// --- Interrupt path ---
+
+static void SchedBench_KernelPartner() {
+  while (!bench_done)
+    Scheduler_Yield();
+
+  // Kernel threads cannot exit; park for good
+  while (1) {
+    Scheduler_Block();
+    Scheduler_Yield();
+  }
+}
+
+void SchedBench_RunKernel() {
+  void *stack = PageAllocator_Alloc(1);
+  if (!stack)
+    return;
+  bench_done = 0;
+  if (Scheduler_AddKernelThread(SchedBench_KernelPartner, stack) < 0) {
+    PageAllocator_Free(stack, 1);
+    return;
+  }
+  Scheduler_Yield(); // Let the partner start
+
+  // Count switches rather than assume two per round, in case a worker woke
+  uint64_t switches = PERCPU_READ(context_switches);
+  uint64_t start = Cpu_ReadTSC();
+  for (int i = 0; i < SCHED_BENCH_ROUNDS; i++)
+    Scheduler_Yield();
+  uint64_t cycles = Cpu_ReadTSC() - start;
+  switches = PERCPU_READ(context_switches) - switches;
+
+  bench_done = 1;
+  Scheduler_Yield(); // Partner parks itself
+
+  if (switches) {
+    Graphics_Print(100, 700, "INT YIELD CYCLES/SWITCH:", 0x268BD2);
+    Graphics_PrintHex(320, 700, cycles / switches, 0x268BD2);
+  }
+}
+
+// --- Syscall path (runs in ring 3) ---
+
+static inline uint64_t bench_syscall(uint64_t num, uint64_t a1, uint64_t a2) {
+  uint64_t ret;
+  asm volatile("syscall"
+               : "=a"(ret)
+               : "a"(num), "D"(a1), "S"(a2)
+               : "rcx", "rdx", "r8", "r9", "r10", "r11", "memory");
+  return ret;
+}
+
+static void SchedBench_UserPartner() {
+  while (!bench_done)
+    bench_syscall(SYSCALL_YIELD, 0, 0);
+  bench_syscall(SYSCALL_TERMINATE, 0, 0);
+}
+
+void SchedBench_RunUser() {
+  bench_done = 0;
+  bench_syscall(SYSCALL_EXEC, (uint64_t)SchedBench_UserPartner, 1);
+  bench_syscall(SYSCALL_YIELD, 0, 0); // Let the partner start
+
+  uint64_t start = Cpu_ReadTSC();
+  for (int i = 0; i < SCHED_BENCH_ROUNDS; i++)
+    bench_syscall(SYSCALL_YIELD, 0, 0);
+  uint64_t cycles = Cpu_ReadTSC() - start;
+  bench_done = 1;
+
+  // Each round switches there and back
+  uint64_t per_switch = cycles / (2 * SCHED_BENCH_ROUNDS);
+
+  char msg[64] = "SYSCALL YIELD CYCLES/SWITCH: 0x";
+  char *hex_chars = "0123456789ABCDEF";
+  int pos = 0;
+  while (msg[pos])
+    pos++;
+  for (int shift = 60; shift >= 0; shift -= 4)
+    msg[pos++] = hex_chars[(per_switch >> shift) & 0xF];
+  msg[pos++] = '\n';
+  msg[pos] = 0;
+  bench_syscall(SYSCALL_PRINT, (uint64_t)msg, 0x93a1a1);
+}
+
+#else
+
+void SchedBench_RunKernel() {}
+void SchedBench_RunUser() {}
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef SCHEDBENCH_H
+#define SCHEDBENCH_H
+
+// Context switch micro-benchmark, built with 'make SCHED_BENCH=1'.
+// Both halves ping-pong between two tasks and report cycles per switch.
+
+// Kernel threads yielding through INT_YIELD (full isr_common save, iretq).
+// Call from task 0 in kernel mode with interrupts enabled.
+void SchedBench_RunKernel();
+
+// User tasks yielding through SYSCALL_YIELD (callee-saved only, sysretq).
+// Call from ring 3.
+void SchedBench_RunUser();
+
+#endif
@@ -1,26 +1,149 @@
 #include "schedule.h"
+#include "cpu.h"
+#include "elf.h"
 #include "gdt.h"
 #include "graphics.h"
 #include "libc.h"
 #include "memory.h" // For PageAllocator_Free and PAGE_SIZE
+#include "percpu.h"
+#include "spinlock.h"
+#include "vdso.h"
 static TCB tasks[MAX_TASKS];
-static int current_task_index = 0;
 static int total_tasks = 0;
 
-void Scheduler_Init() {
-  for (int i = 0; i < MAX_TASKS; i++) {
-    tasks[i].active = 0;
+// Protects the task table and the per-CPU run queues. Taken from interrupt
+// context too, so always with interrupts disabled.
+static LockClass sched_lock_class = LOCK_CLASS_INIT("scheduler");
+static Spinlock sched_lock = SPINLOCK_INIT(&sched_lock_class);
+
+// CPUs reserved for tasks pinned to them (isolcpus= boot option)
+static uint64_t isolated_cpus = 0;
+
+// Switch trace ring, written under sched_lock
+static SchedTraceEntry sched_trace[SCHED_TRACE_SIZE];
+static uint64_t sched_trace_head = 0; // Total entries ever written
+
+static void Scheduler_ScheduleLocked(InterruptFrame **frame_ptr, int reason,
+                                     uint64_t start);
+
+// --- Run queues (sched_lock held) ---
+
+// Takes the entry of 'idx' out of the ring, keeping the order of the rest
+static void RunQueue_Remove(CpuData *cpu, int idx) {
+  uint32_t kept = 0;
+  for (uint32_t i = 0; i < cpu->rq_count; i++) {
+    int e = cpu->runqueue[(cpu->rq_head + i) % MAX_TASKS];
+    if (e != idx)
+      cpu->runqueue[(cpu->rq_head + kept++) % MAX_TASKS] = e;
   }
-  tasks[0].active = 1; // Main thread
-  total_tasks = 1;
+  cpu->rq_count = kept;
+  tasks[idx].rq_cpu = -1;
 }
 
-void Scheduler_AddTask(void (*fn)(), void *stack_base) {
-  if (total_tasks >= MAX_TASKS)
+// A task has at most one entry on any ring: pushing it again onto the same
+// queue does nothing, and an entry left on another CPU's queue (by an
+// affinity change) is taken out first. So a ring never holds more than
+// MAX_TASKS entries. Returns 1 if the task was queued.
+static int RunQueue_Push(CpuData *cpu, int idx) {
+  if (tasks[idx].rq_cpu == (int)cpu->cpu_id)
+    return 0;
+  if (tasks[idx].rq_cpu >= 0) {
+    CpuData *old = PerCpu_Get(tasks[idx].rq_cpu);
+    if (old)
+      RunQueue_Remove(old, idx);
+  }
+  if (cpu->rq_count >= MAX_TASKS)
+    return 0;
+  cpu->runqueue[(cpu->rq_head + cpu->rq_count) % MAX_TASKS] = idx;
+  cpu->rq_count++;
+  tasks[idx].rq_cpu = cpu->cpu_id;
+  return 1;
+}
+
+// Next READY task queued on this CPU, or -1. Entries of tasks that blocked
+// or exited while queued are dropped.
+static int RunQueue_Pop(CpuData *cpu) {
+  while (cpu->rq_count) {
+    int idx = cpu->runqueue[cpu->rq_head];
+    cpu->rq_head = (cpu->rq_head + 1) % MAX_TASKS;
+    cpu->rq_count--;
+    tasks[idx].rq_cpu = -1;
+    if (tasks[idx].active && tasks[idx].state == TASK_READY &&
+        tasks[idx].cpu == (int)cpu->cpu_id)
+      return idx;
+  }
+  return -1;
+}
+
+static uint64_t Scheduler_OnlineCpus() {
+  uint64_t mask = 0;
+  for (uint32_t i = 0; i < MAX_CPUS; i++) {
+    if (PerCpu_Get(i))
+      mask |= 1ULL << i;
+  }
+  return mask;
+}
+
+// CPU for a task allowed on 'mask': stay on 'preferred' if possible,
+// otherwise the lowest allowed online CPU. -1 if none is online.
+static int Scheduler_PickCpu(uint64_t mask, int preferred) {
+  mask &= Scheduler_OnlineCpus();
+  if (!mask)
+    return -1;
+  if (preferred >= 0 && preferred < MAX_CPUS && (mask & (1ULL << preferred)))
+    return preferred;
+  return __builtin_ctzll(mask);
+}
+
+// Tasks that were not pinned stay off isolated CPUs
+static void Scheduler_PlaceNewTask(TCB *task) {
+  task->affinity = ~isolated_cpus;
+  int cpu = Scheduler_PickCpu(task->affinity, (int)Cpu_GetId());
+  task->cpu = cpu >= 0 ? cpu : 0; // The boot CPU is never isolated
+}
+
+// Makes a READY task runnable on its CPU
+static void Scheduler_Enqueue(int idx) {
+  CpuData *cpu = PerCpu_Get(tasks[idx].cpu);
+  if (!cpu)
     return;
+  // The running task is requeued when it is switched out
+  if (cpu->current_task == idx)
+    return;
+  if (RunQueue_Push(cpu, idx)) {
+    tasks[idx].ready_since = Cpu_ReadTSC();
+    cpu->need_resched = 1;
+  }
+}
 
-  int idx = total_tasks++;
+// Runs whenever every other task is blocked
+static void Scheduler_IdleTask() {
+  while (1) {
+    asm volatile("sti\n"
+                 "hlt\n");
+  }
+}
+
+// Takes the lock and picks the next task. 'start' is taken before the lock
+// so the traced cost includes lock contention.
+static void Scheduler_Reschedule(InterruptFrame **frame_ptr, int reason) {
+  uint64_t start = Cpu_ReadTSC();
+  uint64_t flags = Spinlock_LockIrqSave(&sched_lock);
+  Scheduler_ScheduleLocked(frame_ptr, reason, start);
+  Spinlock_UnlockIrqRestore(&sched_lock, flags);
+}
+
+static void Scheduler_YieldHandler(InterruptFrame **frame_ptr) {
+  Scheduler_Reschedule(frame_ptr, SCHED_SWITCH_YIELD);
+}
 
+// Builds the initial interrupt frame of a ring 0 task (sched_lock held)
+static int Scheduler_NewKernelTask(void (*fn)(), void *stack_base,
+                                   int kernel_thread) {
+  if (total_tasks >= MAX_TASKS)
+    return -1;
+
+  int idx = total_tasks++;
   // Set up the initial stack (Kernel Task)
   // Assuming 1 page for kernel tasks created this way for now, or just don't
   // free them if stack_base is NULL? Let's assume standard kernel tasks manage
@@ -51,15 +174,65 @@ void Scheduler_AddTask(void (*fn)(), void *stack_base) {
   tasks[idx].rsp = (uintptr_t)stack;
   tasks[idx].stack_base = stack_base;
   tasks[idx].stack_pages = 1; // Default
+  tasks[idx].kstack_top = 0;  // Ring 0 only, RSP0 is never used
+  tasks[idx].kernel_thread = kernel_thread;
+  Scheduler_PlaceNewTask(&tasks[idx]);
+  tasks[idx].state = TASK_READY;
   tasks[idx].active = 1;
+  return idx;
 }
 
-void Scheduler_AddUserTask(void (*fn)(), void *stack_base,
-                           uint64_t stack_pages) {
-  if (total_tasks >= MAX_TASKS)
-    return;
+void Scheduler_Init() {
+  for (int i = 0; i < MAX_TASKS; i++) {
+    tasks[i].active = 0;
+    tasks[i].rq_cpu = -1;
+  }
+  tasks[0].active = 1; // Main thread
+  tasks[0].state = TASK_READY;
+  tasks[0].cpu = Cpu_GetId();
+  tasks[0].affinity = ~0ULL;
+  tasks[0].last_run = Cpu_ReadTSC();
+  total_tasks = 1;
+  PERCPU_WRITE(user_task, 0);
+
+  Interrupt_RegisterHandler(INT_YIELD, Scheduler_YieldHandler);
+
+  // The idle task is never queued; it runs when this CPU's queue is empty
+  void *idle_stack = PageAllocator_Alloc(1);
+  if (idle_stack) {
+    uint64_t flags = Spinlock_LockIrqSave(&sched_lock);
+    int idle = Scheduler_NewKernelTask(Scheduler_IdleTask, idle_stack, 1);
+    if (idle >= 0) {
+      tasks[idle].cpu = Cpu_GetId();
+      tasks[idle].affinity = 1ULL << Cpu_GetId();
+    }
+    PERCPU_WRITE(idle_task, idle);
+    Spinlock_UnlockIrqRestore(&sched_lock, flags);
+  }
+}
 
-  int idx = total_tasks++;
+int Scheduler_AddTask(void (*fn)(), void *stack_base) {
+  uint64_t flags = Spinlock_LockIrqSave(&sched_lock);
+  int idx = Scheduler_NewKernelTask(fn, stack_base, 0);
+  if (idx >= 0)
+    Scheduler_Enqueue(idx);
+  Spinlock_UnlockIrqRestore(&sched_lock, flags);
+  return idx;
+}
+
+int Scheduler_AddKernelThread(void (*fn)(), void *stack_base) {
+  uint64_t flags = Spinlock_LockIrqSave(&sched_lock);
+  int idx = Scheduler_NewKernelTask(fn, stack_base, 1);
+  if (idx >= 0)
+    Scheduler_Enqueue(idx);
+  Spinlock_UnlockIrqRestore(&sched_lock, flags);
+  return idx;
+}
+
+int Scheduler_AddUserTask(void (*fn)(), void *stack_base,
+                          uint64_t stack_pages) {
+  if (total_tasks >= MAX_TASKS)
+    return -1;
 
   // Set up the initial stack (User Task)
   // Stack grows down from base + size
@@ -83,7 +256,15 @@ void Scheduler_AddUserTask(void (*fn)(), void *stack_base,
   // Implicit allocation of Kernel Stack for the task?
   void *kstack = PageAllocator_Alloc(1);
   if (!kstack)
-    return; // Failure
+    return -1; // Failure
+
+  uint64_t flags = Spinlock_LockIrqSave(&sched_lock);
+  if (total_tasks >= MAX_TASKS) {
+    Spinlock_UnlockIrqRestore(&sched_lock, flags);
+    PageAllocator_Free(kstack, 1);
+    return -1;
+  }
+  int idx = total_tasks++;
 
   uint64_t *kstack_top = (uint64_t *)((uint8_t *)kstack + 4096);
   uint64_t *ks = kstack_top;
@@ -104,7 +285,12 @@ void Scheduler_AddUserTask(void (*fn)(), void *stack_base,
     *(--ks) = 0;
 
   tasks[idx].rsp = (uintptr_t)ks;
+  tasks[idx].kstack_top = (uintptr_t)kstack_top;
+  tasks[idx].kernel_thread = 0;
+  Scheduler_PlaceNewTask(&tasks[idx]);
+  tasks[idx].state = TASK_READY;
   tasks[idx].active = 1;
+  Scheduler_Enqueue(idx);
 
   // Store USER stack info for freeing (if we want to free user stack when task
   // dies) We also need to track the KERNEL stack we just allocated to free it
@@ -122,19 +308,97 @@ void Scheduler_AddUserTask(void (*fn)(), void *stack_base,
   // NOTE: We are "leaking" the 'kstack' (1 page) here because TCB doesn't have
   // a field for it yet. I should probably add `kstack_base` to TCB to be
   // perfect, but let's stick to the user request first.
+  Spinlock_UnlockIrqRestore(&sched_lock, flags);
+  return idx;
 }
 // ... switch ...
 
+static void Scheduler_Trace(int prev, int next, int reason, uint64_t start,
+                            uint64_t now) {
+  SchedTraceEntry *e =
+      &sched_trace[sched_trace_head++ & (SCHED_TRACE_SIZE - 1)];
+  e->timestamp = now;
+  e->cost_cycles = (uint32_t)(now - start);
+  e->prev = (int16_t)prev;
+  e->next = (int16_t)next;
+  e->reason = (uint8_t)reason;
+  e->cpu = (uint8_t)Cpu_GetId();
+  e->reserved = 0;
+}
+
+// Save the outgoing frame and load the incoming task. The kernel stack
+// follows the task so that every user task takes interrupts and syscalls on
+// its own stack. A still runnable outgoing task goes to the back of the queue.
+// 'start' is the TSC at which the scheduler was entered, for the trace.
+static void Scheduler_SwitchTo(InterruptFrame **frame_ptr, int next_index,
+                               int reason, uint64_t start) {
+  CpuData *cpu = PerCpu_This();
+  int prev = cpu->current_task;
+  uint64_t now = Cpu_ReadTSC();
+
+  tasks[prev].rsp = (uintptr_t)*frame_ptr;
+  tasks[prev].kstack_top = cpu->kernel_stack;
+  tasks[prev].runtime_cycles += now - tasks[prev].last_run;
+
+  if (!tasks[prev].active)
+    reason = SCHED_SWITCH_EXIT;
+  else if (tasks[prev].state == TASK_BLOCKED)
+    reason = SCHED_SWITCH_BLOCK;
+
+  cpu->current_task = next_index;
+  if (!tasks[next_index].kernel_thread)
+    cpu->user_task = next_index;
+  if (tasks[prev].active && tasks[prev].state == TASK_READY &&
+      prev != cpu->idle_task) {
+    // A task whose affinity changed while it ran moves to its new CPU
+    if (tasks[prev].cpu == (int)cpu->cpu_id) {
+      tasks[prev].ready_since = now;
+      RunQueue_Push(cpu, prev);
+    } else {
+      Scheduler_Enqueue(prev);
+    }
+  }
+
+  // Idle is never queued, so it has no wait time
+  if (next_index != cpu->idle_task)
+    tasks[next_index].wait_cycles += now - tasks[next_index].ready_since;
+  tasks[next_index].switch_count++;
+  tasks[next_index].last_run = now;
+
+  if (tasks[next_index].kstack_top)
+    PerCpu_SetKernelStack(tasks[next_index].kstack_top);
+  cpu->context_switches++;
+  Vdso_SetTask(cpu->cpu_id, next_index);
+  *frame_ptr = (InterruptFrame *)tasks[next_index].rsp;
+
+  Scheduler_Trace(prev, next_index, reason, start, Cpu_ReadTSC());
+}
+
 void Scheduler_TerminateCurrentTask(InterruptFrame **frame_ptr) {
+  uint64_t start = Cpu_ReadTSC();
+  // Before taking sched_lock: Elf_Exec creates tasks under the ELF lock.
+  // A no-op for tasks not started from an ELF image.
+  Elf_ReleaseTask(Cpu_GetCurrentTask());
+  uint64_t flags = Spinlock_LockIrqSave(&sched_lock);
+  CpuData *cpu = PerCpu_This();
+  int current = cpu->current_task;
+
   // Cannot terminate the main task (task 0)
-  if (current_task_index == 0) {
+  if (current == 0) {
+    Spinlock_UnlockIrqRestore(&sched_lock, flags);
     Graphics_Clear(0xEEE8D5);
     Graphics_Print(100, 500, "CANNOT TERMINATE MAIN TASK", 0xFF0000);
     return;
   }
 
+  // Idle and worker threads keep the kernel running
+  if (tasks[current].kernel_thread) {
+    Spinlock_UnlockIrqRestore(&sched_lock, flags);
+    return;
+  }
+
   // Free resources
-  TCB *task = &tasks[current_task_index];
+  TCB *task = &tasks[current];
   if (task->stack_base && task->stack_pages > 0) {
     PageAllocator_Free(task->stack_base, task->stack_pages);
     task->stack_base = 0;
@@ -145,52 +409,261 @@ void Scheduler_TerminateCurrentTask(InterruptFrame **frame_ptr) {
   Graphics_Clear(0xEEE8D5);
   Graphics_Print(100, 500, "TASK TERMINATED            ", 0xFFFF00);
 
-  // Find next active task
-  int next_index = -1;
-  for (int i = 1; i <= total_tasks; i++) {
-    int idx = (current_task_index + i) % total_tasks;
-    if (tasks[idx].active) {
-      next_index = idx;
-      break;
-    }
+  // Find next active task (task 0 is in the queue if it can run), otherwise
+  // idle
+  int next_index = RunQueue_Pop(cpu);
+  if (next_index == -1) {
+    next_index = cpu->idle_task;
   }
 
-  // If no next task, go back to main task (task 0)
+  // Move to next task. The dead task is not requeued; what gets saved for it
+  // is never used again.
+  Scheduler_SwitchTo(frame_ptr, next_index, SCHED_SWITCH_EXIT, start);
+  Spinlock_UnlockIrqRestore(&sched_lock, flags);
+}
+void Scheduler_Switch(InterruptFrame **frame_ptr) {
+  uint64_t start = Cpu_ReadTSC();
+  uint64_t flags = Spinlock_LockIrqSave(&sched_lock);
+
+  // Take the next task waiting on this CPU
+  int next_index = RunQueue_Pop(PerCpu_This());
+
   if (next_index == -1) {
-    next_index = 0;
+    Spinlock_UnlockIrqRestore(&sched_lock, flags);
+    Graphics_Clear(0xEEE8D5);
+    Graphics_Print(100, 500, "NO NEXT TASK AVAILABLE", 0xFF0000);
+    return;
   }
 
-  // Move to next task
-  current_task_index = next_index;
+  // Save current task RSP and move to next active task
+  Scheduler_SwitchTo(frame_ptr, next_index, SCHED_SWITCH_MANUAL, start);
+  Spinlock_UnlockIrqRestore(&sched_lock, flags);
+  Graphics_Clear(0xEEE8D5);
+  Graphics_Print(100, 500, "SWITCHED TO NEXT TASK     ", 0x00FF00);
+}
+
+int Scheduler_GetCurrentTask() { return Cpu_GetCurrentTask(); }
 
-  // Restore next task RSP
-  *frame_ptr = (InterruptFrame *)tasks[current_task_index].rsp;
+void Scheduler_Block() {
+  uint64_t flags = Spinlock_LockIrqSave(&sched_lock);
+  tasks[Cpu_GetCurrentTask()].state = TASK_BLOCKED;
+  Spinlock_UnlockIrqRestore(&sched_lock, flags);
 }
-void Scheduler_Switch(InterruptFrame **frame_ptr) {
-  int next_index = -1;
-  // Search for next active task (check all tasks including wrap-around)
-  for (int i = 1; i <= total_tasks; i++) {
-    int idx = (current_task_index + i) % total_tasks;
-    if (tasks[idx].active && idx != current_task_index) {
-      next_index = idx;
-      break;
-    }
+
+void Scheduler_Wake(int task_id) {
+  uint64_t flags = Spinlock_LockIrqSave(&sched_lock);
+  if (task_id >= 0 && task_id < total_tasks && tasks[task_id].active &&
+      tasks[task_id].state == TASK_BLOCKED) {
+    tasks[task_id].state = TASK_READY;
+    Scheduler_Enqueue(task_id);
   }
+  Spinlock_UnlockIrqRestore(&sched_lock, flags);
+}
 
-  if (next_index == -1 || next_index == current_task_index) {
-    Graphics_Clear(0xEEE8D5);
-    Graphics_Print(100, 500, "NO NEXT TASK AVAILABLE", 0xFF0000);
+// Give up the CPU from kernel mode. Goes through isr_common so the task is
+// saved as a regular interrupt frame and can be resumed by any switch path.
+void Scheduler_Yield() { asm volatile("int %0" : : "i"(INT_YIELD) : "memory"); }
+
+int Scheduler_CanSleep() {
+  uint64_t flags;
+  asm volatile("pushfq\n"
+               "popq %0\n"
+               : "=r"(flags));
+  return (flags & RFLAGS_IF) && tasks[Cpu_GetCurrentTask()].kernel_thread;
+}
+
+int Scheduler_HasRunnable() {
+  // Racy without the lock, and entries of tasks that blocked since they
+  // were queued still count: a hint, not a promise
+  return __atomic_load_n(&PerCpu_This()->rq_count, __ATOMIC_RELAXED) != 0;
+}
+
+void Scheduler_Schedule(InterruptFrame **frame_ptr) {
+  Scheduler_Reschedule(frame_ptr, SCHED_SWITCH_PREEMPT);
+}
+
+static void Scheduler_ScheduleLocked(InterruptFrame **frame_ptr, int reason,
+                                     uint64_t start) {
+  CpuData *cpu = PerCpu_This();
+  cpu->need_resched = 0;
+
+  int next_index = RunQueue_Pop(cpu);
+  if (next_index == -1) {
+    // Nothing else to run: keep the current task if it can still run here
+    TCB *current = &tasks[cpu->current_task];
+    if (current->state == TASK_READY && current->cpu == (int)cpu->cpu_id &&
+        cpu->current_task != cpu->idle_task)
+      return;
+    next_index = cpu->idle_task;
+  }
+
+  if (next_index == cpu->current_task || next_index == -1)
     return;
+
+  Scheduler_SwitchTo(frame_ptr, next_index, reason, start);
+}
+
+// A request only applies to the task it was made for, on an exit back to
+// its user mode code. Until then it stays pending, so kernel workers, the
+// softirq thread and idle are never switched or terminated by it.
+static int Scheduler_RequestDue(uint64_t cs) {
+  return PERCPU_READ(sched_request) && (cs & 3) == 3 &&
+         PERCPU_READ(sched_request_task) == PERCPU_READ(current_task);
+}
+
+// Called on interrupt exit. Kernel code is not preemptible, so a pending
+// reschedule only takes effect when returning to user mode or to idle.
+// Never while softirq handlers run: the frame being returned to is nested
+// inside them, not the interrupted task.
+int Scheduler_PreemptPending(uint64_t cs) {
+  if (PERCPU_READ(in_softirq))
+    return 0;
+  if (Scheduler_RequestDue(cs))
+    return 1;
+  return PERCPU_READ(need_resched) &&
+         ((cs & 3) == 3 || PERCPU_READ(current_task) == PERCPU_READ(idle_task));
+}
+
+// The target is the task the key interrupted: the current task, or the
+// user task that last ran here if a kernel thread (the softirq thread, a
+// worker, idle) is running instead. Dropped if there is none.
+void Scheduler_Request(int request) {
+  int task = PERCPU_READ(current_task);
+  if (tasks[task].kernel_thread)
+    task = PERCPU_READ(user_task);
+  if (task < 0)
+    return;
+  PERCPU_WRITE(sched_request_task, task);
+  PERCPU_WRITE(sched_request, request);
+}
+
+void Scheduler_Preempt(InterruptFrame **frame_ptr) {
+  uint64_t cs = (*frame_ptr)->cs;
+  if (!Scheduler_PreemptPending(cs))
+    return;
+
+  int request = SCHED_REQUEST_NONE;
+  if (Scheduler_RequestDue(cs))
+    request = __atomic_exchange_n(&PerCpu_This()->sched_request,
+                                  SCHED_REQUEST_NONE, __ATOMIC_RELAXED);
+  if (request == SCHED_REQUEST_SWITCH)
+    Scheduler_Switch(frame_ptr);
+  else if (request == SCHED_REQUEST_TERMINATE)
+    Scheduler_TerminateCurrentTask(frame_ptr);
+  else
+    Scheduler_Schedule(frame_ptr);
+}
+
+// 'frame' is the InterruptFrame syscall_entry laid out at the top of the
+// kernel stack. Once the selectors are filled in it can be resumed through
+// isr_restore like an interrupted task; syscall_entry itself resumes it with
+// sysretq (FRAME_SYSCALL).
+static void Scheduler_SaveSyscallFrame(InterruptFrame *frame) {
+  frame->cs = USER_CODE_SEL;
+  frame->ss = USER_DATA_SEL;
+  frame->int_no = FRAME_SYSCALL;
+  frame->err_code = 0;
+  // Caller-saved registers are clobbered by the syscall ABI; don't leak
+  // kernel values back to user mode.
+  frame->rcx = frame->rdx = 0;
+  frame->r8 = frame->r9 = frame->r10 = frame->r11 = 0;
+}
+
+// Sleeps inside a syscall. The caller must already have called
+// Scheduler_Block under the lock protecting its wait condition; if a wakeup
+// got in first the task simply keeps running.
+// Returns the frame to switch to.
+InterruptFrame *Scheduler_SleepFromSyscall(InterruptFrame *frame) {
+  Scheduler_SaveSyscallFrame(frame);
+  InterruptFrame *next = frame;
+  Scheduler_Reschedule(&next, SCHED_SWITCH_BLOCK);
+  return next;
+}
+
+InterruptFrame *Scheduler_YieldFromSyscall(InterruptFrame *frame) {
+  Scheduler_SaveSyscallFrame(frame);
+  InterruptFrame *next = frame;
+  Scheduler_Reschedule(&next, SCHED_SWITCH_YIELD);
+  return next;
+}
+
+int Scheduler_GetTaskStats(int task_id, TaskStats *out) {
+  uint64_t flags = Spinlock_LockIrqSave(&sched_lock);
+  if (task_id < 0 || task_id >= total_tasks) {
+    Spinlock_UnlockIrqRestore(&sched_lock, flags);
+    return -1;
   }
 
-  // Save current task RSP
-  tasks[current_task_index].rsp = (uintptr_t)*frame_ptr;
+  TCB *task = &tasks[task_id];
+  out->runtime_cycles = task->runtime_cycles;
+  out->wait_cycles = task->wait_cycles;
+  out->switch_count = task->switch_count;
+  out->active = task->active;
+  out->state = task->state;
+  out->cpu = task->cpu;
+  out->kernel_thread = task->kernel_thread;
+  out->affinity = task->affinity;
+
+  // Include the slice in progress for a running task
+  CpuData *cpu = PerCpu_Get(task->cpu);
+  if (task->active && cpu && cpu->current_task == task_id)
+    out->runtime_cycles += Cpu_ReadTSC() - task->last_run;
+  Spinlock_UnlockIrqRestore(&sched_lock, flags);
+  return 0;
+}
 
-  // Move to next active task
-  current_task_index = next_index;
+int Scheduler_ReadTrace(SchedTraceEntry *out, int max) {
+  uint64_t flags = Spinlock_LockIrqSave(&sched_lock);
+  uint64_t count = sched_trace_head;
+  if (count > SCHED_TRACE_SIZE)
+    count = SCHED_TRACE_SIZE;
+  if (max < 0)
+    max = 0;
+  if (count > (uint64_t)max)
+    count = max;
+
+  uint64_t first = sched_trace_head - count;
+  for (uint64_t i = 0; i < count; i++)
+    out[i] = sched_trace[(first + i) & (SCHED_TRACE_SIZE - 1)];
+  Spinlock_UnlockIrqRestore(&sched_lock, flags);
+  return (int)count;
+}
 
-  // Restore next task RSP
-  *frame_ptr = (InterruptFrame *)tasks[current_task_index].rsp;
-  Graphics_Clear(0xEEE8D5);
-  Graphics_Print(100, 500, "SWITCHED TO NEXT TASK     ", 0x00FF00);
-}
\ No newline at end of file
+int Scheduler_SetAffinity(int task_id, uint64_t mask) {
+  uint64_t flags = Spinlock_LockIrqSave(&sched_lock);
+  if (task_id < 0 || task_id >= total_tasks || !tasks[task_id].active ||
+      tasks[task_id].kernel_thread) {
+    Spinlock_UnlockIrqRestore(&sched_lock, flags);
+    return -1;
+  }
+
+  TCB *task = &tasks[task_id];
+  int cpu = Scheduler_PickCpu(mask, task->cpu);
+  if (cpu < 0) {
+    Spinlock_UnlockIrqRestore(&sched_lock, flags);
+    return -1;
+  }
+  task->affinity = mask;
+
+  if (cpu != task->cpu) {
+    CpuData *old = PerCpu_Get(task->cpu);
+    task->cpu = cpu;
+    if (old && old->current_task == task_id) {
+      // Moved when it is next switched out
+      old->need_resched = 1;
+    } else if (task->state == TASK_READY) {
+      // Moves its entry from the old queue to the new one
+      Scheduler_Enqueue(task_id);
+    }
+  }
+  Spinlock_UnlockIrqRestore(&sched_lock, flags);
+  return 0;
+}
+
+void Scheduler_IsolateCpus(uint64_t mask) {
+  uint64_t flags = Spinlock_LockIrqSave(&sched_lock);
+  isolated_cpus = mask & ~1ULL; // The boot CPU does the housekeeping
+  Spinlock_UnlockIrqRestore(&sched_lock, flags);
+}
+
+uint64_t Scheduler_GetIsolatedCpus() { return isolated_cpus; }
@@ -4,19 +4,121 @@
 #include "interrupt.h"
 #include <stdint.h>
 
-#define MAX_TASKS 10
+#define MAX_TASKS 16
+
+// Task states
+#define TASK_READY 0
+#define TASK_BLOCKED 1
 
 typedef struct {
   uint64_t rsp;
   int active;
+  int state;            // TASK_READY or TASK_BLOCKED
+  int kernel_thread;    // Idle/worker threads (never terminated by ESC)
   void *stack_base;     // For freeing
   uint64_t stack_pages; // For freeing
+  uint64_t kstack_top;  // Loaded into TSS.RSP0 while this task runs
+  int cpu;              // CPU whose run queue the task is on
+  int rq_cpu;           // Run queue holding an entry for it, -1 if none
+  uint64_t affinity;    // CPUs the task may run on
+
+  // Accounting (TSC cycles)
+  uint64_t runtime_cycles; // Time spent running
+  uint64_t wait_cycles;    // Time spent READY but waiting for a CPU
+  uint64_t switch_count;   // Times switched in
+  uint64_t last_run;       // TSC when last switched in
+  uint64_t ready_since;    // TSC when last queued
 } TCB;
 
+// Per-task statistics as returned to user mode
+typedef struct {
+  uint64_t runtime_cycles;
+  uint64_t wait_cycles;
+  uint64_t switch_count;
+  int active;
+  int state;
+  int cpu;
+  int kernel_thread;
+  uint64_t affinity;
+} TaskStats;
+
+// Switch trace
+#define SCHED_TRACE_SIZE 256 // Entries, power of two
+
+// Why the outgoing task gave up the CPU
+#define SCHED_SWITCH_PREEMPT 0 // Reschedule on interrupt exit
+#define SCHED_SWITCH_YIELD 1   // Kernel thread yielded while runnable
+#define SCHED_SWITCH_BLOCK 2   // Outgoing task went to sleep
+#define SCHED_SWITCH_EXIT 3    // Outgoing task terminated
+#define SCHED_SWITCH_MANUAL 4  // CapsLock
+
+typedef struct {
+  uint64_t timestamp;   // TSC when the switch completed
+  uint32_t cost_cycles; // Time spent in the scheduler, lock wait included
+  int16_t prev;
+  int16_t next;
+  uint8_t reason; // SCHED_SWITCH_*
+  uint8_t cpu;
+  uint16_t reserved;
+} SchedTraceEntry;
+
 void Scheduler_Init();
-void Scheduler_AddTask(void (*fn)(), void *stack_base);
-void Scheduler_AddUserTask(void (*fn)(), void *stack_base,
-                           uint64_t stack_pages);
+int Scheduler_AddTask(void (*fn)(), void *stack_base);
+int Scheduler_AddKernelThread(void (*fn)(), void *stack_base);
+// Returns the new task's id, or -1
+int Scheduler_AddUserTask(void (*fn)(), void *stack_base,
+                          uint64_t stack_pages);
 void Scheduler_Switch(InterruptFrame **frame_ptr);
 void Scheduler_TerminateCurrentTask(InterruptFrame **frame_ptr);
+
+// Block/wake path
+// Scheduler_Block marks the current task as blocked; the caller must then
+// give up the CPU (Scheduler_Yield from a kernel thread). Mark the task
+// blocked before the final check of the wait condition, with interrupts
+// disabled until the yield, so a wakeup from an IRQ handler or another CPU
+// cannot be lost.
+int Scheduler_GetCurrentTask();
+void Scheduler_Block();
+void Scheduler_Wake(int task_id);
+void Scheduler_Yield();
+// 1 if the caller may Scheduler_Block + Scheduler_Yield: a kernel thread
+// running with interrupts enabled (not an interrupt or syscall handler)
+int Scheduler_CanSleep();
+// 1 if another task is queued to run on this CPU, so Scheduler_Yield would
+// give the CPU away instead of coming straight back
+int Scheduler_HasRunnable();
+void Scheduler_Schedule(InterruptFrame **frame_ptr);
+void Scheduler_Preempt(InterruptFrame **frame_ptr);
+// 1 if Scheduler_Preempt would switch when returning to code segment 'cs'
+int Scheduler_PreemptPending(uint64_t cs);
+// Asks this CPU to switch away from or terminate the user task that was
+// interrupted, for code that cannot touch the interrupt frame (softirqs).
+// Carried out on the next interrupt exit to that task's user mode code.
+#define SCHED_REQUEST_NONE 0
+#define SCHED_REQUEST_SWITCH 1    // As Scheduler_Switch
+#define SCHED_REQUEST_TERMINATE 2 // As Scheduler_TerminateCurrentTask
+void Scheduler_Request(int request);
+InterruptFrame *Scheduler_SleepFromSyscall(InterruptFrame *frame);
+// Voluntary switch from a syscall; the task stays runnable. Returns the frame
+// to switch to ('frame' itself if nothing else is runnable).
+InterruptFrame *Scheduler_YieldFromSyscall(InterruptFrame *frame);
+
+// Statistics
+// Fills 'out' for any task slot ever used (terminated tasks report
+// active = 0). Returns 0, or -1 if 'task_id' is out of range.
+int Scheduler_GetTaskStats(int task_id, TaskStats *out);
+// Copies up to 'max' of the most recent switch events, oldest first.
+// Returns the number of entries copied.
+int Scheduler_ReadTrace(SchedTraceEntry *out, int max);
+
+// CPU affinity
+// Restricts a task to the CPUs in 'mask' (bit n = CPU n), moving it if its
+// current CPU is no longer allowed. Returns -1 for an invalid task or a mask
+// with no online CPU. Kernel threads keep their placement.
+int Scheduler_SetAffinity(int task_id, uint64_t mask);
+// Reserves CPUs for tasks explicitly pinned to them: tasks created afterwards
+// default to the remaining CPUs. CPU 0 is never isolated. Call at boot,
+// before creating tasks.
+void Scheduler_IsolateCpus(uint64_t mask);
+uint64_t Scheduler_GetIsolatedCpus();
 #endif
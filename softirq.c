@@ -0,0 +1,121 @@
+#include "softirq.h"
+#include "apic.h"
+#include "cpu.h"
+#include "memory.h"
+#include "percpu.h"
+#include "schedule.h"
+#include <stddef.h>
+
+static void (*handlers[SOFTIRQ_COUNT])(void);
+static SoftirqStats stats;
+
+// Softirq thread of each CPU, -1 until Softirq_Init
+static int threads[MAX_CPUS] = {-1, -1, -1, -1, -1, -1, -1, -1};
+static int num_threads = 0;
+
+void Softirq_Register(int nr, void (*handler)(void)) {
+  if (nr >= 0 && nr < SOFTIRQ_COUNT)
+    handlers[nr] = handler;
+}
+
+void Softirq_Raise(int nr) {
+  __atomic_fetch_or(&PerCpu_This()->softirq_pending, 1u << nr,
+                    __ATOMIC_RELEASE);
+}
+
+int Softirq_Active(void) { return PERCPU_READ(in_softirq); }
+
+void Softirq_GetStats(SoftirqStats *out) { *out = stats; }
+
+// Runs the pending handlers of 'cpu' with interrupts enabled, within the
+// budget. Entered and left with interrupts disabled. Returns 1 if softirqs
+// are still pending.
+static int Softirq_Process(CpuData *cpu) {
+  uint64_t budget = LAPIC_GetTscFrequency() / 1000000 * SOFTIRQ_BUDGET_US;
+  uint64_t start = Cpu_ReadTSC();
+
+  cpu->in_softirq = 1;
+  for (int round = 0; round < SOFTIRQ_MAX_ROUNDS; round++) {
+    uint32_t pending =
+        __atomic_exchange_n(&cpu->softirq_pending, 0, __ATOMIC_ACQUIRE);
+    if (!pending)
+      break;
+
+    asm volatile("sti" ::: "memory");
+    while (pending) {
+      int nr = __builtin_ctz(pending);
+      pending &= pending - 1;
+      if (handlers[nr]) {
+        handlers[nr]();
+        __atomic_fetch_add(&stats.runs[nr], 1, __ATOMIC_RELAXED);
+      }
+    }
+    asm volatile("cli" ::: "memory");
+
+    if (Cpu_ReadTSC() - start >= budget)
+      break;
+  }
+  cpu->in_softirq = 0;
+  return cpu->softirq_pending != 0;
+}
+
+void Softirq_IrqExit(void) {
+  CpuData *cpu = PerCpu_This();
+  // Nested in a softirq run, or the thread has taken over
+  if (!cpu->softirq_pending || cpu->in_softirq || cpu->softirq_deferred)
+    return;
+
+  if (Softirq_Process(cpu) && threads[cpu->cpu_id] >= 0) {
+    cpu->softirq_deferred = 1;
+    __atomic_fetch_add(&stats.thread_wakeups, 1, __ATOMIC_RELAXED);
+    Scheduler_Wake(threads[cpu->cpu_id]);
+  }
+}
+
+static void Softirq_ThreadMain() {
+  // Threads are created in CPU order; find which CPU's bitmap is ours
+  int self = Scheduler_GetCurrentTask();
+  CpuData *cpu = NULL;
+  for (int i = 0; i < num_threads && !cpu; i++)
+    if (threads[i] == self)
+      cpu = PerCpu_Get(i);
+
+  while (1) {
+    // Marked blocked before looking, so the wakeup from an interrupt exit
+    // that ran out of budget cannot be lost
+    uint64_t flags = Cpu_IrqSave();
+    Scheduler_Block();
+    if (!cpu || !cpu->softirq_pending) {
+      if (cpu)
+        cpu->softirq_deferred = 0;
+      Scheduler_Yield();
+      Cpu_IrqRestore(flags);
+      continue;
+    }
+    Scheduler_Wake(self);
+
+    // Other tasks get the CPU between batches
+    Softirq_Process(cpu);
+    Cpu_IrqRestore(flags);
+    Scheduler_Yield();
+  }
+}
+
+void Softirq_Init(int num_cpus) {
+  if (num_cpus > MAX_CPUS)
+    num_cpus = MAX_CPUS;
+
+  for (int i = 0; i < num_cpus; i++) {
+    void *stack = PageAllocator_Alloc(1);
+    if (!stack)
+      break;
+
+    int task = Scheduler_AddKernelThread(Softirq_ThreadMain, stack);
+    if (task < 0) {
+      PageAllocator_Free(stack, 1);
+      break;
+    }
+    threads[i] = task;
+    num_threads++;
+  }
+}
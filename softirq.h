@@ -0,0 +1,43 @@
+#ifndef SOFTIRQ_H
+#define SOFTIRQ_H
+
+#include <stdint.h>
+
+// Softirqs: the deferred half of interrupt handling. A hard IRQ handler
+// does the minimum (acknowledge the device, grab its data, EOI) and raises
+// a softirq; the softirq handler runs on the same CPU on interrupt exit,
+// with interrupts enabled. Each CPU has its own pending bitmap.
+//
+// Softirq handlers run in interrupt context: they must not sleep, and may
+// only take locks that are always taken with interrupts disabled.
+#define SOFTIRQ_TIMER 0    // Timer tick work (delayed work expiry)
+#define SOFTIRQ_BLOCK 1    // NVMe completions
+#define SOFTIRQ_KEYBOARD 2 // Scancode translation
+#define SOFTIRQ_COUNT 8
+
+// A run on interrupt exit stops after SOFTIRQ_MAX_ROUNDS passes over the
+// pending bitmap or SOFTIRQ_BUDGET_US, whichever comes first. Whatever is
+// left goes to the CPU's softirq thread, and interrupt exits leave
+// softirqs to it until it has caught up.
+#define SOFTIRQ_MAX_ROUNDS 10
+#define SOFTIRQ_BUDGET_US 2000
+
+typedef struct {
+  uint64_t runs[SOFTIRQ_COUNT]; // Handler invocations
+  uint64_t thread_wakeups;      // Times the budget ran out
+} SoftirqStats;
+
+void Softirq_Register(int nr, void (*handler)(void));
+// Marks 'nr' pending on this CPU. Call with interrupts disabled (from a
+// hard IRQ handler); it runs on the way out of the interrupt.
+void Softirq_Raise(int nr);
+// Called on interrupt exit with interrupts disabled
+void Softirq_IrqExit(void);
+// 1 while this CPU is running softirq handlers
+int Softirq_Active(void);
+void Softirq_GetStats(SoftirqStats *out);
+
+// Starts one softirq thread per CPU. Must run after Scheduler_Init.
+void Softirq_Init(int num_cpus);
+
+#endif
@@ -0,0 +1,189 @@
+#include "spinlock.h"
+
+static LockClass *volatile lock_classes = NULL;
+
+#ifdef LOCK_STAT
+static void LockStat_Register(LockClass *cls) {
+  // First user of a class links it into the registry
+  if (__atomic_exchange_n(&cls->registered, 1, __ATOMIC_ACQ_REL))
+    return;
+  LockClass *head = __atomic_load_n(&lock_classes, __ATOMIC_RELAXED);
+  do {
+    cls->next = head;
+  } while (!__atomic_compare_exchange_n(&lock_classes, &head, cls, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+void LockStat_Acquired(LockClass *cls, int contended, uint64_t wait_cycles) {
+  if (!cls)
+    return;
+  if (!cls->registered)
+    LockStat_Register(cls);
+  // Classes are shared between locks, so updates must be atomic
+  __atomic_fetch_add(&cls->acquisitions, 1, __ATOMIC_RELAXED);
+  if (contended) {
+    __atomic_fetch_add(&cls->contentions, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&cls->wait_cycles, wait_cycles, __ATOMIC_RELAXED);
+  }
+}
+
+void LockStat_Released(LockClass *cls, uint64_t hold_cycles) {
+  if (!cls)
+    return;
+  __atomic_fetch_add(&cls->hold_cycles, hold_cycles, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&cls->max_hold_cycles, __ATOMIC_RELAXED);
+  while (hold_cycles > max &&
+         !__atomic_compare_exchange_n(&cls->max_hold_cycles, &max, hold_cycles,
+                                      1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+#endif
+
+LockClass *LockStat_First() {
+  return __atomic_load_n(&lock_classes, __ATOMIC_ACQUIRE);
+}
+
+void LockStat_Reset() {
+  for (LockClass *cls = LockStat_First(); cls; cls = cls->next) {
+    cls->acquisitions = 0;
+    cls->contentions = 0;
+    cls->wait_cycles = 0;
+    cls->hold_cycles = 0;
+    cls->max_hold_cycles = 0;
+  }
+}
+
+int LockStat_Get(int index, LockStatInfo *out) {
+  LockClass *cls = LockStat_First();
+  for (int i = 0; cls && i < index; i++)
+    cls = cls->next;
+  if (index < 0 || !cls)
+    return -1;
+
+  int n = 0;
+  while (cls->name && cls->name[n] && n < LOCK_STAT_NAME_LEN - 1) {
+    out->name[n] = cls->name[n];
+    n++;
+  }
+  out->name[n] = 0;
+  out->acquisitions = __atomic_load_n(&cls->acquisitions, __ATOMIC_RELAXED);
+  out->contentions = __atomic_load_n(&cls->contentions, __ATOMIC_RELAXED);
+  out->wait_cycles = __atomic_load_n(&cls->wait_cycles, __ATOMIC_RELAXED);
+  out->hold_cycles = __atomic_load_n(&cls->hold_cycles, __ATOMIC_RELAXED);
+  out->max_hold_cycles =
+      __atomic_load_n(&cls->max_hold_cycles, __ATOMIC_RELAXED);
+  return 0;
+}
+
+// --- MCS queue lock ---
+
+void McsLock_Init(McsLock *lock, LockClass *cls) {
+  lock->tail = NULL;
+  lock->cls = cls;
+  lock->acquired_at = 0;
+}
+
+void McsLock_Lock(McsLock *lock, McsNode *node) {
+  node->next = NULL;
+  node->locked = 1;
+
+  McsNode *prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+#ifdef LOCK_STAT
+  uint64_t start = Cpu_ReadTSC();
+#endif
+  if (prev) {
+    // Queue behind the previous holder and spin on our own node
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+      Cpu_Pause();
+  }
+#ifdef LOCK_STAT
+  lock->acquired_at = Cpu_ReadTSC();
+  LockStat_Acquired(lock->cls, prev != NULL, lock->acquired_at - start);
+#endif
+}
+
+void McsLock_Unlock(McsLock *lock, McsNode *node) {
+#ifdef LOCK_STAT
+  LockStat_Released(lock->cls, Cpu_ReadTSC() - lock->acquired_at);
+#endif
+  McsNode *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+  if (!next) {
+    // No known successor: try to mark the lock free
+    McsNode *expected = node;
+    if (__atomic_compare_exchange_n(&lock->tail, &expected, NULL, 0,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      return;
+    // A successor is between its exchange and linking itself in
+    while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)))
+      Cpu_Pause();
+  }
+  __atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+}
+
+// --- Reader-writer lock ---
+
+void RwLock_Init(RwLock *lock, LockClass *cls) {
+  lock->state = 0;
+  lock->cls = cls;
+  lock->acquired_at = 0;
+}
+
+void RwLock_ReadLock(RwLock *lock) {
+#ifdef LOCK_STAT
+  uint64_t start = Cpu_ReadTSC();
+  int contended = 0;
+#endif
+  while (1) {
+    uint32_t s = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+    if (!(s & (RWLOCK_WRITER | RWLOCK_WAITING)) &&
+        __atomic_compare_exchange_n(&lock->state, &s, s + 1, 1,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      break;
+#ifdef LOCK_STAT
+    contended = 1;
+#endif
+    Cpu_Pause();
+  }
+#ifdef LOCK_STAT
+  LockStat_Acquired(lock->cls, contended, Cpu_ReadTSC() - start);
+#endif
+}
+
+void RwLock_ReadUnlock(RwLock *lock) {
+  __atomic_fetch_sub(&lock->state, 1, __ATOMIC_RELEASE);
+}
+
+void RwLock_WriteLock(RwLock *lock) {
+#ifdef LOCK_STAT
+  uint64_t start = Cpu_ReadTSC();
+  int contended = 0;
+#endif
+  while (1) {
+    uint32_t s = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+    // Free apart from (possibly our own) waiting flag: take it
+    if ((s & ~RWLOCK_WAITING) == 0 &&
+        __atomic_compare_exchange_n(&lock->state, &s, RWLOCK_WRITER, 1,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      break;
+    // Stop new readers from getting in while we wait
+    if (!(s & RWLOCK_WAITING))
+      __atomic_fetch_or(&lock->state, RWLOCK_WAITING, __ATOMIC_RELAXED);
+#ifdef LOCK_STAT
+    contended = 1;
+#endif
+    Cpu_Pause();
+  }
+#ifdef LOCK_STAT
+  lock->acquired_at = Cpu_ReadTSC();
+  LockStat_Acquired(lock->cls, contended, lock->acquired_at - start);
+#endif
+}
+
+void RwLock_WriteUnlock(RwLock *lock) {
+#ifdef LOCK_STAT
+  LockStat_Released(lock->cls, Cpu_ReadTSC() - lock->acquired_at);
+#endif
+  // Drop the writer bit but keep a waiting flag set by another writer
+  __atomic_fetch_and(&lock->state, ~RWLOCK_WRITER, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,195 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include "cpu.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Kernel locking primitives
+// - Spinlock: FIFO ticket lock, for short critical sections
+// - McsLock:  queue lock, each waiter spins on its own node (no cache line
+//             bouncing under heavy contention)
+// - RwLock:   reader-writer spinlock with writer preference
+// The *IrqSave variants also disable interrupts, which is required for any
+// lock that is taken from an interrupt handler.
+//
+// Build with LOCK_STAT=1 (see Makefile) to record acquisitions, contention
+// and hold time for every lock class.
+
+// Statistics are shared by all locks of the same class
+typedef struct LockClass {
+  const char *name;
+  uint64_t acquisitions;
+  uint64_t contentions;
+  uint64_t wait_cycles;     // Total TSC cycles spent spinning
+  uint64_t hold_cycles;     // Total TSC cycles held (exclusive holds)
+  uint64_t max_hold_cycles; // Longest single exclusive hold
+  struct LockClass *next;   // Registry of classes seen so far
+  int registered;
+} LockClass;
+
+#define LOCK_CLASS_INIT(n) {.name = (n)}
+
+#ifdef LOCK_STAT
+void LockStat_Acquired(LockClass *cls, int contended, uint64_t wait_cycles);
+void LockStat_Released(LockClass *cls, uint64_t hold_cycles);
+#endif
+
+// Iterate over all classes that have been used at least once
+LockClass *LockStat_First();
+void LockStat_Reset();
+
+// A class as SYSCALL_LOCK_STATS reports it
+#define LOCK_STAT_NAME_LEN 32
+typedef struct {
+  char name[LOCK_STAT_NAME_LEN]; // NUL terminated, truncated if needed
+  uint64_t acquisitions;
+  uint64_t contentions;
+  uint64_t wait_cycles;
+  uint64_t hold_cycles;
+  uint64_t max_hold_cycles;
+} LockStatInfo;
+
+// Copies the 'index'th class of the registry (most recently seen first).
+// Returns -1 past the end; without LOCK_STAT the registry stays empty.
+int LockStat_Get(int index, LockStatInfo *out);
+
+// --- Ticket lock ---
+
+typedef struct {
+  volatile uint32_t next;  // Next ticket to hand out
+  volatile uint32_t owner; // Ticket currently being served
+  LockClass *cls;
+  uint64_t acquired_at;
+} Spinlock;
+
+#define SPINLOCK_INIT(c) {0, 0, (c), 0}
+
+static inline void Spinlock_Init(Spinlock *lock, LockClass *cls) {
+  lock->next = 0;
+  lock->owner = 0;
+  lock->cls = cls;
+  lock->acquired_at = 0;
+}
+
+static inline void Spinlock_Lock(Spinlock *lock) {
+  uint32_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+#ifdef LOCK_STAT
+  uint64_t start = Cpu_ReadTSC();
+  int contended = __atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket;
+#endif
+  while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket)
+    Cpu_Pause();
+#ifdef LOCK_STAT
+  lock->acquired_at = Cpu_ReadTSC();
+  LockStat_Acquired(lock->cls, contended, lock->acquired_at - start);
+#endif
+}
+
+static inline int Spinlock_TryLock(Spinlock *lock) {
+  uint32_t owner = __atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE);
+  uint32_t expected = owner;
+  if (!__atomic_compare_exchange_n(&lock->next, &expected, owner + 1, 0,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return 0;
+#ifdef LOCK_STAT
+  lock->acquired_at = Cpu_ReadTSC();
+  LockStat_Acquired(lock->cls, 0, 0);
+#endif
+  return 1;
+}
+
+static inline void Spinlock_Unlock(Spinlock *lock) {
+#ifdef LOCK_STAT
+  LockStat_Released(lock->cls, Cpu_ReadTSC() - lock->acquired_at);
+#endif
+  __atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t Spinlock_LockIrqSave(Spinlock *lock) {
+  uint64_t flags = Cpu_IrqSave();
+  Spinlock_Lock(lock);
+  return flags;
+}
+
+static inline void Spinlock_UnlockIrqRestore(Spinlock *lock, uint64_t flags) {
+  Spinlock_Unlock(lock);
+  Cpu_IrqRestore(flags);
+}
+
+// --- MCS queue lock ---
+
+// Each acquirer supplies its own node (usually on its stack) and passes the
+// same node to unlock.
+typedef struct McsNode {
+  struct McsNode *volatile next;
+  volatile int locked;
+} McsNode;
+
+typedef struct {
+  McsNode *volatile tail;
+  LockClass *cls;
+  uint64_t acquired_at;
+} McsLock;
+
+#define MCSLOCK_INIT(c) {NULL, (c), 0}
+
+void McsLock_Init(McsLock *lock, LockClass *cls);
+void McsLock_Lock(McsLock *lock, McsNode *node);
+void McsLock_Unlock(McsLock *lock, McsNode *node);
+
+static inline uint64_t McsLock_LockIrqSave(McsLock *lock, McsNode *node) {
+  uint64_t flags = Cpu_IrqSave();
+  McsLock_Lock(lock, node);
+  return flags;
+}
+
+static inline void McsLock_UnlockIrqRestore(McsLock *lock, McsNode *node,
+                                            uint64_t flags) {
+  McsLock_Unlock(lock, node);
+  Cpu_IrqRestore(flags);
+}
+
+// --- Reader-writer lock ---
+
+#define RWLOCK_WRITER 0x80000000u  // Held by a writer
+#define RWLOCK_WAITING 0x40000000u // A writer is waiting, readers back off
+
+typedef struct {
+  volatile uint32_t state; // Reader count | RWLOCK_WRITER | RWLOCK_WAITING
+  LockClass *cls;
+  uint64_t acquired_at;
+} RwLock;
+
+#define RWLOCK_INIT(c) {0, (c), 0}
+
+void RwLock_Init(RwLock *lock, LockClass *cls);
+void RwLock_ReadLock(RwLock *lock);
+void RwLock_ReadUnlock(RwLock *lock);
+void RwLock_WriteLock(RwLock *lock);
+void RwLock_WriteUnlock(RwLock *lock);
+
+static inline uint64_t RwLock_ReadLockIrqSave(RwLock *lock) {
+  uint64_t flags = Cpu_IrqSave();
+  RwLock_ReadLock(lock);
+  return flags;
+}
+
+static inline void RwLock_ReadUnlockIrqRestore(RwLock *lock, uint64_t flags) {
+  RwLock_ReadUnlock(lock);
+  Cpu_IrqRestore(flags);
+}
+
+static inline uint64_t RwLock_WriteLockIrqSave(RwLock *lock) {
+  uint64_t flags = Cpu_IrqSave();
+  RwLock_WriteLock(lock);
+  return flags;
+}
+
+static inline void RwLock_WriteUnlockIrqRestore(RwLock *lock,
+                                                uint64_t flags) {
+  RwLock_WriteUnlock(lock);
+  Cpu_IrqRestore(flags);
+}
+
+#endif
@@ -1,10 +1,18 @@
 #include "syscall.h"
+#include "bcache.h"
+#include "cpu.h"
 #include "gdt.h"
+#include "futex.h"
 #include "graphics.h"
 #include "interrupt.h"
 #include "memory.h"
 #include "nvme.h"
+#include "percpu.h"
 #include "schedule.h"
+#include "spinlock.h"
+#include "uring.h"
+#include "usercopy.h"
+#include "elf.h"
 #include <stdint.h>
 
 extern void syscall_entry();
@@ -21,20 +29,9 @@ uint64_t MSR_Read(uint32_t msr) {
   return ((uint64_t)high << 32) | low;
 }
 
-// Per-CPU data structure for GS segment
-typedef struct {
-  uint64_t user_rsp_scratch; // Offset 0
-  uint64_t kernel_stack;     // Offset 8 (Optional usage)
-} CpuData;
-
 void Syscall_Init() {
-  // 0. Setup Per-CPU Data for GS
-  CpuData *cpu_data = (CpuData *)PageAllocator_Alloc(1); // 1 Page
-  if (cpu_data) {
-    // Write the address of the structure to MSR_KERNEL_GS_BASE
-    // When executing 'swapgs' in syscall_entry, GS Base will point here.
-    MSR_Write(MSR_KERNEL_GS_BASE, (uint64_t)cpu_data);
-  }
+  // 0. Per-CPU data for GS is set up by PerCpu_Init (percpu.c), which must
+  // run first: syscall_entry takes its stack from there.
 
   // 1. Enable SCE (System Call Extensions) in EFER
   uint64_t efer = MSR_Read(MSR_EFER);
@@ -124,115 +121,413 @@ void Syscall_Init() {
 static uint32_t console_x = 10;
 static uint32_t console_y = 10;
 
-uint64_t Syscall_Handler(uint64_t sys_num, uint64_t a1, uint64_t a2,
-                         uint64_t a3, uint64_t a4, uint64_t a5) {
-  switch (sys_num) {
-  case SYSCALL_CLEAR: {
-    Graphics_Clear(a1);
-    console_x = 10;
-    console_y = 10;
-    break;
-  }
-  case SYSCALL_PRINT: {
-    // a1 = string pointer
-    // a2 = length? Or null terminated.
-    // a3 = color?
-    char *str = (char *)a1;
-    uint32_t color = (uint32_t)a2;
-
-    uint32_t width = 0, height = 0;
-    Graphics_GetDimensions(&width, &height);
-    if (width == 0)
-      width = 800; // Fallback
-    if (height == 0)
-      height = 600;
-
-    while (*str) {
-      char c = *str;
-      if (c == '\n') {
+// syscall_entry saves the user context as an InterruptFrame at the top of the
+// current task's kernel stack. Its RAX slot is what user mode gets back.
+static InterruptFrame *Syscall_CurrentFrame() {
+  return (InterruptFrame *)(PERCPU_READ(kernel_stack) - sizeof(InterruptFrame));
+}
+
+void Syscall_ConsolePrint(const char *str, uint32_t color) {
+  uint32_t width = 0, height = 0;
+  Graphics_GetDimensions(&width, &height);
+  if (width == 0)
+    width = 800; // Fallback
+  if (height == 0)
+    height = 600;
+
+  while (*str) {
+    char c = *str;
+    if (c == '\n') {
+      console_x = 10;
+      console_y += 16;
+    } else if (c == '\r') {
+      console_x = 10;
+    } else {
+      Graphics_PutChar(console_x, console_y, c, color);
+      console_x += 8;
+      if (console_x >= width - 8) {
         console_x = 10;
         console_y += 16;
-      } else if (c == '\r') {
-        console_x = 10;
-      } else {
-        Graphics_PutChar(console_x, console_y, c, color);
-        console_x += 8;
-        if (console_x >= width - 8) {
-          console_x = 10;
-          console_y += 16;
-        }
       }
+    }
 
-      if (console_y >= height - 16) {
-        console_y = 10;
-        Graphics_Clear(0x000000); // Clear screen on wrap for now
-      }
-      str++;
+    if (console_y >= height - 16) {
+      console_y = 10;
+      Graphics_Clear(0x000000); // Clear screen on wrap for now
     }
-    break;
+    str++;
   }
-  case SYSCALL_EXEC: {
-    // a1 = function pointer
-    // a2 = stack pages count
-    void *stack = PageAllocator_Alloc(a2);
-    if (!stack) {
-      break;
-    }
-    void (*func_ptr)() = (void (*)())a1;
-    // Use Scheduler_AddUserTask to run as Ring 3 with correct stack management
-    Scheduler_AddUserTask(func_ptr, stack, a2);
+}
 
-    break;
-  }
-  case SYSCALL_TERMINATE: {
-    // Terminate current task and switch to next
-    // We need to pass a pointer to a frame pointer, but we don't care about
-    // saving current frame. However, Scheduler_TerminateCurrentTask updates the
-    // *pointer* to the NEW frame.
-
-    InterruptFrame *new_rsp = NULL;
-    // We pass address of new_rsp. Scheduler will write the new task's RSP to
-    // new_rsp.
-    Scheduler_TerminateCurrentTask(&new_rsp);
-
-    // Return the new RSP to assembly wrapper, which will switch stack and jump
-    // to isr_restore
-    return (uint64_t)new_rsp;
-  }
-  case SYSCALL_HALT: {
-    asm volatile("hlt");
+// --- Syscall implementations ---
+// Each handler gets the arguments already checked against its table entry
+// and returns the value for RAX. A handler that puts the task to sleep or
+// ends it stores the frame to switch to in *next instead (and sets the RAX
+// slot of its own frame itself if it will be resumed).
+
+static uint64_t Sys_Clear(const uint64_t *a, InterruptFrame **next) {
+  (void)next;
+  Graphics_Clear((uint32_t)a[0]);
+  console_x = 10;
+  console_y = 10;
+  return 0;
+}
+
+static uint64_t Sys_Print(const uint64_t *a, InterruptFrame **next) {
+  (void)next;
+  return Syscall_PrintUser((const char *)a[0], (uint32_t)a[1]);
+}
+
+static uint64_t Sys_Exec(const uint64_t *a, InterruptFrame **next) {
+  (void)next;
+  if (!User_RangeOk((void *)a[0], 1))
+    return SYSCALL_EFAULT;
+  void *stack = PageAllocator_Alloc(a[1]);
+  if (!stack)
+    return SYSCALL_ENOMEM;
+  // Use Scheduler_AddUserTask to run as Ring 3 with correct stack management
+  if (Scheduler_AddUserTask((void (*)())a[0], stack, a[1]) < 0) {
+    PageAllocator_Free(stack, a[1]);
+    return SYSCALL_ENOMEM;
   }
-  case SYSCALL_NVME_READ: {
-    // a1 = nsid (uint32)
-    // a2 = lba (uint64)
-    // a3 = buffer (ptr)
-    // a4 = count (uint32)
-    NVMe_Read((uint32_t)a1, (uint64_t)a2, (void *)a3, (uint32_t)a4);
-    break;
+  return 0;
+}
+
+static uint64_t Sys_IrqStats(const uint64_t *a, InterruptFrame **next) {
+  (void)next;
+  if (a[0] > 255)
+    return SYSCALL_EINVAL;
+  IrqStats stats;
+  Interrupt_GetStats((uint8_t)a[0], &stats);
+  if (copy_to_user((void *)a[1], &stats, sizeof(stats)))
+    return SYSCALL_EFAULT;
+  return 0;
+}
+
+static uint64_t Sys_BCacheStats(const uint64_t *a, InterruptFrame **next) {
+  (void)next;
+  BCache_Stats stats;
+  BCache_GetStats(&stats);
+  if (copy_to_user((void *)a[0], &stats, sizeof(stats)))
+    return SYSCALL_EFAULT;
+  return 0;
+}
+
+static uint64_t Sys_LockStats(const uint64_t *a, InterruptFrame **next) {
+  (void)next;
+#ifndef LOCK_STAT
+  (void)a;
+  return SYSCALL_ENOSYS;
+#else
+  if (a[0] == LOCK_STATS_RESET) {
+    LockStat_Reset();
+    return 0;
   }
-  case SYSCALL_NVME_WRITE: {
-    // a1 = nsid (uint32)
-    // a2 = lba (uint64)
-    // a3 = buffer (ptr)
-    // a4 = count (uint32)
-    NVMe_Write((uint32_t)a1, (uint64_t)a2, (void *)a3, (uint32_t)a4);
-    break;
+  // Iterating indexes from 0 until SYSCALL_EINVAL lists every class
+  LockStatInfo info;
+  if (a[0] > 0x7FFFFFFF || LockStat_Get((int)a[0], &info) != 0)
+    return SYSCALL_EINVAL;
+  if (copy_to_user((void *)a[1], &info, sizeof(info)))
+    return SYSCALL_EFAULT;
+  return 0;
+#endif
+}
+
+static uint64_t Sys_ExecElf(const uint64_t *a, InterruptFrame **next) {
+  (void)next;
+  // Returns the new task id
+  return (uint64_t)Elf_Exec((uint32_t)a[0], a[1], a[2]);
+}
+
+static uint64_t Sys_Terminate(const uint64_t *a, InterruptFrame **next) {
+  (void)a;
+  // Nothing of the current frame needs saving; the scheduler stores the next
+  // task's frame in *next and syscall_entry switches to it.
+  Scheduler_TerminateCurrentTask(next);
+  return 0;
+}
+
+static uint64_t Sys_Halt(const uint64_t *a, InterruptFrame **next) {
+  (void)a;
+  (void)next;
+  asm volatile("hlt");
+  return 0;
+}
+
+// Both go through the block cache, which copies to and from the buffer with
+// copy_to_user/copy_from_user, so an unmapped page fails with -EFAULT.
+// Before BCache_Init the controller accesses the buffer directly, so it must
+// still be in the identity-mapped part of user space. Writes are flushed
+// before returning, also after a fault changed part of the blocks.
+static uint64_t Sys_BCacheResult(int ret) {
+  if (ret == BCACHE_EFAULT)
+    return SYSCALL_EFAULT;
+  return ret ? SYSCALL_EIO : 0;
+}
+
+static uint64_t Sys_NVMeRead(const uint64_t *a, InterruptFrame **next) {
+  (void)next;
+  // Counts are in namespace LBAs; at most 4 KiB each, so no overflow
+  if (a[3] > UINT32_MAX)
+    return SYSCALL_EINVAL;
+  if (!User_DmaOk((void *)a[2], a[3] * NVMe_GetBlockSize()))
+    return SYSCALL_EFAULT;
+  return Sys_BCacheResult(
+      BCache_ReadUser((uint32_t)a[0], a[1], (void *)a[2], (uint32_t)a[3]));
+}
+
+static uint64_t Sys_NVMeWrite(const uint64_t *a, InterruptFrame **next) {
+  (void)next;
+  // Counts are in namespace LBAs; at most 4 KiB each, so no overflow
+  if (a[3] > UINT32_MAX)
+    return SYSCALL_EINVAL;
+  if (!User_DmaOk((void *)a[2], a[3] * NVMe_GetBlockSize()))
+    return SYSCALL_EFAULT;
+  int ret =
+      BCache_WriteUser((uint32_t)a[0], a[1], (void *)a[2], (uint32_t)a[3]);
+  if (BCache_Flush((uint32_t)a[0]) != 0 && ret == 0)
+    ret = -1;
+  return Sys_BCacheResult(ret);
+}
+
+static uint64_t Sys_Kmalloc(const uint64_t *a, InterruptFrame **next) {
+  (void)next;
+  void *ptr = kmalloc((size_t)a[0]);
+  return ptr ? (uint64_t)ptr : SYSCALL_ENOMEM;
+}
+
+static uint64_t Sys_Kfree(const uint64_t *a, InterruptFrame **next) {
+  (void)next;
+  kfree((void *)a[0]);
+  return 0;
+}
+
+static uint64_t Sys_FutexWait(const uint64_t *a, InterruptFrame **next) {
+  // Returns 0 once woken, SYSCALL_EAGAIN if *a[0] != a[1] on entry
+  int queued = Futex_Wait((uint32_t *)a[0], (uint32_t)a[1]);
+  if (queued < 0)
+    return SYSCALL_EFAULT;
+  if (!queued)
+    return SYSCALL_EAGAIN;
+  InterruptFrame *frame = Syscall_CurrentFrame();
+  frame->rax = 0; // Result seen when the task is resumed
+  *next = Scheduler_SleepFromSyscall(frame);
+  return 0;
+}
+
+static uint64_t Sys_FutexWake(const uint64_t *a, InterruptFrame **next) {
+  (void)next;
+  return (uint64_t)Futex_Wake((uint32_t *)a[0], (int)a[1]);
+}
+
+static uint64_t Sys_TaskStats(const uint64_t *a, InterruptFrame **next) {
+  (void)next;
+  // Iterating ids from 0 until SYSCALL_EINVAL lists every task
+  TaskStats stats;
+  if (Scheduler_GetTaskStats((int)a[0], &stats) != 0)
+    return SYSCALL_EINVAL;
+  if (copy_to_user((void *)a[1], &stats, sizeof(stats)) != 0)
+    return SYSCALL_EFAULT;
+  return 0;
+}
+
+static uint64_t Sys_SchedTrace(const uint64_t *a, InterruptFrame **next) {
+  (void)next;
+  // Returns the number of entries copied, oldest first. The trace is read
+  // into a kernel buffer first: it is taken under the scheduler lock.
+  int max = (int)a[1];
+  if (max <= 0)
+    return 0;
+  if (max > SCHED_TRACE_SIZE)
+    max = SCHED_TRACE_SIZE;
+  SchedTraceEntry *buf =
+      (SchedTraceEntry *)kmalloc(max * sizeof(SchedTraceEntry));
+  if (!buf)
+    return SYSCALL_ENOMEM;
+  int count = Scheduler_ReadTrace(buf, max);
+  uint64_t left =
+      copy_to_user((void *)a[0], buf, count * sizeof(SchedTraceEntry));
+  kfree(buf);
+  return left ? SYSCALL_EFAULT : (uint64_t)count;
+}
+
+static uint64_t Sys_SetAffinity(const uint64_t *a, InterruptFrame **next) {
+  (void)next;
+  int task_id = a[0] == (uint64_t)-1 ? Scheduler_GetCurrentTask() : (int)a[0];
+  if (Scheduler_SetAffinity(task_id, a[1]) != 0)
+    return SYSCALL_EINVAL;
+  return 0;
+}
+
+static uint64_t Sys_Yield(const uint64_t *a, InterruptFrame **next) {
+  (void)a;
+  // If nothing else is runnable the frame is left as is and we return with
+  // sysretq straight away.
+  InterruptFrame *frame = Syscall_CurrentFrame();
+  frame->rax = 0;
+  InterruptFrame *target = Scheduler_YieldFromSyscall(frame);
+  if (target != frame)
+    *next = target;
+  return 0;
+}
+
+static uint64_t Sys_UringSetup(const uint64_t *a, InterruptFrame **next) {
+  (void)a;
+  (void)next;
+  UringRings *rings = Uring_Setup();
+  return rings ? (uint64_t)rings : SYSCALL_ENOMEM;
+}
+
+static uint64_t Sys_UringEnter(const uint64_t *a, InterruptFrame **next) {
+  // Submits every queued SQE and returns how many were consumed
+  int submitted = Uring_Submit();
+  if (submitted < 0)
+    return SYSCALL_EINVAL;
+  if (Uring_Wait((uint32_t)a[0])) {
+    InterruptFrame *frame = Syscall_CurrentFrame();
+    frame->rax = (uint64_t)submitted;
+    *next = Scheduler_SleepFromSyscall(frame);
   }
-  case SYSCALL_KMALLOC: {
-    // a1 = size (uint64)
-    void *ptr = kmalloc((size_t)a1);
-    a1 = (uint64_t)ptr;
+  return (uint64_t)submitted;
+}
+
+static uint64_t Sys_Stats(const uint64_t *a, InterruptFrame **next);
+
+// --- Syscall table ---
+
+// Argument kinds, checked before the handler runs
+#define SYSARG_NONE 0
+#define SYSARG_INT 1    // Any value
+#define SYSARG_PTR 2    // User pointer, must not be NULL
+#define SYSARG_PTR32 3  // User pointer to a 4-byte aligned uint32_t
+
+typedef struct {
+  const char *name;
+  uint64_t (*fn)(const uint64_t *args, InterruptFrame **next);
+  uint8_t nargs;
+  uint8_t args[5]; // SYSARG_* for each argument
+} SyscallEntry;
+
+#define I SYSARG_INT
+#define P SYSARG_PTR
+#define P32 SYSARG_PTR32
+static const SyscallEntry syscall_table[SYSCALL_MAX] = {
+    [SYSCALL_CLEAR] = {"clear", Sys_Clear, 1, {I}},
+    [SYSCALL_PRINT] = {"print", Sys_Print, 2, {P, I}},
+    [SYSCALL_EXEC] = {"exec", Sys_Exec, 2, {P, I}},
+    [SYSCALL_TERMINATE] = {"terminate", Sys_Terminate, 0, {0}},
+    [SYSCALL_HALT] = {"halt", Sys_Halt, 0, {0}},
+    [SYSCALL_NVME_READ] = {"nvme_read", Sys_NVMeRead, 4, {I, I, P, I}},
+    [SYSCALL_NVME_WRITE] = {"nvme_write", Sys_NVMeWrite, 4, {I, I, P, I}},
+    [SYSCALL_KMALLOC] = {"kmalloc", Sys_Kmalloc, 1, {I}},
+    [SYSCALL_KFREE] = {"kfree", Sys_Kfree, 1, {P}},
+    [SYSCALL_FUTEX_WAIT] = {"futex_wait", Sys_FutexWait, 2, {P32, I}},
+    [SYSCALL_FUTEX_WAKE] = {"futex_wake", Sys_FutexWake, 2, {P32, I}},
+    [SYSCALL_TASK_STATS] = {"task_stats", Sys_TaskStats, 2, {I, P}},
+    [SYSCALL_SCHED_TRACE] = {"sched_trace", Sys_SchedTrace, 2, {P, I}},
+    [SYSCALL_SET_AFFINITY] = {"set_affinity", Sys_SetAffinity, 2, {I, I}},
+    [SYSCALL_YIELD] = {"yield", Sys_Yield, 0, {0}},
+    [SYSCALL_URING_SETUP] = {"uring_setup", Sys_UringSetup, 0, {0}},
+    [SYSCALL_URING_ENTER] = {"uring_enter", Sys_UringEnter, 1, {I}},
+    [SYSCALL_STATS] = {"stats", Sys_Stats, 2, {I, P}},
+    [SYSCALL_EXEC_ELF] = {"exec_elf", Sys_ExecElf, 3, {I, I, I}},
+    [SYSCALL_IRQ_STATS] = {"irq_stats", Sys_IrqStats, 2, {I, P}},
+    [SYSCALL_BCACHE_STATS] = {"bcache_stats", Sys_BCacheStats, 1, {P}},
+    [SYSCALL_LOCK_STATS] = {"lock_stats", Sys_LockStats, 2, {I, P}},
+};
+#undef I
+#undef P
+#undef P32
+
+// --- Statistics ---
+
+// Time from entry to the handler's return, so a syscall that sleeps is
+// measured up to the point where it gives up the CPU.
+static SyscallStats syscall_stats[SYSCALL_MAX];
+
+static int Syscall_IsError(uint64_t ret) { return ret >= (uint64_t)-4095; }
+
+static void Syscall_Account(uint64_t num, uint64_t ret, uint64_t cycles) {
+  SyscallStats *s = &syscall_stats[num];
+  int bucket = cycles ? 63 - __builtin_clzll(cycles) : 0;
+  if (bucket >= SYSCALL_HIST_BUCKETS)
+    bucket = SYSCALL_HIST_BUCKETS - 1;
+
+  __atomic_fetch_add(&s->calls, 1, __ATOMIC_RELAXED);
+  if (Syscall_IsError(ret))
+    __atomic_fetch_add(&s->errors, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&s->total_cycles, cycles, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&s->histogram[bucket], 1, __ATOMIC_RELAXED);
+  if (cycles > s->max_cycles)
+    s->max_cycles = cycles;
+}
+
+static uint64_t Sys_Stats(const uint64_t *a, InterruptFrame **next) {
+  (void)next;
+  if (a[0] >= SYSCALL_MAX || !syscall_table[a[0]].fn)
+    return SYSCALL_EINVAL;
+  if (copy_to_user((void *)a[1], &syscall_stats[a[0]], sizeof(SyscallStats)))
+    return SYSCALL_EFAULT;
+  return 0;
+}
+
+// --- Dispatch ---
+
+static uint64_t Syscall_CheckArgs(const SyscallEntry *e, const uint64_t *a) {
+  for (int i = 0; i < e->nargs; i++) {
+    switch (e->args[i]) {
+    case SYSARG_PTR:
+      if (!a[i])
+        return SYSCALL_EINVAL;
+      break;
+    case SYSARG_PTR32:
+      if (!a[i] || (a[i] & 3))
+        return SYSCALL_EINVAL;
+      break;
+    default:
+      break;
+    }
   }
-  case SYSCALL_KFREE: {
-    // a1 = ptr (void*)
-    kfree((void *)a1);
-    break;
+  return 0;
+}
+
+uint64_t Syscall_PrintUser(const char *user_str, uint32_t color) {
+  char buf[128];
+  while (1) {
+    int64_t len = strncpy_from_user(buf, user_str, sizeof(buf));
+    if (len < 0)
+      return SYSCALL_EFAULT;
+    Syscall_ConsolePrint(buf, color);
+    if (len < (int64_t)sizeof(buf) - 1)
+      return 0;
+    user_str += len;
   }
-  default: {
+}
+
+uint64_t Syscall_Handler(uint64_t sys_num, uint64_t a1, uint64_t a2,
+                         uint64_t a3, uint64_t a4, uint64_t a5) {
+  PERCPU_INC(syscall_count);
+
+  if (sys_num >= SYSCALL_MAX || !syscall_table[sys_num].fn) {
     Graphics_Clear(0xEEE8D5);
     Graphics_Print(100, 100, "SYSCALL NOT IMPLEMENTED", 0x268BD2);
-    break;
-  }
+    Syscall_CurrentFrame()->rax = SYSCALL_ENOSYS;
+    return 0;
   }
+
+  uint64_t start = Cpu_ReadTSC();
+  const SyscallEntry *e = &syscall_table[sys_num];
+  uint64_t args[5] = {a1, a2, a3, a4, a5};
+  InterruptFrame *next = NULL;
+
+  uint64_t ret = Syscall_CheckArgs(e, args);
+  if (ret == 0)
+    ret = e->fn(args, &next);
+
+  Syscall_Account(sys_num, ret, Cpu_ReadTSC() - start);
+
+  if (next)
+    return (uint64_t)next; // syscall_entry switches to this frame
+  Syscall_CurrentFrame()->rax = ret;
   return 0; // 0 means no context switch, return normally via sysretq
 }
@@ -7,11 +7,20 @@
 #define MSR_STAR 0xC0000081
 #define MSR_LSTAR 0xC0000082
 #define MSR_SFMASK 0xC0000084
+#define MSR_GS_BASE 0xC0000101
 #define MSR_KERNEL_GS_BASE 0xC0000102
+#define MSR_TSC_AUX 0xC0000103
 
 #define EFER_SCE 1 // System Call Extensions
 
 void Syscall_Init();
+void MSR_Write(uint32_t msr, uint64_t val);
+uint64_t MSR_Read(uint32_t msr);
+
+// Prints to the text console used by SYSCALL_PRINT
+void Syscall_ConsolePrint(const char *str, uint32_t color);
+// Same for a string in user memory. Returns 0 or SYSCALL_EFAULT.
+uint64_t Syscall_PrintUser(const char *user_str, uint32_t color);
 
 // Known Sycalls
 #define SYSCALL_CLEAR 0
@@ -23,5 +32,42 @@ void Syscall_Init();
 #define SYSCALL_NVME_WRITE 6
 #define SYSCALL_KMALLOC 7
 #define SYSCALL_KFREE 8
+#define SYSCALL_FUTEX_WAIT 9
+#define SYSCALL_FUTEX_WAKE 10
+#define SYSCALL_TASK_STATS 11
+#define SYSCALL_SCHED_TRACE 12
+#define SYSCALL_SET_AFFINITY 13
+#define SYSCALL_YIELD 14
+#define SYSCALL_URING_SETUP 15
+#define SYSCALL_URING_ENTER 16
+#define SYSCALL_STATS 17
+#define SYSCALL_EXEC_ELF 18
+#define SYSCALL_IRQ_STATS 19
+#define SYSCALL_BCACHE_STATS 20
+#define SYSCALL_LOCK_STATS 21
+#define SYSCALL_MAX 22
+
+// SYSCALL_LOCK_STATS index that clears every class's counters
+#define LOCK_STATS_RESET ((uint64_t)-1)
+
+// Error returns (negative, Linux style)
+#define SYSCALL_EIO ((uint64_t)-5)
+#define SYSCALL_EAGAIN ((uint64_t)-11)
+#define SYSCALL_ENOMEM ((uint64_t)-12)
+#define SYSCALL_EFAULT ((uint64_t)-14)
+#define SYSCALL_EINVAL ((uint64_t)-22)
+#define SYSCALL_ENOSYS ((uint64_t)-38)
+
+// Per-syscall statistics (SYSCALL_STATS). Bucket n of the histogram counts
+// calls that took [2^n, 2^(n+1)) TSC cycles; the last bucket takes the rest.
+#define SYSCALL_HIST_BUCKETS 32
+
+typedef struct {
+  uint64_t calls;
+  uint64_t errors; // Calls that returned a SYSCALL_E* value
+  uint64_t total_cycles;
+  uint64_t max_cycles;
+  uint64_t histogram[SYSCALL_HIST_BUCKETS];
+} SyscallStats;
 
 #endif
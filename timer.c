@@ -1,15 +1,25 @@
 #include "timer.h"
 #include "apic.h"
+#include "softirq.h"
+#include "vdso.h"
+#include "workqueue.h"
 #include <stddef.h>
 
 static uint64_t g_ticks = 0;
 
-void Timer_Handler(InterruptFrame **frame) {
-  (void)frame;
+int Timer_Handler(uint8_t vector) {
+  (void)vector;
   g_ticks++;
+  Vdso_Tick(g_ticks);
   LAPIC_SendEOI();
+  Softirq_Raise(SOFTIRQ_TIMER);
+  return 0;
 }
 
+// Delayed work expiry, off the hard-IRQ path. A late run still sees every
+// expired item: the list is checked against the current tick count.
+void Timer_Softirq(void) { Workqueue_Tick(g_ticks); }
+
 uint64_t Timer_GetTicks() { return g_ticks; }
 
 // Sleep for specified milliseconds
@@ -4,7 +4,10 @@
 #include "interrupt.h"
 #include <stdint.h>
 
-void Timer_Handler(InterruptFrame **frame);
+// Fast handler for INT_TIMER (see Interrupt_RegisterFastHandler)
+int Timer_Handler(uint8_t vector);
+// SOFTIRQ_TIMER handler
+void Timer_Softirq(void);
 void Timer_Sleep(uint64_t ms);
 uint64_t Timer_GetTicks();
 
@@ -0,0 +1,297 @@
+#include "uring.h"
+#include "bcache.h"
+#include "cpu.h"
+#include "futex.h"
+#include "libc.h"
+#include "memory.h"
+#include "nvme.h"
+#include "schedule.h"
+#include "spinlock.h"
+#include "syscall.h"
+#include "usercopy.h"
+#include "workqueue.h"
+#include <stddef.h>
+
+#define URING_RING_PAGES ((sizeof(UringRings) + PAGE_SIZE - 1) / PAGE_SIZE)
+
+// An operation in flight
+typedef struct UringRequest {
+  struct Uring *ring;
+  UringSqe sqe; // Private copy, user mode may reuse the slot right away
+  WorkItem work;
+  FutexWaiter futex;
+  NVMe_Request nvme;   // Command of the NVMe piece in flight
+  uint32_t nvme_done;  // LBAs transferred by the earlier pieces
+  uint32_t nvme_count; // LBAs of the piece in flight
+  struct UringRequest *next_free;
+} UringRequest;
+
+typedef struct Uring {
+  UringRings *rings;
+  int task;
+  Spinlock lock;          // Completion side: cq_tail, free list, waiting
+  uint32_t in_flight;     // Started but not yet posted
+  uint32_t wait_nr;       // Completions the task sleeps for, 0 if awake
+  // NVMe operations started but not yet posted
+  volatile uint32_t nvme_in_flight;
+  UringRequest reqs[URING_SQ_ENTRIES];
+  UringRequest *free_list;
+} Uring;
+
+static Uring *rings_by_task[MAX_TASKS];
+static LockClass uring_lock_class = LOCK_CLASS_INIT("uring");
+
+static uint32_t Uring_Ready(Uring *ring) {
+  return ring->rings->cq_tail - ring->rings->cq_head;
+}
+
+// Posts the result of 'req' and recycles it. Safe from any context.
+static void Uring_Complete(UringRequest *req, int64_t res) {
+  Uring *ring = req->ring;
+  UringRings *r = ring->rings;
+
+  uint64_t flags = Spinlock_LockIrqSave(&ring->lock);
+  if (r->cq_tail - r->cq_head < URING_CQ_ENTRIES) {
+    UringCqe *cqe = &r->cq[r->cq_tail & (URING_CQ_ENTRIES - 1)];
+    cqe->user_data = req->sqe.user_data;
+    cqe->res = res;
+    __atomic_store_n(&r->cq_tail, r->cq_tail + 1, __ATOMIC_RELEASE);
+  } else {
+    r->cq_overflow++;
+  }
+
+  ring->in_flight--;
+  req->next_free = ring->free_list;
+  ring->free_list = req;
+
+  if (ring->wait_nr && Uring_Ready(ring) >= ring->wait_nr) {
+    ring->wait_nr = 0;
+    Scheduler_Wake(ring->task);
+  }
+  Spinlock_UnlockIrqRestore(&ring->lock, flags);
+}
+
+// --- Asynchronous operations ---
+
+// NVMe operations go straight to the device, one command per piece of at
+// most NVMe_GetMaxTransfer bytes, each piece submitted from the completion
+// callback of the previous one. Every SQE of a batch is in flight at once.
+
+// 1 if every page of the user buffer is mapped. Below USER_IDENTITY_LIMIT
+// the address is also the physical one, so the device can be pointed at it.
+static int Uring_BufferMapped(uint64_t addr, uint64_t len) {
+  uint64_t want = PAGE_PRESENT | PAGE_USER;
+  for (uint64_t page = addr & ~(uint64_t)(PAGE_SIZE - 1); page < addr + len;
+       page += PAGE_SIZE) {
+    if ((PageTable_Lookup(g_kernel_pml4, (void *)page) & want) != want)
+      return 0;
+  }
+  return 1;
+}
+
+// Posts the result of an NVMe operation. Blocks written behind the cache
+// are dropped from it, also after a failure that may have written some.
+static void Uring_NVMeFinish(UringRequest *req, int64_t res) {
+  UringSqe *sqe = &req->sqe;
+  if (sqe->opcode == URING_OP_NVME_WRITE)
+    BCache_Invalidate(sqe->nsid, sqe->off, sqe->len);
+  __atomic_fetch_sub(&req->ring->nvme_in_flight, 1, __ATOMIC_RELEASE);
+  Uring_Complete(req, res);
+}
+
+static void Uring_NVMeDone(NVMe_Request *nreq, void *arg);
+
+// Submits the next piece. Returns 0, or -1 if the driver refused it.
+static int Uring_NVMeSubmit(UringRequest *req) {
+  UringSqe *sqe = &req->sqe;
+  uint32_t block_size = NVMe_GetBlockSize();
+  uint32_t max = NVMe_GetMaxTransfer() / block_size;
+  uint32_t count = sqe->len - req->nvme_done;
+  if (count > max)
+    count = max;
+  req->nvme_count = count;
+
+  uint64_t lba = sqe->off + req->nvme_done;
+  void *buf = (uint8_t *)sqe->addr + (uint64_t)req->nvme_done * block_size;
+  if (sqe->opcode == URING_OP_NVME_READ)
+    return NVMe_SubmitRead(sqe->nsid, lba, buf, count, &req->nvme,
+                           Uring_NVMeDone, req);
+  return NVMe_SubmitWrite(sqe->nsid, lba, buf, count, &req->nvme,
+                          Uring_NVMeDone, req);
+}
+
+// Completion callback of a piece: starts the next one or posts the result
+static void Uring_NVMeDone(NVMe_Request *nreq, void *arg) {
+  UringRequest *req = (UringRequest *)arg;
+  if (nreq->Status) {
+    Uring_NVMeFinish(req, (int64_t)SYSCALL_EIO);
+    return;
+  }
+  req->nvme_done += req->nvme_count;
+  if (req->nvme_done == req->sqe.len)
+    Uring_NVMeFinish(req, 0);
+  else if (Uring_NVMeSubmit(req) != 0)
+    Uring_NVMeFinish(req, (int64_t)SYSCALL_EIO);
+}
+
+static void Uring_TimerWork(void *arg) { Uring_Complete(arg, 0); }
+
+static void Uring_FutexWake(FutexWaiter *w) {
+  UringRequest *req =
+      (UringRequest *)((uint8_t *)w - offsetof(UringRequest, futex));
+  Uring_Complete(req, 0);
+}
+
+// Starts one operation. Quick ones complete right here.
+static void Uring_Start(UringRequest *req) {
+  UringSqe *sqe = &req->sqe;
+
+  switch (sqe->opcode) {
+  case URING_OP_NOP:
+    Uring_Complete(req, 0);
+    break;
+  case URING_OP_NVME_READ:
+  case URING_OP_NVME_WRITE: {
+    // len is in namespace LBAs; the buffer must be dword aligned
+    uint64_t bytes = (uint64_t)sqe->len * NVMe_GetBlockSize();
+    if (!sqe->addr || bytes == 0 || !User_DmaOk((void *)sqe->addr, bytes)) {
+      Uring_Complete(req, (int64_t)SYSCALL_EINVAL);
+      break;
+    }
+    if (!Uring_BufferMapped(sqe->addr, bytes)) {
+      Uring_Complete(req, (int64_t)SYSCALL_EFAULT);
+      break;
+    }
+    // The device is accessed behind the cache, so changes still cached
+    // must reach it first
+    if (BCache_Flush(sqe->nsid) != 0) {
+      Uring_Complete(req, (int64_t)SYSCALL_EIO);
+      break;
+    }
+    req->nvme_done = 0;
+    __atomic_fetch_add(&req->ring->nvme_in_flight, 1, __ATOMIC_RELAXED);
+    if (Uring_NVMeSubmit(req) != 0)
+      Uring_NVMeFinish(req, (int64_t)SYSCALL_EINVAL);
+    break;
+  }
+  case URING_OP_PRINT:
+    Uring_Complete(req, (int64_t)Syscall_PrintUser((const char *)sqe->addr,
+                                                   (uint32_t)sqe->off));
+    break;
+  case URING_OP_SLEEP:
+    Work_Init(&req->work, Uring_TimerWork, req);
+    Workqueue_QueueDelayed(&req->work, sqe->off);
+    break;
+  case URING_OP_FUTEX_WAIT: {
+    if (!sqe->addr || (sqe->addr & 3)) {
+      Uring_Complete(req, (int64_t)SYSCALL_EINVAL);
+      break;
+    }
+    req->futex.wake = Uring_FutexWake;
+    int queued = Futex_WaitAsync((uint32_t *)sqe->addr, (uint32_t)sqe->off,
+                                 &req->futex);
+    if (queued <= 0)
+      Uring_Complete(req, queued < 0 ? (int64_t)SYSCALL_EFAULT
+                                     : (int64_t)SYSCALL_EAGAIN);
+    break;
+  }
+  case URING_OP_FUTEX_WAKE:
+    if (!sqe->addr || (sqe->addr & 3)) {
+      Uring_Complete(req, (int64_t)SYSCALL_EINVAL);
+      break;
+    }
+    Uring_Complete(req, Futex_Wake((uint32_t *)sqe->addr, (int)sqe->len));
+    break;
+  default:
+    Uring_Complete(req, (int64_t)SYSCALL_EINVAL);
+    break;
+  }
+}
+
+UringRings *Uring_Setup() {
+  int task = Scheduler_GetCurrentTask();
+  if (rings_by_task[task])
+    return rings_by_task[task]->rings;
+
+  Uring *ring = (Uring *)kmalloc(sizeof(Uring));
+  if (!ring)
+    return NULL;
+  UringRings *rings = (UringRings *)PageAllocator_Alloc(URING_RING_PAGES);
+  if (!rings) {
+    kfree(ring);
+    return NULL;
+  }
+  memset(rings, 0, sizeof(UringRings));
+  memset(ring, 0, sizeof(Uring));
+
+  ring->rings = rings;
+  ring->task = task;
+  Spinlock_Init(&ring->lock, &uring_lock_class);
+  for (int i = URING_SQ_ENTRIES - 1; i >= 0; i--) {
+    ring->reqs[i].ring = ring;
+    ring->reqs[i].next_free = ring->free_list;
+    ring->free_list = &ring->reqs[i];
+  }
+
+  rings_by_task[task] = ring;
+  return rings;
+}
+
+int Uring_Submit() {
+  Uring *ring = rings_by_task[Scheduler_GetCurrentTask()];
+  if (!ring)
+    return -1;
+  UringRings *r = ring->rings;
+
+  int submitted = 0;
+  uint32_t tail = __atomic_load_n(&r->sq_tail, __ATOMIC_ACQUIRE);
+  while (r->sq_head != tail) {
+    // Only start what is guaranteed a CQ slot, so completions never
+    // overflow. The rest stays queued for the next enter.
+    uint64_t flags = Spinlock_LockIrqSave(&ring->lock);
+    UringRequest *req = ring->free_list;
+    if (!req || Uring_Ready(ring) + ring->in_flight >= URING_CQ_ENTRIES) {
+      Spinlock_UnlockIrqRestore(&ring->lock, flags);
+      break;
+    }
+    ring->free_list = req->next_free;
+    ring->in_flight++;
+    Spinlock_UnlockIrqRestore(&ring->lock, flags);
+
+    req->sqe = r->sq[r->sq_head & (URING_SQ_ENTRIES - 1)];
+    __atomic_store_n(&r->sq_head, r->sq_head + 1, __ATOMIC_RELEASE);
+    Uring_Start(req);
+    submitted++;
+  }
+  return submitted;
+}
+
+int Uring_Wait(uint32_t min_complete) {
+  Uring *ring = rings_by_task[Scheduler_GetCurrentTask()];
+  if (!ring || min_complete == 0)
+    return 0;
+  if (min_complete > URING_CQ_ENTRIES)
+    min_complete = URING_CQ_ENTRIES;
+
+  // Don't sleep if the wait is already satisfied, or if everything still in
+  // flight could never satisfy it. NVMe commands on a queue without an
+  // interrupt only complete when it is polled, so wait for those here.
+  uint64_t flags;
+  while (1) {
+    NVMe_Poll();
+    flags = Spinlock_LockIrqSave(&ring->lock);
+    if (Uring_Ready(ring) >= min_complete ||
+        Uring_Ready(ring) + ring->in_flight < min_complete) {
+      Spinlock_UnlockIrqRestore(&ring->lock, flags);
+      return 0;
+    }
+    if (!ring->nvme_in_flight || NVMe_HasInterrupt())
+      break;
+    Spinlock_UnlockIrqRestore(&ring->lock, flags);
+    Cpu_Pause();
+  }
+  ring->wait_nr = min_complete;
+  Scheduler_Block();
+  Spinlock_UnlockIrqRestore(&ring->lock, flags);
+  return 1;
+}
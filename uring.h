@@ -0,0 +1,72 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+
+// Shared submission/completion rings (io_uring style). A task gets its rings
+// from SYSCALL_URING_SETUP, fills SQEs and advances sq_tail, then calls
+// SYSCALL_URING_ENTER once for the whole batch. Results show up in the CQ as
+// operations finish; NVMe, sleep and futex wait complete asynchronously.
+// NVMe operations are submitted to the device as they are consumed, all of a
+// batch in flight at once, and transfer straight to or from the user buffer
+// (dword aligned, every page mapped), bypassing the block cache.
+#define URING_SQ_ENTRIES 64
+#define URING_CQ_ENTRIES 128
+
+// Opcodes
+#define URING_OP_NOP 0
+#define URING_OP_NVME_READ 1  // nsid, addr = buffer, off = LBA, len = blocks
+#define URING_OP_NVME_WRITE 2 // nsid, addr = buffer, off = LBA, len = blocks
+#define URING_OP_PRINT 3      // addr = string, off = color
+#define URING_OP_SLEEP 4      // off = milliseconds
+#define URING_OP_FUTEX_WAIT 5 // addr = uint32_t *, off = expected value
+#define URING_OP_FUTEX_WAKE 6 // addr = uint32_t *, len = max waiters
+
+// Submission queue entry - 64 bytes
+typedef struct {
+  uint8_t opcode;
+  uint8_t flags;
+  uint16_t reserved;
+  uint32_t nsid;
+  uint64_t addr;
+  uint64_t off;
+  uint32_t len;
+  uint32_t reserved2;
+  uint64_t user_data; // Copied to the completion
+  uint64_t pad[3];
+} UringSqe;
+
+// Completion queue entry - 16 bytes
+typedef struct {
+  uint64_t user_data;
+  int64_t res; // >= 0 on success, negative SYSCALL_E* value on error
+} UringCqe;
+
+// The shared area. User mode owns sq_tail and cq_head, the kernel owns
+// sq_head and cq_tail. Indices are free running; mask with the ring size.
+typedef struct {
+  volatile uint32_t sq_head;
+  volatile uint32_t sq_tail;
+  volatile uint32_t cq_head;
+  volatile uint32_t cq_tail;
+  volatile uint32_t cq_overflow; // Completions dropped because the CQ was full
+  uint32_t reserved[11];
+  UringSqe sq[URING_SQ_ENTRIES];
+  UringCqe cq[URING_CQ_ENTRIES];
+} UringRings;
+
+#ifndef URING_USER
+// Allocates (once) the rings of the current task. Returns NULL on failure.
+UringRings *Uring_Setup();
+
+// Starts every queued SQE the kernel has room for and returns the number
+// consumed, or -1 if the task has no rings.
+int Uring_Submit();
+
+// Marks the current task blocked if fewer than 'min_complete' completions
+// are waiting. Returns 1 if the caller must now sleep
+// (Scheduler_SleepFromSyscall).
+int Uring_Wait(uint32_t min_complete);
+#endif
+
+#endif
@@ -0,0 +1,58 @@
+#include "usercopy.h"
+
+// usercopy.S
+extern uint64_t usercopy_raw(void *dst, const void *src, uint64_t n);
+extern int64_t usercopy_strncpy_raw(char *dst, const char *src, uint64_t n);
+
+typedef struct {
+  uint64_t insn;  // RIP of an instruction that may fault
+  uint64_t fixup; // Where to continue if it does
+} UsercopyFixup;
+
+extern const UsercopyFixup usercopy_fixup_start[];
+extern const UsercopyFixup usercopy_fixup_end[];
+
+uint64_t copy_from_user(void *dst, const void *user_src, uint64_t n) {
+  if (!User_RangeOk(user_src, n))
+    return n;
+  return usercopy_raw(dst, user_src, n);
+}
+
+uint64_t copy_to_user(void *user_dst, const void *src, uint64_t n) {
+  if (!User_RangeOk(user_dst, n))
+    return n;
+  return usercopy_raw(user_dst, src, n);
+}
+
+int64_t strncpy_from_user(char *dst, const char *user_src, uint64_t n) {
+  if (n == 0)
+    return -1;
+  // Clamp rather than reject, the string usually ends well before n
+  uint64_t max = n - 1;
+  uint64_t a = (uint64_t)user_src;
+  if (a >= USER_ADDR_LIMIT)
+    return -1;
+  if (max > USER_ADDR_LIMIT - a)
+    max = USER_ADDR_LIMIT - a;
+
+  int64_t len = usercopy_strncpy_raw(dst, user_src, max);
+  if (len < 0)
+    return -1;
+  dst[len] = 0;
+  return len;
+}
+
+int Usercopy_Fixup(InterruptFrame *frame) {
+  // Only #GP (non-canonical) and #PF can come from a user access
+  if ((frame->cs & 3) != 0 || (frame->int_no != 13 && frame->int_no != 14))
+    return 0;
+
+  for (const UsercopyFixup *f = usercopy_fixup_start; f < usercopy_fixup_end;
+       f++) {
+    if (f->insn == frame->rip) {
+      frame->rip = f->fixup;
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,41 @@
+#ifndef USERCOPY_H
+#define USERCOPY_H
+
+#include "interrupt.h"
+#include <stdint.h>
+
+// User pointers must lie below this (the lower canonical half)
+#define USER_ADDR_LIMIT 0x0000800000000000ULL
+
+// [addr, addr + len) is below USER_ADDR_LIMIT and does not wrap. A single
+// test: any of the three values reaching bit 47 means the range is bad.
+static inline int User_RangeOk(const void *addr, uint64_t len) {
+  uint64_t a = (uint64_t)addr;
+  return ((a | len | (a + len)) & ~(USER_ADDR_LIMIT - 1)) == 0;
+}
+
+// Below this, user memory is identity mapped, so a user buffer can be handed
+// to a device by address. Demand-paged ELF images live above it.
+#define USER_IDENTITY_LIMIT 0x0000600000000000ULL
+
+static inline int User_DmaOk(const void *addr, uint64_t len) {
+  uint64_t a = (uint64_t)addr;
+  return a < USER_IDENTITY_LIMIT && len <= USER_IDENTITY_LIMIT - a;
+}
+
+// Copy between user and kernel memory. A bad user address returns an
+// error instead of faulting the kernel. Return the number of bytes not
+// copied (0 on success).
+uint64_t copy_from_user(void *dst, const void *user_src, uint64_t n);
+uint64_t copy_to_user(void *user_dst, const void *src, uint64_t n);
+
+// Copies a NUL terminated user string of at most n - 1 characters and
+// always terminates 'dst'. Returns the length copied, n - 1 if the string
+// was truncated, or -1 for a bad address.
+int64_t strncpy_from_user(char *dst, const char *user_src, uint64_t n);
+
+// Called by ExceptionHandler for faults taken in kernel mode. Returns 1 if
+// the fault hit a user access with a fixup; 'frame' then resumes there.
+int Usercopy_Fixup(InterruptFrame *frame);
+
+#endif
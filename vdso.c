@@ -0,0 +1,58 @@
+#include "vdso.h"
+#include "cpu.h"
+#include "libc.h"
+#include "memory.h"
+#include "percpu.h"
+
+_Static_assert(VDSO_MAX_CPUS == MAX_CPUS, "vDSO per-CPU slots");
+_Static_assert(sizeof(VdsoData) <= PAGE_SIZE, "VdsoData must fit in a page");
+
+// Written through the kernel's identity mapping; user space only has the
+// read-only alias at VDSO_DATA_ADDR.
+static VdsoData *g_vdso = NULL;
+
+void Vdso_Init(uint64_t tsc_hz) {
+  VdsoData *vdso = (VdsoData *)PageAllocator_Alloc(1);
+  if (!vdso || !g_kernel_pml4)
+    return;
+  memset(vdso, 0, PAGE_SIZE);
+
+  vdso->version = VDSO_VERSION;
+  vdso->tsc_hz = tsc_hz;
+  if (tsc_hz)
+    vdso->tsc_mult = (1000000000ULL << VDSO_TSC_SHIFT) / tsc_hz;
+  vdso->tsc_base = Cpu_ReadTSC();
+  for (int i = 0; i < VDSO_MAX_CPUS; i++)
+    vdso->cpu[i].task_id = -1;
+  vdso->cpu[Cpu_GetId()].task_id = Cpu_GetCurrentTask();
+
+  // Present + User, not writable
+  PageTable_Map(g_kernel_pml4, (void *)VDSO_DATA_ADDR, vdso, PAGE_USER);
+  asm volatile("invlpg (%0)" : : "r"(VDSO_DATA_ADDR) : "memory");
+  g_vdso = vdso;
+}
+
+void Vdso_Tick(uint64_t ticks) {
+  VdsoData *vdso = g_vdso;
+  if (!vdso)
+    return;
+
+  // Single writer (the boot CPU's timer), so no lock around the seqlock
+  uint64_t now = Cpu_ReadTSC();
+  vdso->seq++;
+  asm volatile("" ::: "memory");
+  // Rebase so the multiply in readers cannot overflow
+  vdso->base_ns += ((now - vdso->tsc_base) * vdso->tsc_mult) >> VDSO_TSC_SHIFT;
+  vdso->tsc_base = now;
+  vdso->ticks = ticks;
+  asm volatile("" ::: "memory");
+  vdso->seq++;
+}
+
+void Vdso_SetTask(uint32_t cpu, int task_id) {
+  VdsoData *vdso = g_vdso;
+  if (!vdso || cpu >= VDSO_MAX_CPUS)
+    return;
+  vdso->cpu[cpu].task_id = task_id;
+  vdso->cpu[cpu].switches++;
+}
@@ -0,0 +1,46 @@
+#ifndef VDSO_H
+#define VDSO_H
+
+#include <stdint.h>
+
+// Kernel data page mapped read-only into user space at VDSO_DATA_ADDR.
+// User code reads it through the helpers in vdso_user.h.
+#define VDSO_DATA_ADDR 0x00007FFF00000000ULL
+#define VDSO_MAX_CPUS 8
+#define VDSO_VERSION 1
+
+// Monotonic clock: ns = base_ns + ((tsc - tsc_base) * tsc_mult) >> tsc_shift
+#define VDSO_TSC_SHIFT 24
+
+typedef struct {
+  // Seqlock for the clock fields: odd while the kernel is writing them
+  volatile uint32_t seq;
+  uint32_t version; // VDSO_VERSION
+
+  uint64_t tsc_base; // TSC at the last update
+  uint64_t base_ns;  // Monotonic time at tsc_base
+  uint64_t tsc_mult;
+  uint64_t tsc_hz;
+  uint64_t ticks; // Timer ticks (1ms) since boot
+
+  // Indexed by the CPU number rdtscp returns (TSC_AUX). 'switches' changes
+  // on every context switch, so a task that sees the same value before and
+  // after reading 'task_id' on the same CPU was running the whole time.
+  struct {
+    volatile uint64_t switches;
+    volatile int32_t task_id;
+    uint32_t reserved;
+  } cpu[VDSO_MAX_CPUS];
+} VdsoData;
+
+#ifndef VDSO_USER
+// Allocates the page and maps it into user space. 'tsc_hz' comes from the
+// LAPIC timer calibration.
+void Vdso_Init(uint64_t tsc_hz);
+// Advances the clock and tick count. Called from the timer interrupt.
+void Vdso_Tick(uint64_t ticks);
+// Publishes the task now running on 'cpu'. Called on every context switch.
+void Vdso_SetTask(uint32_t cpu, int task_id);
+#endif
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef VDSO_USER_H
+#define VDSO_USER_H
+
+// User mode helpers for the kernel data page (vdso.h). No syscalls.
+#define VDSO_USER
+#include "vdso.h"
+
+static inline const volatile VdsoData *vdso_data(void) {
+  return (const volatile VdsoData *)VDSO_DATA_ADDR;
+}
+
+// TSC read that is not executed ahead of the loads before it
+static inline uint64_t vdso_rdtsc(void) {
+  uint32_t low, high;
+  asm volatile("lfence\n"
+               "rdtsc"
+               : "=a"(low), "=d"(high)
+               :
+               : "memory");
+  return ((uint64_t)high << 32) | low;
+}
+
+static inline uint32_t vdso_rdtscp_aux(void) {
+  uint32_t low, high, aux;
+  asm volatile("rdtscp\n"
+               "lfence"
+               : "=a"(low), "=d"(high), "=c"(aux)
+               :
+               : "memory");
+  return aux;
+}
+
+// Nanoseconds since boot
+static inline uint64_t vdso_clock_ns(void) {
+  const volatile VdsoData *d = vdso_data();
+  uint32_t seq;
+  uint64_t ns;
+  do {
+    seq = d->seq;
+    if (seq & 1) {
+      asm volatile("pause");
+      continue;
+    }
+    asm volatile("" ::: "memory");
+    uint64_t tsc = vdso_rdtsc();
+    uint64_t delta = tsc > d->tsc_base ? tsc - d->tsc_base : 0;
+    ns = d->base_ns + ((delta * d->tsc_mult) >> VDSO_TSC_SHIFT);
+    asm volatile("" ::: "memory");
+  } while ((seq & 1) || d->seq != seq);
+  return ns;
+}
+
+static inline uint64_t vdso_ticks(void) { return vdso_data()->ticks; }
+
+static inline uint32_t vdso_cpu_id(void) { return vdso_rdtscp_aux() & 0xFFF; }
+
+static inline int vdso_task_id(void) {
+  const volatile VdsoData *d = vdso_data();
+  while (1) {
+    uint32_t cpu = vdso_cpu_id();
+    if (cpu >= VDSO_MAX_CPUS)
+      return -1;
+    uint64_t switches = d->cpu[cpu].switches;
+    int task_id = d->cpu[cpu].task_id;
+    if (vdso_cpu_id() == cpu && d->cpu[cpu].switches == switches)
+      return task_id;
+  }
+}
+
+#endif
@@ -0,0 +1,166 @@
+#include "workqueue.h"
+#include "cpu.h"
+#include "memory.h"
+#include "percpu.h"
+#include "schedule.h"
+#include "timer.h"
+#include <stddef.h>
+
+typedef struct {
+  WorkItem *volatile head; // Lock-free LIFO of submitted work
+  int task;                // Worker thread task index
+} Worker;
+
+static Worker workers[MAX_CPUS];
+static int num_workers = 0;
+
+// Delayed work: submitters push onto 'delayed_incoming' (lock-free) and the
+// timer tick, the only consumer, keeps 'delayed_list' sorted by expiry.
+static WorkItem *volatile delayed_incoming = NULL;
+static WorkItem *delayed_list = NULL;
+
+static void Workqueue_Push(WorkItem *volatile *head, WorkItem *work) {
+  WorkItem *old = __atomic_load_n(head, __ATOMIC_RELAXED);
+  do {
+    work->next = old;
+  } while (!__atomic_compare_exchange_n(head, &old, work, 1, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED));
+}
+
+static Worker *Workqueue_Self() {
+  int task = Scheduler_GetCurrentTask();
+  for (int i = 0; i < num_workers; i++) {
+    if (workers[i].task == task)
+      return &workers[i];
+  }
+  return NULL;
+}
+
+static void Workqueue_WorkerMain() {
+  Worker *self = Workqueue_Self();
+
+  while (1) {
+    // Take the whole pending list in one go. We are marked blocked before
+    // looking, so a submitter that comes in afterwards will wake us.
+    uint64_t flags = Cpu_IrqSave();
+    Scheduler_Block();
+    WorkItem *list = __atomic_exchange_n(&self->head, NULL, __ATOMIC_ACQUIRE);
+    if (!list) {
+      Scheduler_Yield();
+      Cpu_IrqRestore(flags);
+      continue;
+    }
+    Scheduler_Wake(self->task);
+    Cpu_IrqRestore(flags);
+
+    // The stack hands items back newest first; reverse for FIFO order
+    WorkItem *fifo = NULL;
+    while (list) {
+      WorkItem *next = list->next;
+      list->next = fifo;
+      fifo = list;
+      list = next;
+    }
+
+    while (fifo) {
+      WorkItem *work = fifo;
+      fifo = fifo->next;
+
+      // Clear pending before running so the function may requeue itself
+      void (*fn)(void *) = work->fn;
+      void *arg = work->arg;
+      __atomic_store_n(&work->pending, 0, __ATOMIC_RELEASE);
+      fn(arg);
+    }
+  }
+}
+
+void Work_Init(WorkItem *work, void (*fn)(void *arg), void *arg) {
+  work->fn = fn;
+  work->arg = arg;
+  work->next = NULL;
+  work->expires = 0;
+  work->cpu = 0;
+  work->pending = 0;
+}
+
+void Workqueue_Init(int num_cpus) {
+  if (num_cpus > MAX_CPUS)
+    num_cpus = MAX_CPUS;
+
+  for (int i = 0; i < num_cpus; i++) {
+    void *stack = PageAllocator_Alloc(1);
+    if (!stack)
+      break;
+
+    workers[i].head = NULL;
+    workers[i].task = Scheduler_AddKernelThread(Workqueue_WorkerMain, stack);
+    if (workers[i].task < 0) {
+      PageAllocator_Free(stack, 1);
+      break;
+    }
+    num_workers++;
+  }
+}
+
+int Workqueue_QueueOn(int cpu, WorkItem *work) {
+  // Before the workers exist, run the work inline
+  if (num_workers == 0) {
+    work->fn(work->arg);
+    return 1;
+  }
+
+  if (__atomic_exchange_n(&work->pending, 1, __ATOMIC_ACQ_REL))
+    return 0;
+
+  if (cpu < 0 || cpu >= num_workers)
+    cpu = 0;
+  work->cpu = cpu;
+
+  Workqueue_Push(&workers[cpu].head, work);
+  Scheduler_Wake(workers[cpu].task);
+  return 1;
+}
+
+int Workqueue_Queue(WorkItem *work) {
+  return Workqueue_QueueOn(Cpu_GetId(), work);
+}
+
+int Workqueue_QueueDelayed(WorkItem *work, uint64_t delay_ms) {
+  if (delay_ms == 0)
+    return Workqueue_Queue(work);
+
+  if (__atomic_exchange_n(&work->pending, 1, __ATOMIC_ACQ_REL))
+    return 0;
+
+  // Timer ticks are 1ms (see LAPIC_TimerInit usage in main.c)
+  work->cpu = 0;
+  work->expires = Timer_GetTicks() + delay_ms;
+  Workqueue_Push(&delayed_incoming, work);
+  return 1;
+}
+
+void Workqueue_Tick(uint64_t now) {
+  if (num_workers == 0)
+    return;
+
+  // Move newly submitted delayed work into the sorted list
+  WorkItem *in = __atomic_exchange_n(&delayed_incoming, NULL, __ATOMIC_ACQUIRE);
+  while (in) {
+    WorkItem *next = in->next;
+    WorkItem **pos = &delayed_list;
+    while (*pos && (*pos)->expires <= in->expires)
+      pos = &(*pos)->next;
+    in->next = *pos;
+    *pos = in;
+    in = next;
+  }
+
+  // Hand expired items to their worker (they stay pending)
+  while (delayed_list && delayed_list->expires <= now) {
+    WorkItem *work = delayed_list;
+    delayed_list = work->next;
+    Workqueue_Push(&workers[work->cpu].head, work);
+    Scheduler_Wake(workers[work->cpu].task);
+  }
+}
@@ -0,0 +1,33 @@
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <stdint.h>
+
+// A unit of deferred work. The item is owned by the caller and must stay
+// valid until its function has started running.
+typedef struct WorkItem {
+  void (*fn)(void *arg);
+  void *arg;
+  struct WorkItem *next;
+  uint64_t expires;     // Timer tick at which delayed work becomes runnable
+  int cpu;              // Worker the item is queued on
+  volatile int pending; // Set while queued, cleared right before fn runs
+} WorkItem;
+
+void Work_Init(WorkItem *work, void (*fn)(void *arg), void *arg);
+
+// Starts one worker thread per CPU. Must run after Scheduler_Init.
+void Workqueue_Init(int num_cpus);
+
+// Queue work on the given CPU's worker (or the calling CPU for
+// Workqueue_Queue).
+// Safe from IRQ handlers and syscalls: submission is a lock-free push.
+// Returns 1 if queued, 0 if the item was already pending.
+int Workqueue_Queue(WorkItem *work);
+int Workqueue_QueueOn(int cpu, WorkItem *work);
+int Workqueue_QueueDelayed(WorkItem *work, uint64_t delay_ms);
+
+// Promotes expired delayed work. Called from the timer interrupt.
+void Workqueue_Tick(uint64_t now);
+
+#endif